@@ -4,7 +4,9 @@
 #include <stdio.h>
 #include <stdlib.h>
 
+#include <array>
 #include <vector>
+#include <chrono>
 #include <optional>
 #include <functional>
 #include <type_traits>
@@ -37,7 +39,14 @@ enum {
     CS_IDF_READONLY   = 1 << 3,
     CS_IDF_OVERRIDDEN = 1 << 4,
     CS_IDF_UNKNOWN    = 1 << 5,
-    CS_IDF_ARG        = 1 << 6
+    CS_IDF_ARG        = 1 << 6,
+    /* commands that may run on several states of one shared state at once */
+    CS_IDF_THREADSAFE = 1 << 7,
+    /* commands that never get at identifiers by name, only through the ones
+     * and the code they are given, so locals may stay off their aliases
+     * across calls of them
+     */
+    CS_IDF_NONAMES    = 1 << 8
 };
 
 struct cs_bcode;
@@ -69,7 +78,7 @@ private:
 OSTD_EXPORT bool cs_code_is_empty(cs_bcode *code);
 
 enum class cs_value_type {
-    Null = 0, Int, Float, String, Cstring, Code, Macro, Ident
+    Null = 0, Int, Float, String, Cstring, Code, Macro, Ident, Array, Dict
 };
 
 struct OSTD_EXPORT cs_value {
@@ -86,12 +95,20 @@ struct OSTD_EXPORT cs_value {
 
     void set_int(cs_int val);
     void set_float(cs_float val);
-    void set_str(cs_string val);
+    void set_str(ostd::string_range val);
     void set_null();
     void set_code(cs_bcode *val);
     void set_cstr(ostd::string_range val);
     void set_ident(cs_ident *val);
     void set_macro(ostd::string_range val);
+    /* copies the values, which are then shared by the copies of this one
+     * and never changed; anything that wants a string gets them as a list
+     */
+    void set_array(cs_const_value_r vals);
+    /* an empty dictionary; copies share it until one of them changes it,
+     * which then gets its own, and as a string it is a key/value list
+     */
+    void set_dict();
 
     cs_string get_str() const;
     ostd::string_range get_strr() const;
@@ -99,8 +116,22 @@ struct OSTD_EXPORT cs_value {
     cs_float get_float() const;
     cs_bcode *get_code() const;
     cs_ident *get_ident() const;
+    /* empty for values that are not arrays */
+    cs_const_value_r get_array() const;
     void get_val(cs_value &r) const;
 
+    /* lookups find nothing in values that are not dictionaries, changes
+     * make them into empty ones first
+     */
+    cs_value const *dict_get(ostd::string_range key) const;
+    void dict_set(ostd::string_range key, cs_value const &v);
+    bool dict_del(ostd::string_range key);
+    size_t dict_size() const;
+    /* entries in the order they were first set, starting with pos at 0 */
+    bool dict_next(
+        size_t &pos, ostd::string_range &key, cs_value const *&val
+    ) const;
+
     bool get_bool() const;
 
     void force_null();
@@ -111,9 +142,15 @@ struct OSTD_EXPORT cs_value {
     bool code_is_empty() const;
 
 private:
-    std::aligned_union_t<1, cs_int, cs_float, void *> p_stor;
-    size_t p_len;
+    friend struct cs_strman;
+    friend struct cs_list_index;
+
+    /* strings that fit are stored inline (p_sso being their length), longer
+     * ones live in refcounted immutable buffers shared between copies
+     */
+    std::aligned_union_t<2 * sizeof(void *), cs_int, cs_float, void *> p_stor;
     cs_value_type p_type;
+    unsigned char p_sso;
 };
 
 struct cs_ident_stack {
@@ -139,6 +176,7 @@ struct cs_command;
 struct OSTD_EXPORT cs_ident {
     friend struct cs_state;
     friend struct cs_shared_state;
+    friend struct cs_alias_internal;
 
     cs_ident() = delete;
     cs_ident(cs_ident const &) = delete;
@@ -311,7 +349,7 @@ struct cs_command: cs_ident {
 private:
     cs_command(
         ostd::string_range name, ostd::string_range args,
-        int numargs, cs_command_cb func
+        int numargs, cs_command_cb func, int flags
     );
 
     cs_string p_cargs;
@@ -320,6 +358,39 @@ private:
 };
 
 struct cs_identLink;
+struct cs_local_frame;
+struct cs_value_stack;
+struct cs_thread_state;
+struct cs_task_queue;
+struct cs_profiler;
+
+struct cs_profile_entry {
+    cs_ident *id;
+    size_t calls;
+    /* the outermost call of a recursion counts, the rest are part of it */
+    std::chrono::nanoseconds inclusive;
+    /* without the time spent in the calls it made */
+    std::chrono::nanoseconds exclusive;
+};
+
+/* counted only in builds with the VM_STATS option, otherwise all zero */
+struct cs_stats {
+    /* by the low byte of the instruction, its opcode and return type */
+    std::array<size_t, 256> ops{};
+    size_t instructions = 0;
+    /* of source into bytecode, whether of files, aliases or arguments */
+    size_t compilations = 0;
+    /* strings of values too long to be stored inline */
+    size_t string_allocs = 0;
+    /* idents looked up by name rather than through an interned string */
+    size_t lookups = 0;
+    size_t exceptions = 0;
+};
+
+/* the name of the instruction counted at the index in cs_stats::ops, or
+ * an empty range for the ones that are never emitted
+ */
+OSTD_EXPORT ostd::string_range cs_opcode_name(size_t op);
 
 enum {
     CsLibMath   = 1 << 0,
@@ -346,6 +417,22 @@ struct OSTD_EXPORT cs_state {
 
     cs_shared_state *p_state;
     cs_identLink *p_callstack = nullptr;
+    /* the innermost locals kept in slots */
+    cs_local_frame *p_locals = nullptr;
+    cs_value_stack *p_vstack = nullptr;
+    /* only on states made by new_thread, what they keep to themselves */
+    cs_thread_state *p_tstate = nullptr;
+    /* made by the first start_profile, kept until the state is gone */
+    cs_profiler *p_profiler = nullptr;
+    /* a break or continue on its way out to the loop it is for */
+    CsLoopState p_loopstate = CsLoopState::Normal;
+    /* how many loop bodies are running, for break and continue */
+    int p_inloop = 0;
+    /* how deep runs are nested, for the recursion limit */
+    int p_rundepth = 0;
+    /* instructions left of the budget, which is only kept when limited */
+    long long p_budget = 0;
+    bool p_limited = false;
 
     int identflags = 0;
 
@@ -369,19 +456,101 @@ struct OSTD_EXPORT cs_state {
     void swap(cs_state &s) {
         std::swap(p_state, s.p_state);
         std::swap(p_callstack, s.p_callstack);
+        std::swap(p_locals, s.p_locals);
+        std::swap(p_vstack, s.p_vstack);
+        std::swap(p_tstate, s.p_tstate);
+        std::swap(p_profiler, s.p_profiler);
+        std::swap(p_rundepth, s.p_rundepth);
+        std::swap(p_budget, s.p_budget);
+        std::swap(p_limited, s.p_limited);
+        std::swap(p_budgethook, s.p_budgethook);
+        std::swap(p_loopstate, s.p_loopstate);
         std::swap(identflags, s.identflags);
         std::swap(p_pstate, s.p_pstate);
         std::swap(p_inloop, s.p_inloop);
         std::swap(p_owner, s.p_owner);
         std::swap(p_callhook, s.p_callhook);
+        std::swap(p_tasks, s.p_tasks);
     }
 
+    /* a state sharing the idents of this one, to be used by another
+     * thread; any number of them may run code at the same time as this
+     * one does, under these rules:
+     *
+     * - idents may be created from any state; the tables behind them are
+     *   read without locking and only additions take a lock
+     * - aliases a thread state writes or pushes become its own copies,
+     *   made from the shared value on first write and gone with the state;
+     *   it does not see later changes to the shared value, and those must
+     *   not be made while threads may be reading it; arguments are always
+     *   the thread's own
+     * - numargs and the recursion limit are per state
+     * - variables are shared and not synchronized in any way
+     * - commands not flagged CS_IDF_THREADSAFE never run at the same time
+     *   as each other while thread states exist; the commands of the
+     *   library are flagged
+     * - the allocator must be safe to call from all of the threads
+     */
     cs_state new_thread();
 
+    /* tasks run code on coroutines of their own, each on a state made by
+     * new_thread; arguments, locals and loop variables stay on the task,
+     * while other alias assignments go to the shared aliases just like
+     * they do from this state; the yield and sleep commands suspend a
+     * task, and step resumes the ones that are ready in turn until the
+     * budget is used up, returning how many are left; with insns given,
+     * each task is also suspended once it has run that many instructions
+     * (see set_instruction_budget); an error ends the task that raised it
+     * and is rethrown from step
+     */
+    void spawn(cs_bcode *code);
+    void spawn(ostd::string_range code);
+    size_t step(
+        std::chrono::nanoseconds budget = std::chrono::nanoseconds::max(),
+        size_t insns = 0
+    );
+    size_t get_task_count() const;
+
     cs_hook_cb set_call_hook(cs_hook_cb func);
     cs_hook_cb const &get_call_hook() const;
     cs_hook_cb &get_call_hook();
 
+    /* with a budget set, the instructions run on this state count against
+     * it, and it is checked each time a run starts, which is at every call
+     * and loop iteration; once it is used up the budget hook is called,
+     * which may throw, set a new budget or clear it, and if that does not
+     * leave any to run on a cs_error is raised; the budget stays used up
+     * until it is set again, so a script cannot catch its way past it
+     */
+    void set_instruction_budget(size_t n);
+    void clear_instruction_budget();
+    std::optional<size_t> get_instruction_budget() const;
+
+    cs_hook_cb set_budget_hook(cs_hook_cb func);
+    cs_hook_cb const &get_budget_hook() const;
+    cs_hook_cb &get_budget_hook();
+
+    /* while profiling, every alias and command called on this state is
+     * timed, which costs two clock reads per call; other states, such as
+     * the ones of threads and tasks, are profiled on their own; the
+     * profile is sorted by exclusive time, and the folded form has a line
+     * for each call stack with the exclusive nanoseconds spent in it, as
+     * flame graph tools take it
+     */
+    void start_profile();
+    void stop_profile();
+    void clear_profile();
+    bool is_profiling() const;
+    std::vector<cs_profile_entry> get_profile() const;
+    cs_string get_profile_folded() const;
+
+    /* the statistics are of the whole process rather than of this state,
+     * as values do not know the state they belong to; each thread counts
+     * on its own, and clearing only moves the point they are counted from
+     */
+    static cs_stats get_stats();
+    static void clear_stats();
+
     void init_libs(int libs = CsLibAll);
 
     void clear_override(cs_ident &id);
@@ -404,7 +573,8 @@ struct OSTD_EXPORT cs_state {
     );
 
     cs_command *new_command(
-        ostd::string_range name, ostd::string_range args, cs_command_cb func
+        ostd::string_range name, ostd::string_range args, cs_command_cb func,
+        int flags = 0
     );
 
     cs_ident *get_ident(ostd::string_range name);
@@ -448,6 +618,19 @@ struct OSTD_EXPORT cs_state {
         return p_inloop;
     }
 
+    /* number of VM stack values in use and the most ever used at once */
+    size_t get_value_stack_depth() const;
+    size_t get_value_stack_peak() const;
+
+    /* run_file reuses the code of files that have not changed since,
+     * keeping up to the limit of files (256 by default, 0 keeps none)
+     */
+    size_t get_file_cache_hits() const;
+    size_t get_file_cache_misses() const;
+    size_t get_file_cache_limit() const;
+    void set_file_cache_limit(size_t n);
+    void clear_file_cache();
+
     std::optional<cs_string> run_file_str(ostd::string_range fname);
     std::optional<cs_int> run_file_int(ostd::string_range fname);
     std::optional<cs_float> run_file_float(ostd::string_range fname);
@@ -455,6 +638,15 @@ struct OSTD_EXPORT cs_state {
     bool run_file(ostd::string_range fname, cs_value &ret);
     bool run_file(ostd::string_range fname);
 
+    /* compiled code can be saved and loaded into any state that has the
+     * same commands and variables; the aliases it uses are created on load
+     */
+    cs_bcode_ref compile(
+        ostd::string_range code, ostd::string_range src_name = "<string>"
+    );
+    void save_code(cs_bcode *code, ostd::stream &s);
+    cs_bcode_ref load_code(ostd::stream &s);
+
     void set_alias(ostd::string_range name, cs_value v);
 
     void set_var_int(
@@ -496,12 +688,13 @@ private:
     OSTD_LOCAL void *alloc(void *ptr, size_t olds, size_t news);
 
     cs_gen_state *p_pstate = nullptr;
-    int p_inloop = 0;
     bool p_owner = false;
+    cs_task_queue *p_tasks = nullptr;
 
     char p_errbuf[512];
 
     cs_hook_cb p_callhook;
+    cs_hook_cb p_budgethook;
 };
 
 struct cs_stack_state_node {
@@ -583,7 +776,7 @@ private:
 };
 
 struct OSTD_EXPORT cs_stacked_value: cs_value {
-    cs_stacked_value(cs_ident *id = nullptr);
+    cs_stacked_value(cs_state &cs, cs_ident *id = nullptr);
     ~cs_stacked_value();
 
     cs_stacked_value(cs_stacked_value const &) = delete;
@@ -603,6 +796,7 @@ struct OSTD_EXPORT cs_stacked_value: cs_value {
     bool pop();
 
 private:
+    cs_state &p_cs;
     cs_alias *p_a;
     cs_ident_stack p_stack;
     bool p_pushed;
@@ -828,7 +1022,9 @@ private:
                 }
                 case cs_value_type::String:
                 case cs_value_type::Cstring:
-                case cs_value_type::Macro: {
+                case cs_value_type::Macro:
+                case cs_value_type::Array:
+                case cs_value_type::Dict: {
                     ostd::range_put_all(writer, vals[i].get_strr());
                     break;
                 }
@@ -12,6 +12,7 @@ namespace cscript {
     struct cs_value;
 
     using cs_value_r       = ostd::iterator_range<cs_value *>;
+    using cs_const_value_r = ostd::iterator_range<cs_value const *>;
     using cs_ident_r       = ostd::iterator_range<cs_ident **>;
     using cs_const_ident_r = ostd::iterator_range<cs_ident const **>;
 }
@@ -40,33 +40,18 @@ ostd::string_range cs_gen_state::read_macro_name() {
     return op.slice(0, &source[0] - &op[0]);
 }
 
-char cs_gen_state::skip_until(ostd::string_range chars) {
-    char c = current();
-    while (c && ostd::find(chars, c).empty()) {
-        next_char();
-        c = current();
-    }
-    return c;
-}
-
-char cs_gen_state::skip_until(char cf) {
-    char c = current();
-    while (c && (c != cf)) {
-        next_char();
-        c = current();
-    }
-    return c;
+char cs_gen_state::skip_until(cs_charset const &chars) {
+    skip_to(cs_scan_find(source.data(), source.data() + source.size(), chars));
+    return current();
 }
 
-static bool cs_is_hspace(char c) {
-    return (c == ' ') || (c == '\t') || (c == '\r');
-}
+/* where a line comment ends; a null stops scanning like the end does */
+static constexpr cs_charset cs_comment_end{"\0\n"};
 
 void cs_gen_state::skip_comments() {
+    static constexpr cs_charset hspace{" \t\r"};
     for (;;) {
-        for (char c = current(); cs_is_hspace(c); c = current()) {
-            next_char();
-        }
+        source = cs_scan_skip(source, hspace);
         if (current() == '\\') {
             char c = current(1);
             if ((c != '\r') && (c != '\n')) {
@@ -86,9 +71,8 @@ void cs_gen_state::skip_comments() {
         if ((current() != '/') || (current(1) != '/')) {
             return;
         }
-        while (current() != '\n') {
-            next_char();
-        }
+        /* a comment on the last line may run to the end of the source */
+        skip_until(cs_comment_end);
     }
 }
 
@@ -427,7 +411,7 @@ lookupid:
                         goto invalid;
                 }
             }
-            gs.gen_str(lookup, true);
+            gs.gen_name(lookup);
             break;
         }
     }
@@ -484,9 +468,11 @@ static bool compileblockstr(cs_gen_state &gs, ostd::string_range str, bool macro
     gs.code.reserve(gs.code.size() + str.size() / sizeof(uint32_t) + 1);
     char *buf = new char[(str.size() / sizeof(uint32_t) + 1) * sizeof(uint32_t)];
     int len = 0;
+    static constexpr cs_charset special{"\r/\"@]"};
+    static constexpr cs_charset newline{"\n"};
     while (!str.empty()) {
         char const *p = str.data();
-        str = ostd::find_one_of(str, ostd::string_range("\r/\"@]"));
+        str = cs_scan_find(str, special);
         memcpy(&buf[len], p, str.data() - p);
         len += str.data() - p;
         if (str.empty()) {
@@ -506,7 +492,7 @@ static bool compileblockstr(cs_gen_state &gs, ostd::string_range str, bool macro
             }
             case '/':
                 if (str[1] == '/') {
-                    str = ostd::find(str, '\n');
+                    str = cs_scan_find(str, newline);
                 } else {
                     buf[len++] = str.front();
                     str.pop_front();
@@ -575,7 +561,7 @@ lookupid:
                         break;
                 }
             }
-            gs.gen_str(lookup, true);
+            gs.gen_name(lookup);
             gs.code.push_back(CsCodeLookupMu);
 done:
             break;
@@ -589,7 +575,8 @@ static void compileblockmain(cs_gen_state &gs, int wordtype, int prevargs) {
     size_t curline = gs.current_line;
     int concs = 0;
     for (int brak = 1; brak;) {
-        switch (gs.skip_until("@\"/[]")) {
+        static constexpr cs_charset special{"\0@\"/[]"};
+        switch (gs.skip_until(special)) {
             case '\0':
                 throw cs_error(gs.cs, "missing \"]\"");
                 return;
@@ -599,7 +586,7 @@ static void compileblockmain(cs_gen_state &gs, int wordtype, int prevargs) {
             case '/':
                 gs.next_char();
                 if (gs.current() == '/') {
-                    gs.skip_until('\n');
+                    gs.skip_until(cs_comment_end);
                 }
                 break;
             case '[':
@@ -776,11 +763,18 @@ static bool compilearg(
                     compileblock(gs);
                     break;
                 }
-                case CsValWord:
-                    if (word) {
-                        *word = gs.get_str_dup();
+                case CsValWord: {
+                    /* an empty name is looked up when run, like the ones
+                     * made by code, as no ident has it
+                     */
+                    auto s = gs.get_str_dup();
+                    if (s.empty()) {
+                        gs.gen_str();
+                    } else if (word) {
+                        *word = std::move(s);
                     }
                     break;
+                }
                 case CsValAny:
                 case CsValString:
                     compileunescapestr(gs);
@@ -1086,6 +1080,48 @@ compilecomv:
     );
 }
 
+static struct {
+    char const *name;
+    int op;
+} const cs_math_ops[] = {
+    {"+", CsMathAdd}, {"-", CsMathSub}, {"*", CsMathMul},
+    {"div", CsMathDiv}, {"mod", CsMathMod},
+    {"=", CsMathEq}, {"!=", CsMathNe}, {"<", CsMathLt}, {">", CsMathGt},
+    {"<=", CsMathLe}, {">=", CsMathGe},
+    {"+f", CsMathAdd | CsMathFloat}, {"-f", CsMathSub | CsMathFloat},
+    {"*f", CsMathMul | CsMathFloat}, {"divf", CsMathDiv | CsMathFloat},
+    {"modf", CsMathMod | CsMathFloat},
+    {"=f", CsMathEq | CsMathFloat}, {"!=f", CsMathNe | CsMathFloat},
+    {"<f", CsMathLt | CsMathFloat}, {">f", CsMathGt | CsMathFloat},
+    {"<=f", CsMathLe | CsMathFloat}, {">=f", CsMathGe | CsMathFloat}
+};
+
+int cs_math_op(ostd::string_range name) {
+    for (auto &m: cs_math_ops) {
+        if (name == m.name) {
+            return m.op;
+        }
+    }
+    return -1;
+}
+
+static void compile_math(
+    cs_gen_state &gs, cs_command *id, bool &more, int rettype, int prevargs
+) {
+    compile_cmd(gs, id, more, rettype, prevargs);
+    /* the common two operand form needs no call into the library; the
+     * arguments are compiled as for the command, so only the call changes
+     */
+    uint32_t &op = gs.code.back();
+    if ((op & ~CsCodeRetMask) == (
+        CsCodeComV | (2 << 8) | (uint32_t(id->get_index()) << 13)
+    )) {
+        op = CsCodeMath | (op & CsCodeRetMask) |
+            (uint32_t(cs_math_op(id->get_name())) << 8) |
+            (uint32_t(id->get_index()) << 13);
+    }
+}
+
 static void compile_alias(cs_gen_state &gs, cs_alias *id, bool &more, int prevargs) {
     int numargs = 0;
     while (numargs < MaxArguments) {
@@ -1115,6 +1151,7 @@ static void compile_local(cs_gen_state &gs, bool &more, int prevargs) {
     if (more) {
         while ((more = compilearg(gs, CsValPop)));
     }
+    gs.locals.push_back(gs.code.size());
     gs.code.push_back(CsCodeLocal | (numargs << 8));
 }
 
@@ -1191,6 +1228,74 @@ static void compile_if(
     }
 }
 
+static void compile_loop(
+    cs_gen_state &gs, cs_command *id, bool &more, int prevargs, int rettype
+) {
+    int numargs = 0, numblocks = 0;
+    size_t blocks[3];
+    for (auto fmt = id->get_args(); !fmt.empty(); ++fmt) {
+        switch (*fmt) {
+            case 'r':
+                if (more) {
+                    more = compilearg(gs, CsValIdent, prevargs + numargs);
+                }
+                if (!more) {
+                    gs.gen_ident();
+                }
+                break;
+            case 'i':
+                if (more) {
+                    more = compilearg(gs, CsValInt, prevargs + numargs);
+                }
+                if (!more) {
+                    gs.gen_int();
+                }
+                break;
+            case 'e':
+                blocks[numblocks++] = gs.code.size();
+                if (more) {
+                    more = compilearg(gs, CsValCode, prevargs + numargs);
+                }
+                if (!more) {
+                    compileblock(gs);
+                }
+                break;
+        }
+        ++numargs;
+    }
+    blocks[numblocks] = gs.code.size();
+    /* the condition and body run inline when they are literal blocks */
+    uint32_t len = gs.code.size() - (blocks[0] + 1);
+    bool inl = (len < (1u << (32 - CsCodeLoopLen)));
+    for (int i = 0; inl && (i < numblocks); ++i) {
+        uint32_t blen = blocks[i + 1] - (blocks[i] + 1);
+        inl = (
+            (gs.code[blocks[i]] & ~CsCodeRetMask) == (CsCodeBlock | (blen << 8))
+        );
+    }
+    if (!inl) {
+        gs.code.push_back(
+            CsCodeCom | cs_ret_code(rettype) | (id->get_index() << 8)
+        );
+        return;
+    }
+    /* the suffix says which numbers come before the count; loop* is the
+     * odd one out, taking the step after the count
+     */
+    auto name = id->get_name();
+    uint32_t op = CsCodeLoop | cs_ret_code(rettype) | (len << CsCodeLoopLen);
+    if (numblocks > 1) {
+        op |= CsCodeLoopCond;
+    }
+    if (!ostd::find(name, '+').empty()) {
+        op |= CsCodeLoopOffset;
+    }
+    if (!ostd::find(name, '*').empty()) {
+        op |= (name == "loop*") ? CsCodeLoopStepLast : CsCodeLoopStep;
+    }
+    gs.code[blocks[0]] = op;
+}
+
 static void compile_and_or(
     cs_gen_state &gs, cs_ident *id, bool &more, int prevargs, int rettype
 ) {
@@ -1322,7 +1427,7 @@ static void compilestatements(cs_gen_state &gs, int rettype, int brak, int preva
                                     break;
                             }
                         }
-                        gs.gen_str(idname, true);
+                        gs.gen_name(idname);
                     }
                     more = compilearg(gs, CsValAny);
                     if (!more) {
@@ -1347,7 +1452,7 @@ noid:
             cs_ident *id = gs.cs.get_ident(idname);
             if (!id) {
                 if (!cs_check_num(idname)) {
-                    gs.gen_str(idname, true);
+                    gs.gen_name(idname);
                     goto noid;
                 }
                 switch (rettype) {
@@ -1419,6 +1524,18 @@ noid:
                     case CsIdOr:
                         compile_and_or(gs, id, more, prevargs, rettype);
                         break;
+                    case CsIdMath:
+                        compile_math(
+                            gs, static_cast<cs_command *>(id), more,
+                            rettype, prevargs
+                        );
+                        break;
+                    case CsIdLoop:
+                        compile_loop(
+                            gs, static_cast<cs_command *>(id), more,
+                            prevargs, rettype
+                        );
+                        break;
                     case CsIdIvar:
                         if (!(more = compilearg(gs, CsValInt, prevargs))) {
                             gs.code.push_back(CsCodePrint | (id->get_index() << 8));
@@ -1468,7 +1585,8 @@ endstatement:
         if (more) {
             while (compilearg(gs, CsValPop));
         }
-        switch (gs.skip_until(")];/\n")) {
+        static constexpr cs_charset special{"\0)];/\n"};
+        switch (gs.skip_until(special)) {
             case '\0':
                 if (gs.current() != brak) {
                     throw cs_error(gs.cs, "missing \"%c\"", char(brak));
@@ -1486,7 +1604,7 @@ endstatement:
             case '/':
                 gs.next_char();
                 if (gs.current() == '/') {
-                    gs.skip_until('\n');
+                    gs.skip_until(cs_comment_end);
                 }
                 goto endstatement;
             default:
@@ -1497,10 +1615,14 @@ endstatement:
 }
 
 void cs_gen_state::gen_main(ostd::string_range s, int ret_type) {
+    CS_STATS_INCR(compilations);
     source = s;
     code.push_back(CsCodeStart);
     compilestatements(*this, CsValAny);
     code.push_back(CsCodeExit | ((ret_type < CsValAny) ? (ret_type << CsCodeRet) : 0));
+    if (!locals.empty()) {
+        cs_code_locals(cs, code.data(), locals);
+    }
 }
 
 } /* namespace cscript */
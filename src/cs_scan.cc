@@ -0,0 +1,198 @@
+#include <cubescript/cubescript.hh>
+#include "cs_util.hh"
+
+#if defined(CS_SIMD_SCAN) && defined(__x86_64__) && \
+    (defined(__GNUC__) || defined(__clang__))
+#  define CS_SCAN_SSE2 1
+#  define CS_SCAN_AVX2 1
+#  include <immintrin.h>
+#endif
+
+namespace cscript {
+
+/* the scalar scanner finishes whatever the vector ones leave over and is
+ * the only one on targets without them
+ */
+template<bool Skip>
+static char const *cs_scan_scalar(
+    char const *beg, char const *end, cs_charset const &set
+) {
+    for (; beg != end; ++beg) {
+        if (set.has(*beg) != Skip) {
+            return beg;
+        }
+    }
+    return end;
+}
+
+#ifdef CS_SCAN_SSE2
+template<bool Skip>
+static char const *cs_scan_sse2(
+    char const *beg, char const *end, cs_charset const &set
+) {
+    __m128i chars[cs_charset::MaxChars];
+    for (size_t i = 0; i < set.p_len; ++i) {
+        chars[i] = _mm_set1_epi8(set.p_chars[i]);
+    }
+    for (; (end - beg) >= 16; beg += 16) {
+        __m128i blk = _mm_loadu_si128(reinterpret_cast<__m128i const *>(beg));
+        __m128i hit = _mm_setzero_si128();
+        for (size_t i = 0; i < set.p_len; ++i) {
+            hit = _mm_or_si128(hit, _mm_cmpeq_epi8(blk, chars[i]));
+        }
+        unsigned int mask = unsigned(_mm_movemask_epi8(hit));
+        if (Skip) {
+            mask ^= 0xFFFF;
+        }
+        if (mask) {
+            return beg + __builtin_ctz(mask);
+        }
+    }
+    return cs_scan_scalar<Skip>(beg, end, set);
+}
+#endif
+
+#ifdef CS_SCAN_AVX2
+/* with AVX2 the set is looked up by nibble with two shuffles per block,
+ * so the cost does not grow with the size of the set
+ */
+template<bool Skip>
+__attribute__((target("avx2")))
+static char const *cs_scan_avx2(
+    char const *beg, char const *end, cs_charset const &set
+) {
+    if (!set.p_lut) {
+        return cs_scan_sse2<Skip>(beg, end, set);
+    }
+    __m256i lo = _mm256_broadcastsi128_si256(
+        _mm_loadu_si128(reinterpret_cast<__m128i const *>(set.p_lo))
+    );
+    __m256i hi = _mm256_broadcastsi128_si256(
+        _mm_loadu_si128(reinterpret_cast<__m128i const *>(set.p_hi))
+    );
+    __m256i nib = _mm256_set1_epi8(0x0F);
+    for (; (end - beg) >= 32; beg += 32) {
+        __m256i blk = _mm256_loadu_si256(
+            reinterpret_cast<__m256i const *>(beg)
+        );
+        __m256i cls = _mm256_and_si256(
+            _mm256_shuffle_epi8(lo, _mm256_and_si256(blk, nib)),
+            _mm256_shuffle_epi8(
+                hi, _mm256_and_si256(_mm256_srli_epi16(blk, 4), nib)
+            )
+        );
+        /* bits set for the bytes not in the set */
+        unsigned int mask = unsigned(_mm256_movemask_epi8(
+            _mm256_cmpeq_epi8(cls, _mm256_setzero_si256())
+        ));
+        if (!Skip) {
+            mask = ~mask;
+        }
+        if (mask) {
+            return beg + __builtin_ctz(mask);
+        }
+    }
+    return cs_scan_sse2<Skip>(beg, end, set);
+}
+#endif
+
+static size_t cs_count_scalar(char const *beg, char const *end, char c) {
+    size_t ret = 0;
+    for (; beg != end; ++beg) {
+        ret += (*beg == c);
+    }
+    return ret;
+}
+
+#ifdef CS_SCAN_SSE2
+static size_t cs_count_sse2(char const *beg, char const *end, char c) {
+    size_t ret = 0;
+    __m128i cv = _mm_set1_epi8(c);
+    for (; (end - beg) >= 16; beg += 16) {
+        __m128i blk = _mm_loadu_si128(reinterpret_cast<__m128i const *>(beg));
+        ret += size_t(__builtin_popcount(
+            unsigned(_mm_movemask_epi8(_mm_cmpeq_epi8(blk, cv)))
+        ));
+    }
+    return ret + cs_count_scalar(beg, end, c);
+}
+#endif
+
+#ifdef CS_SCAN_AVX2
+__attribute__((target("avx2,popcnt")))
+static size_t cs_count_avx2(char const *beg, char const *end, char c) {
+    size_t ret = 0;
+    __m256i cv = _mm256_set1_epi8(c);
+    for (; (end - beg) >= 32; beg += 32) {
+        __m256i blk = _mm256_loadu_si256(
+            reinterpret_cast<__m256i const *>(beg)
+        );
+        ret += size_t(__builtin_popcount(
+            unsigned(_mm256_movemask_epi8(_mm256_cmpeq_epi8(blk, cv)))
+        ));
+    }
+    return ret + cs_count_sse2(beg, end, c);
+}
+#endif
+
+using cs_scan_fn = char const *(*)(
+    char const *, char const *, cs_charset const &
+);
+
+template<bool Skip>
+static cs_scan_fn cs_scan_pick() {
+#ifdef CS_SCAN_AVX2
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        return &cs_scan_avx2<Skip>;
+    }
+#endif
+#ifdef CS_SCAN_SSE2
+    return &cs_scan_sse2<Skip>;
+#else
+    return &cs_scan_scalar<Skip>;
+#endif
+}
+
+using cs_count_fn = size_t (*)(char const *, char const *, char);
+
+static cs_count_fn cs_count_pick() {
+#ifdef CS_SCAN_AVX2
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        return &cs_count_avx2;
+    }
+#endif
+#ifdef CS_SCAN_SSE2
+    return &cs_count_sse2;
+#else
+    return &cs_count_scalar;
+#endif
+}
+
+/* picked on first use rather than at load time, as a state could be made
+ * by another static initializer before ours have run
+ */
+char const *cs_scan_find_bulk(
+    char const *beg, char const *end, cs_charset const &set
+) {
+    static cs_scan_fn const scan = cs_scan_pick<false>();
+    return scan(beg, end, set);
+}
+
+char const *cs_scan_skip_bulk(
+    char const *beg, char const *end, cs_charset const &set
+) {
+    static cs_scan_fn const scan = cs_scan_pick<true>();
+    return scan(beg, end, set);
+}
+
+size_t cs_scan_count(char const *beg, char const *end, char c) {
+    if ((end - beg) < 16) {
+        return cs_count_scalar(beg, end, c);
+    }
+    static cs_count_fn const count = cs_count_pick();
+    return count(beg, end, c);
+}
+
+} /* namespace cscript */
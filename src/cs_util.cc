@@ -6,6 +6,14 @@
 
 namespace cscript {
 
+size_t cs_hash_str(ostd::string_range s) {
+    size_t h = size_t(14695981039346656037ULL);
+    for (char c: s) {
+        h = (h ^ static_cast<unsigned char>(c)) * size_t(1099511628211ULL);
+    }
+    return h;
+}
+
 static inline void p_skip_white(ostd::string_range &v) {
     while (!v.empty() && isspace(*v)) {
         ++v;
@@ -192,10 +200,15 @@ namespace util {
         if (str.empty() || (*str != '\"')) {
             return str;
         }
+        static constexpr cs_charset special{"\r\n\"^\\"};
         ostd::string_range orig = str;
         ++str;
         ++nl;
-        while (!str.empty()) {
+        for (;;) {
+            str = cs_scan_find(str, special);
+            if (str.empty()) {
+                break;
+            }
             switch (*str) {
                 case '\r':
                 case '\n':
@@ -223,7 +236,6 @@ namespace util {
                     continue;
                 }
             }
-            ++str;
         }
 end:
         nlines = nl;
@@ -239,8 +251,9 @@ end:
     OSTD_EXPORT ostd::string_range parse_word(
         cs_state &cs, ostd::string_range str
     ) {
+        static constexpr cs_charset delims{"\"/;()[] \t\r\n"};
         for (;;) {
-            str = ostd::find_one_of(str, ostd::string_range("\"/;()[] \t\r\n"));
+            str = cs_scan_find(str, delims);
             if (str.empty()) {
                 return str;
             }
@@ -280,20 +293,17 @@ end:
         return str;
     }
 
+    static constexpr cs_charset spaces{" \t\r\n"};
+    static constexpr cs_charset newline{"\n"};
+    static constexpr cs_charset brakchars{"\"/;()[]"};
+
     void list_parser::skip() {
         for (;;) {
-            while (!p_input.empty()) {
-                char c = *p_input;
-                if ((c == ' ') || (c == '\t') || (c == '\r') || (c == '\n')) {
-                    ++p_input;
-                } else {
-                    break;
-                }
-            }
+            p_input = cs_scan_skip(p_input, spaces);
             if ((p_input.size() < 2) || (p_input[0] != '/') || (p_input[1] != '/')) {
                 break;
             }
-            p_input = ostd::find(p_input, '\n');
+            p_input = cs_scan_find(p_input, newline);
         }
     }
 
@@ -317,9 +327,7 @@ end:
                 char btype = *p_quote;
                 int brak = 1;
                 for (;;) {
-                    p_input = ostd::find_one_of(
-                        p_input, ostd::string_range("\"/;()[]")
-                    );
+                    p_input = cs_scan_find(p_input, brakchars);
                     if (p_input.empty()) {
                         return true;
                     }
@@ -331,7 +339,7 @@ end:
                             break;
                         case '/':
                             if (!p_input.empty() && (*p_input == '/')) {
-                                p_input = ostd::find(p_input, '\n');
+                                p_input = cs_scan_find(p_input, newline);
                             }
                             break;
                         case '(':
@@ -382,4 +390,53 @@ endblock:
     }
 } /* namespace util */
 
+void cs_list_index::build(cs_state &cs, ostd::string_range list) {
+    char const *beg = list.data();
+    auto off = [beg, &list](ostd::string_range r) {
+        return r.data() ? size_t(r.data() - beg) : list.size();
+    };
+    util::list_parser p(cs, list);
+    while (p.parse()) {
+        ostd::string_range quote = p.get_raw_item(true), it = p.get_raw_item();
+        items.push_back(item{
+            off(quote), quote.size(), off(it), it.size(), off(p.get_input())
+        });
+    }
+    end = off(p.get_input());
+}
+
+int cs_list_index::find(
+    ostd::string_range list, ostd::string_range needle
+) const {
+    auto get = [&list](item const &it) {
+        return list.slice(it.item, it.item + it.item_len);
+    };
+    if (!p_searched.exchange(true, std::memory_order_relaxed)) {
+        for (size_t i = 0; i < items.size(); ++i) {
+            if (get(items[i]) == needle) {
+                return int(i);
+            }
+        }
+        return -1;
+    }
+    lookup *tbl = p_lookup.load(std::memory_order_acquire);
+    if (!tbl) {
+        auto *ntbl = new lookup;
+        ntbl->reserve(items.size());
+        for (size_t i = 0; i < items.size(); ++i) {
+            /* keeps the first one, like a scan would find */
+            ntbl->emplace(get(items[i]), int(i));
+        }
+        if (p_lookup.compare_exchange_strong(
+            tbl, ntbl, std::memory_order_acq_rel, std::memory_order_acquire
+        )) {
+            tbl = ntbl;
+        } else {
+            delete ntbl;
+        }
+    }
+    auto it = tbl->find(needle);
+    return (it != tbl->end()) ? it->second : -1;
+}
+
 } /* namespace cscript */
@@ -1,6 +1,8 @@
 #ifndef LIBCUBESCRIPT_CS_UTIL_HH
 #define LIBCUBESCRIPT_CS_UTIL_HH
 
+#include <atomic>
+#include <functional>
 #include <type_traits>
 #include <unordered_map>
 
@@ -22,6 +24,157 @@ cs_float cs_parse_float(
     ostd::string_range input, ostd::string_range *end = nullptr
 );
 
+/* FNV-1a; used for the string table and file cache, not cryptographic */
+size_t cs_hash_str(ostd::string_range s);
+
+/* a small set of bytes to scan text for; the scanners below look at 16 or
+ * 32 bytes at a time where the CPU allows, picking the code at runtime
+ */
+struct cs_charset {
+    static constexpr size_t MaxChars = 16;
+
+    /* taken as an array so that a set can include the null character */
+    template<size_t N>
+    constexpr cs_charset(char const (&chars)[N]) {
+        static_assert(N <= (MaxChars + 1), "too many characters in set");
+        unsigned char nhi = 0;
+        for (size_t i = 0; i < (N - 1); ++i) {
+            auto c = static_cast<unsigned char>(chars[i]);
+            p_chars[p_len++] = chars[i];
+            p_map[c] = true;
+            /* each distinct high nibble gets a bit, which is set for the
+             * low nibbles it goes with; a byte is in the set if the bits
+             * of its two nibbles overlap
+             */
+            if (!p_hi[c >> 4]) {
+                if (nhi == 8) {
+                    p_lut = false;
+                    continue;
+                }
+                p_hi[c >> 4] = static_cast<unsigned char>(1 << nhi++);
+            }
+            p_lo[c & 0xF] |= p_hi[c >> 4];
+        }
+    }
+
+    constexpr bool has(char c) const {
+        return p_map[static_cast<unsigned char>(c)];
+    }
+
+    char p_chars[MaxChars] = {};
+    size_t p_len = 0;
+    bool p_map[256] = {};
+    /* nibble tables for a shuffle based lookup, usable for sets with no
+     * more than 8 distinct high nibbles
+     */
+    unsigned char p_lo[16] = {};
+    unsigned char p_hi[16] = {};
+    bool p_lut = true;
+};
+
+/* the vectorized scanners, for at least 16 bytes */
+char const *cs_scan_find_bulk(
+    char const *beg, char const *end, cs_charset const &set
+);
+char const *cs_scan_skip_bulk(
+    char const *beg, char const *end, cs_charset const &set
+);
+
+/* the first byte in [beg, end) that is in the set, or end; most runs are
+ * only a few bytes long, so those are done before calling out to a scanner
+ */
+inline char const *cs_scan_find(
+    char const *beg, char const *end, cs_charset const &set
+) {
+    char const *pend = ((end - beg) > 4) ? (beg + 4) : end;
+    for (; beg != end; ++beg) {
+        if (set.has(*beg)) {
+            return beg;
+        }
+        if ((beg == pend) && ((end - beg) >= 16)) {
+            return cs_scan_find_bulk(beg, end, set);
+        }
+    }
+    return end;
+}
+
+/* the first byte in [beg, end) that is not in the set, or end */
+inline char const *cs_scan_skip(
+    char const *beg, char const *end, cs_charset const &set
+) {
+    char const *pend = ((end - beg) > 4) ? (beg + 4) : end;
+    for (; beg != end; ++beg) {
+        if (!set.has(*beg)) {
+            return beg;
+        }
+        if ((beg == pend) && ((end - beg) >= 16)) {
+            return cs_scan_skip_bulk(beg, end, set);
+        }
+    }
+    return end;
+}
+
+/* the number of times c occurs in [beg, end) */
+size_t cs_scan_count(char const *beg, char const *end, char c);
+
+inline ostd::string_range cs_scan_find(
+    ostd::string_range s, cs_charset const &set
+) {
+    return ostd::string_range{
+        cs_scan_find(s.data(), s.data() + s.size(), set), s.data() + s.size()
+    };
+}
+
+inline ostd::string_range cs_scan_skip(
+    ostd::string_range s, cs_charset const &set
+) {
+    return ostd::string_range{
+        cs_scan_skip(s.data(), s.data() + s.size(), set), s.data() + s.size()
+    };
+}
+
+/* where the items of a string parsed as a list are, as offsets into it;
+ * string buffers keep theirs, so indexing the same list again is O(1)
+ */
+struct cs_list_index {
+    /* shorter strings are quicker to parse again than to index */
+    static constexpr size_t MinSize = 64;
+
+    struct item {
+        size_t quote, quote_len; /* with the quotes or brackets */
+        size_t item, item_len;
+        size_t next; /* where the next item is looked for */
+    };
+
+    cs_vector<item> items;
+    size_t end = 0; /* where parsing stopped */
+
+    void build(cs_state &cs, ostd::string_range list);
+
+    /* position of the first item equal to needle or -1; a single lookup
+     * scans, later ones go through a table of the items built on demand
+     */
+    int find(ostd::string_range list, ostd::string_range needle) const;
+
+    /* the index of a long enough buffered string, built on first use;
+     * null for other values, which are parsed the usual way
+     */
+    static cs_list_index const *get(cs_state &cs, cs_value const &v);
+
+    cs_list_index() {}
+    cs_list_index(cs_list_index const &) = delete;
+    ~cs_list_index() {
+        delete p_lookup.load(std::memory_order_relaxed);
+    }
+
+private:
+    using lookup = cs_map<ostd::string_range, int>;
+
+    /* an index may be shared by threads, so the table is published once */
+    mutable std::atomic<lookup *> p_lookup{nullptr};
+    mutable std::atomic<bool> p_searched{false};
+};
+
 template<typename F>
 struct CsScopeExit {
     template<typename FF>
@@ -38,6 +191,16 @@ inline void cs_do_and_cleanup(F1 &&dof, F2 &&clf) {
     dof();
 }
 
+/* runs body over [0, n) in chunks, on the thread pool of the shared state
+ * and the calling thread at once; every thread gets a state of its own
+ * from new_thread, seeing the arguments and aliases cs does, and a body
+ * returning false stops the chunks not yet started; errors are rethrown
+ * on cs once all threads are done
+ */
+using cs_parallel_cb = std::function<bool(cs_state &, size_t, size_t)>;
+
+void cs_parallel_for(cs_state &cs, size_t n, cs_parallel_cb const &body);
+
 } /* namespace cscript */
 
 #endif /* LIBCUBESCRIPT_CS_UTIL_HH */
@@ -2,6 +2,9 @@
 #include "cs_vm.hh"
 #include "cs_util.hh"
 
+#include <new>
+#include <atomic>
+
 namespace cscript {
 
 template<typename T, typename U>
@@ -10,30 +13,362 @@ static inline T &csv_get(U &stor) {
     return const_cast<T &>(reinterpret_cast<T const &>(stor));
 }
 
+/* longest string stored inline, one byte is left for the terminator */
+static constexpr size_t CsSsoMax = 2 * sizeof(void *) - 1;
+/* p_sso of strings that are not inline: heap strings, cstrings, macros */
+static constexpr unsigned char CsSsoHeap = 0xFF;
+/* p_sso of strings pointing into the string table, which outlives them */
+static constexpr unsigned char CsSsoIntern = 0xFE;
+
+/* header of a refcounted string buffer, the characters follow it */
+struct cs_strbuf {
+    /* copies of a value may be dropped by different threads */
+    std::atomic<size_t> refc;
+    size_t len;
+    /* the buffer never changes, so neither does this once published */
+    std::atomic<cs_list_index *> list;
+
+    char *data() {
+        return reinterpret_cast<char *>(this + 1);
+    }
+};
+
+struct cs_strref {
+    char const *ptr;
+    size_t len;
+};
+
+static inline cs_strbuf *csv_strbuf(char const *data) {
+    return const_cast<cs_strbuf *>(
+        reinterpret_cast<cs_strbuf const *>(data) - 1
+    );
+}
+
+static char const *csv_strbuf_new(ostd::string_range s) {
+    CS_STATS_INCR(string_allocs);
+    void *mem = ::operator new(sizeof(cs_strbuf) + s.size() + 1);
+    cs_strbuf *buf = new (mem) cs_strbuf{1, s.size(), nullptr};
+    memcpy(buf->data(), s.data(), s.size());
+    buf->data()[s.size()] = '\0';
+    return buf->data();
+}
+
+static inline void csv_strbuf_unref(char const *data) {
+    cs_strbuf *buf = csv_strbuf(data);
+    if (buf->refc.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+        delete buf->list.load(std::memory_order_relaxed);
+        buf->~cs_strbuf();
+        ::operator delete(buf);
+    }
+}
+
+/* header of a refcounted array, the values follow it */
+struct cs_arraybuf {
+    std::atomic<size_t> refc;
+    size_t len;
+    /* a string buffer holding a ref, made the first time it is asked for */
+    std::atomic<char const *> str;
+
+    cs_value *data() {
+        return reinterpret_cast<cs_value *>(this + 1);
+    }
+};
+
+static_assert(sizeof(cs_arraybuf) % alignof(cs_value) == 0);
+
+static cs_arraybuf *csv_arraybuf_new(cs_const_value_r vals) {
+    size_t n = vals.size();
+    void *mem = ::operator new(sizeof(cs_arraybuf) + n * sizeof(cs_value));
+    cs_arraybuf *arr = new (mem) cs_arraybuf{1, n, nullptr};
+    cs_value *data = arr->data();
+    size_t i = 0;
+    try {
+        /* strings pointing into code are copied, like everywhere else */
+        for (; i < n; ++i) {
+            new (&data[i]) cs_value(vals[i]);
+        }
+    } catch (...) {
+        while (i) {
+            data[--i].~cs_value();
+        }
+        arr->~cs_arraybuf();
+        ::operator delete(mem);
+        throw;
+    }
+    return arr;
+}
+
+static inline void csv_arraybuf_unref(cs_arraybuf *arr) {
+    if (arr->refc.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+        for (size_t i = 0; i < arr->len; ++i) {
+            arr->data()[i].~cs_value();
+        }
+        if (char const *s = arr->str.load(std::memory_order_relaxed)) {
+            csv_strbuf_unref(s);
+        }
+        arr->~cs_arraybuf();
+        ::operator delete(arr);
+    }
+}
+
+/* items are quoted where they would not parse back as one */
+template<typename R>
+static void csv_list_put(R &app, ostd::string_range item) {
+    static constexpr cs_charset delims{"\"/;()[] \t\r\n"};
+    if (item.empty() || !cs_scan_find(item, delims).empty()) {
+        util::escape_string(app, item);
+    } else {
+        ostd::range_put_all(app, item);
+    }
+}
+
+template<typename R>
+static void csv_list_put(R &app, cs_value const &v, cs_string &tmp) {
+    ostd::string_range item;
+    switch (v.get_type()) {
+        case cs_value_type::String:
+        case cs_value_type::Macro:
+        case cs_value_type::Cstring:
+        case cs_value_type::Array:
+        case cs_value_type::Dict:
+            item = v.get_strr();
+            break;
+        default:
+            tmp = v.get_str();
+            item = tmp;
+            break;
+    }
+    csv_list_put(app, item);
+}
+
+/* the list form of arrays and dictionaries is made the first time it is
+ * asked for and kept in a string buffer holding a ref
+ */
+template<typename B, typename F>
+static ostd::string_range csv_list_strr(B *buf, F build) {
+    char const *ret = buf->str.load(std::memory_order_acquire);
+    if (!ret) {
+        auto app = ostd::appender<cs_string>();
+        build(app);
+        char const *str = csv_strbuf_new(app.get());
+        /* another thread may have made it meanwhile */
+        if (buf->str.compare_exchange_strong(
+            ret, str, std::memory_order_acq_rel, std::memory_order_acquire
+        )) {
+            ret = str;
+        } else {
+            csv_strbuf_unref(str);
+        }
+    }
+    return ostd::string_range(ret, ret + csv_strbuf(ret)->len);
+}
+
+static ostd::string_range csv_arraybuf_strr(cs_arraybuf *arr) {
+    return csv_list_strr(arr, [arr](auto &app) {
+        cs_string tmp;
+        for (size_t i = 0; i < arr->len; ++i) {
+            if (i) {
+                app.put(' ');
+            }
+            csv_list_put(app, arr->data()[i], tmp);
+        }
+    });
+}
+
+/* a refcounted hash table keeping its entries in the order they were first
+ * set in; values holding the only ref change it in place, others copy it
+ */
+struct cs_dictbuf {
+    struct entry {
+        cs_string key;
+        cs_value val;
+        size_t hash;
+        bool live;
+    };
+
+    std::atomic<size_t> refc{1};
+    std::atomic<char const *> str{nullptr};
+    cs_vector<entry> entries;
+    /* open addressing with linear probing, holding entry indexes plus one
+     * and zero for free slots; deleted entries keep their slots until the
+     * table is next rebuilt, which also drops them from the entries
+     */
+    cs_vector<size_t> slots;
+    size_t count = 0;
+
+    cs_dictbuf() {}
+
+    cs_dictbuf(cs_dictbuf const &d) {
+        entries.reserve(d.count);
+        for (auto &e: d.entries) {
+            if (e.live) {
+                entries.push_back(e);
+            }
+        }
+        count = entries.size();
+        rehash();
+    }
+
+    ~cs_dictbuf() {
+        if (char const *s = str.load(std::memory_order_relaxed)) {
+            csv_strbuf_unref(s);
+        }
+    }
+
+    /* the slot of the key, or the free slot it would go in */
+    size_t probe(ostd::string_range key, size_t hash) const {
+        size_t mask = slots.size() - 1;
+        for (size_t i = hash & mask;; i = (i + 1) & mask) {
+            size_t idx = slots[i];
+            if (!idx) {
+                return i;
+            }
+            entry const &e = entries[idx - 1];
+            if (e.live && (e.hash == hash) && (e.key == key)) {
+                return i;
+            }
+        }
+    }
+
+    entry const *find(ostd::string_range key) const {
+        if (!count) {
+            return nullptr;
+        }
+        size_t idx = slots[probe(key, cs_hash_str(key))];
+        return idx ? &entries[idx - 1] : nullptr;
+    }
+
+    void rehash() {
+        if (count != entries.size()) {
+            cs_vector<entry> live;
+            live.reserve(count);
+            for (auto &e: entries) {
+                if (e.live) {
+                    live.push_back(std::move(e));
+                }
+            }
+            entries = std::move(live);
+        }
+        /* at most a quarter full after this, so sets may double it */
+        size_t n = 8;
+        while (n < (count * 4)) {
+            n *= 2;
+        }
+        slots.assign(n, 0);
+        for (size_t i = 0; i < entries.size(); ++i) {
+            slots[probe(entries[i].key, entries[i].hash)] = i + 1;
+        }
+    }
+
+    void set(ostd::string_range key, cs_value const &v) {
+        if (((entries.size() + 1) * 2) > slots.size()) {
+            /* the key may be one of ours, which rehashing moves */
+            cs_string k{key.data(), key.size()};
+            rehash();
+            put(k, v);
+            return;
+        }
+        put(key, v);
+    }
+
+    void put(ostd::string_range key, cs_value const &v) {
+        size_t hash = cs_hash_str(key);
+        size_t i = probe(key, hash);
+        if (slots[i]) {
+            entries[slots[i] - 1].val = v;
+            return;
+        }
+        entries.push_back(
+            entry{cs_string{key.data(), key.size()}, v, hash, true}
+        );
+        slots[i] = entries.size();
+        ++count;
+    }
+
+    bool del(ostd::string_range key) {
+        if (!count) {
+            return false;
+        }
+        size_t idx = slots[probe(key, cs_hash_str(key))];
+        if (!idx) {
+            return false;
+        }
+        entry &e = entries[idx - 1];
+        e.live = false;
+        e.key = cs_string{};
+        e.val.set_null();
+        --count;
+        return true;
+    }
+};
+
+static inline void csv_dictbuf_unref(cs_dictbuf *dict) {
+    if (dict->refc.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+        delete dict;
+    }
+}
+
+static ostd::string_range csv_dictbuf_strr(cs_dictbuf *dict) {
+    return csv_list_strr(dict, [dict](auto &app) {
+        cs_string tmp;
+        bool first = true;
+        for (auto &e: dict->entries) {
+            if (!e.live) {
+                continue;
+            }
+            if (!first) {
+                app.put(' ');
+            }
+            first = false;
+            csv_list_put(app, ostd::string_range(e.key));
+            app.put(' ');
+            csv_list_put(app, e.val, tmp);
+        }
+    });
+}
+
 template<typename T>
-static inline void csv_cleanup(cs_value_type tv, T &stor) {
+static inline ostd::string_range csv_strr(T const &stor, unsigned char sso) {
+    if (sso <= CsSsoMax) {
+        char const *p = reinterpret_cast<char const *>(&stor);
+        return ostd::string_range(p, p + sso);
+    }
+    cs_strref const &r = csv_get<cs_strref>(stor);
+    return ostd::string_range(r.ptr, r.ptr + r.len);
+}
+
+template<typename T>
+static inline void csv_cleanup(cs_value_type tv, T &stor, unsigned char sso) {
     switch (tv) {
         case cs_value_type::String:
-            delete[] csv_get<char *>(stor);
+            if (sso == CsSsoHeap) {
+                csv_strbuf_unref(csv_get<cs_strref>(stor).ptr);
+            }
             break;
         case cs_value_type::Code: {
             uint32_t *bcode = csv_get<uint32_t *>(stor);
             if (bcode[-1] == CsCodeStart) {
-                delete[] &bcode[-1];
+                bcode_free(&bcode[-1]);
             }
             break;
         }
+        case cs_value_type::Array:
+            csv_arraybuf_unref(csv_get<cs_arraybuf *>(stor));
+            break;
+        case cs_value_type::Dict:
+            csv_dictbuf_unref(csv_get<cs_dictbuf *>(stor));
+            break;
         default:
             break;
     }
 }
 
 cs_value::cs_value():
-    p_stor(), p_len(0), p_type(cs_value_type::Null)
+    p_stor(), p_type(cs_value_type::Null), p_sso(CsSsoHeap)
 {}
 
 cs_value::~cs_value() {
-    csv_cleanup(p_type, p_stor);
+    csv_cleanup(p_type, p_stor, p_sso);
 }
 
 cs_value::cs_value(cs_value const &v): cs_value() {
@@ -45,24 +380,57 @@ cs_value::cs_value(cs_value &&v): cs_value() {
 }
 
 cs_value &cs_value::operator=(cs_value const &v) {
-    csv_cleanup(p_type, p_stor);
+    if (this == &v) {
+        return *this;
+    }
+    csv_cleanup(p_type, p_stor, p_sso);
     p_type = cs_value_type::Null;
     switch (v.get_type()) {
         case cs_value_type::Int:
         case cs_value_type::Float:
         case cs_value_type::Ident:
-            p_len = v.p_len;
             p_type = v.p_type;
             p_stor = v.p_stor;
             break;
         case cs_value_type::String:
+            /* inline strings are copied, buffers only get another ref */
+            p_type = v.p_type;
+            p_stor = v.p_stor;
+            p_sso = v.p_sso;
+            if (p_sso == CsSsoHeap) {
+                csv_strbuf(csv_get<cs_strref>(p_stor).ptr)->refc.fetch_add(
+                    1, std::memory_order_relaxed
+                );
+            }
+            break;
         case cs_value_type::Cstring:
         case cs_value_type::Macro:
-            set_str(cs_string{csv_get<char const *>(v.p_stor), v.p_len});
+            if (v.p_sso == CsSsoIntern) {
+                /* the table outlives the copy, nothing to duplicate */
+                p_type = cs_value_type::String;
+                p_stor = v.p_stor;
+                p_sso = v.p_sso;
+                break;
+            }
+            set_str(v.get_strr());
             break;
         case cs_value_type::Code:
             set_code(cs_copy_code(v.get_code()));
             break;
+        case cs_value_type::Array:
+            p_type = v.p_type;
+            p_stor = v.p_stor;
+            csv_get<cs_arraybuf *>(p_stor)->refc.fetch_add(
+                1, std::memory_order_relaxed
+            );
+            break;
+        case cs_value_type::Dict:
+            p_type = v.p_type;
+            p_stor = v.p_stor;
+            csv_get<cs_dictbuf *>(p_stor)->refc.fetch_add(
+                1, std::memory_order_relaxed
+            );
+            break;
         default:
             break;
     }
@@ -70,10 +438,13 @@ cs_value &cs_value::operator=(cs_value const &v) {
 }
 
 cs_value &cs_value::operator=(cs_value &&v) {
-    csv_cleanup(p_type, p_stor);
+    if (this == &v) {
+        return *this;
+    }
+    csv_cleanup(p_type, p_stor, p_sso);
     p_stor = v.p_stor;
     p_type = v.p_type;
-    p_len = v.p_len;
+    p_sso = v.p_sso;
     v.p_type = cs_value_type::Null;
     return *this;
 }
@@ -83,55 +454,75 @@ cs_value_type cs_value::get_type() const {
 }
 
 void cs_value::set_int(cs_int val) {
-    csv_cleanup(p_type, p_stor);
+    csv_cleanup(p_type, p_stor, p_sso);
     p_type = cs_value_type::Int;
     csv_get<cs_int>(p_stor) = val;
 }
 
 void cs_value::set_float(cs_float val) {
-    csv_cleanup(p_type, p_stor);
+    csv_cleanup(p_type, p_stor, p_sso);
     p_type = cs_value_type::Float;
     csv_get<cs_float>(p_stor) = val;
 }
 
-void cs_value::set_str(cs_string val) {
-    csv_cleanup(p_type, p_stor);
+void cs_value::set_str(ostd::string_range val) {
+    static_assert(sizeof(p_stor) == (CsSsoMax + 1));
+    /* build the new contents first, val may point into our old string */
+    decltype(p_stor) nstor;
+    unsigned char nsso;
+    if (val.size() <= CsSsoMax) {
+        char *p = reinterpret_cast<char *>(&nstor);
+        memcpy(p, val.data(), val.size());
+        p[val.size()] = '\0';
+        nsso = static_cast<unsigned char>(val.size());
+    } else {
+        csv_get<cs_strref>(nstor) = cs_strref{csv_strbuf_new(val), val.size()};
+        nsso = CsSsoHeap;
+    }
+    csv_cleanup(p_type, p_stor, p_sso);
     p_type = cs_value_type::String;
-    p_len = val.size();
-    char *buf = new char[p_len + 1];
-    memcpy(buf, val.data(), p_len + 1);
-    csv_get<char *>(p_stor) = buf;
+    p_stor = nstor;
+    p_sso = nsso;
 }
 
 void cs_value::set_null() {
-    csv_cleanup(p_type, p_stor);
+    csv_cleanup(p_type, p_stor, p_sso);
     p_type = cs_value_type::Null;
 }
 
 void cs_value::set_code(cs_bcode *val) {
-    csv_cleanup(p_type, p_stor);
+    csv_cleanup(p_type, p_stor, p_sso);
     p_type = cs_value_type::Code;
     csv_get<cs_bcode *>(p_stor) = val;
 }
 
 void cs_value::set_cstr(ostd::string_range val) {
-    csv_cleanup(p_type, p_stor);
+    csv_cleanup(p_type, p_stor, p_sso);
     p_type = cs_value_type::Cstring;
-    p_len = val.size();
-    csv_get<char const *>(p_stor) = val.data();
+    p_sso = CsSsoHeap;
+    csv_get<cs_strref>(p_stor) = cs_strref{val.data(), val.size()};
 }
 
 void cs_value::set_ident(cs_ident *val) {
-    csv_cleanup(p_type, p_stor);
+    csv_cleanup(p_type, p_stor, p_sso);
     p_type = cs_value_type::Ident;
     csv_get<cs_ident *>(p_stor) = val;
 }
 
 void cs_value::set_macro(ostd::string_range val) {
-    csv_cleanup(p_type, p_stor);
+    csv_cleanup(p_type, p_stor, p_sso);
     p_type = cs_value_type::Macro;
-    p_len = val.size();
-    csv_get<char const *>(p_stor) = val.data();
+    p_sso = CsSsoHeap;
+    csv_get<cs_strref>(p_stor) = cs_strref{val.data(), val.size()};
+}
+
+void cs_value::set_array(cs_const_value_r vals) {
+    /* made first, vals may be the values of our old array */
+    cs_arraybuf *arr = csv_arraybuf_new(vals);
+    csv_cleanup(p_type, p_stor, p_sso);
+    p_type = cs_value_type::Array;
+    p_sso = CsSsoHeap;
+    csv_get<cs_arraybuf *>(p_stor) = arr;
 }
 
 void cs_value::force_null() {
@@ -150,10 +541,11 @@ cs_float cs_value::force_float() {
         case cs_value_type::String:
         case cs_value_type::Macro:
         case cs_value_type::Cstring:
-            rf = cs_parse_float(ostd::string_range(
-                csv_get<char const *>(p_stor),
-                csv_get<char const *>(p_stor) + p_len
-            ));
+            rf = cs_parse_float(csv_strr(p_stor, p_sso));
+            break;
+        case cs_value_type::Array:
+        case cs_value_type::Dict:
+            rf = cs_parse_float(get_strr());
             break;
         case cs_value_type::Float:
             return csv_get<cs_float>(p_stor);
@@ -173,10 +565,11 @@ cs_int cs_value::force_int() {
         case cs_value_type::String:
         case cs_value_type::Macro:
         case cs_value_type::Cstring:
-            ri = cs_parse_int(ostd::string_range(
-                csv_get<char const *>(p_stor),
-                csv_get<char const *>(p_stor) + p_len
-            ));
+            ri = cs_parse_int(csv_strr(p_stor, p_sso));
+            break;
+        case cs_value_type::Array:
+        case cs_value_type::Dict:
+            ri = cs_parse_int(get_strr());
             break;
         case cs_value_type::Int:
             return csv_get<cs_int>(p_stor);
@@ -188,34 +581,43 @@ cs_int cs_value::force_int() {
 }
 
 ostd::string_range cs_value::force_str() {
-    cs_string rs;
     switch (get_type()) {
         case cs_value_type::Float:
-            rs = floatstr(csv_get<cs_float>(p_stor));
+            set_str(floatstr(csv_get<cs_float>(p_stor)));
             break;
         case cs_value_type::Int:
-            rs = intstr(csv_get<cs_int>(p_stor));
+            set_str(intstr(csv_get<cs_int>(p_stor)));
             break;
         case cs_value_type::Macro:
         case cs_value_type::Cstring:
-            rs = ostd::string_range(
-                csv_get<char const *>(p_stor),
-                csv_get<char const *>(p_stor) + p_len
-            );
+            if (p_sso == CsSsoIntern) {
+                p_type = cs_value_type::String;
+                break;
+            }
+            set_str(csv_strr(p_stor, p_sso));
             break;
         case cs_value_type::String:
-            return ostd::string_range(
-                csv_get<char const *>(p_stor),
-                csv_get<char const *>(p_stor) + p_len
-            );
+            break;
+        case cs_value_type::Array:
+        case cs_value_type::Dict: {
+            /* long lists keep sharing the buffer the value made */
+            ostd::string_range s = get_strr();
+            if (s.size() <= CsSsoMax) {
+                set_str(s);
+                break;
+            }
+            csv_strbuf(s.data())->refc.fetch_add(1, std::memory_order_relaxed);
+            csv_cleanup(p_type, p_stor, p_sso);
+            p_type = cs_value_type::String;
+            p_sso = CsSsoHeap;
+            csv_get<cs_strref>(p_stor) = cs_strref{s.data(), s.size()};
+            break;
+        }
         default:
+            set_str("");
             break;
     }
-    set_str(std::move(rs));
-    return ostd::string_range(
-        csv_get<char const *>(p_stor),
-        csv_get<char const *>(p_stor) + p_len
-    );
+    return csv_strr(p_stor, p_sso);
 }
 
 cs_int cs_value::get_int() const {
@@ -227,10 +629,10 @@ cs_int cs_value::get_int() const {
         case cs_value_type::String:
         case cs_value_type::Macro:
         case cs_value_type::Cstring:
-            return cs_parse_int(ostd::string_range(
-                csv_get<char const *>(p_stor),
-                csv_get<char const *>(p_stor) + p_len
-            ));
+            return cs_parse_int(csv_strr(p_stor, p_sso));
+        case cs_value_type::Array:
+        case cs_value_type::Dict:
+            return cs_parse_int(get_strr());
         default:
             break;
     }
@@ -246,10 +648,10 @@ cs_float cs_value::get_float() const {
         case cs_value_type::String:
         case cs_value_type::Macro:
         case cs_value_type::Cstring:
-            return cs_parse_float(ostd::string_range(
-                csv_get<char const *>(p_stor),
-                csv_get<char const *>(p_stor) + p_len
-            ));
+            return cs_parse_float(csv_strr(p_stor, p_sso));
+        case cs_value_type::Array:
+        case cs_value_type::Dict:
+            return cs_parse_float(get_strr());
         default:
             break;
     }
@@ -274,8 +676,15 @@ cs_string cs_value::get_str() const {
     switch (get_type()) {
         case cs_value_type::String:
         case cs_value_type::Macro:
-        case cs_value_type::Cstring:
-            return cs_string{csv_get<char const *>(p_stor), p_len};
+        case cs_value_type::Cstring: {
+            ostd::string_range s = csv_strr(p_stor, p_sso);
+            return cs_string{s.data(), s.size()};
+        }
+        case cs_value_type::Array:
+        case cs_value_type::Dict: {
+            ostd::string_range s = get_strr();
+            return cs_string{s.data(), s.size()};
+        }
         case cs_value_type::Int:
             return intstr(csv_get<cs_int>(p_stor));
         case cs_value_type::Float:
@@ -291,24 +700,122 @@ ostd::string_range cs_value::get_strr() const {
         case cs_value_type::String:
         case cs_value_type::Macro:
         case cs_value_type::Cstring:
-            return ostd::string_range(
-                csv_get<char const *>(p_stor),
-                csv_get<char const *>(p_stor)+ p_len
-            );
+            return csv_strr(p_stor, p_sso);
+        case cs_value_type::Array:
+            return csv_arraybuf_strr(csv_get<cs_arraybuf *>(p_stor));
+        case cs_value_type::Dict:
+            return csv_dictbuf_strr(csv_get<cs_dictbuf *>(p_stor));
         default:
             break;
     }
     return ostd::string_range();
 }
 
+cs_const_value_r cs_value::get_array() const {
+    if (get_type() != cs_value_type::Array) {
+        return cs_const_value_r();
+    }
+    cs_arraybuf *arr = csv_get<cs_arraybuf *>(p_stor);
+    return cs_const_value_r(arr->data(), arr->data() + arr->len);
+}
+
+/* the table this value alone holds, made empty for other types; the list
+ * form goes, as it is about to change
+ */
+template<typename T>
+static cs_dictbuf *csv_dict_own(
+    cs_value_type &tv, T &stor, unsigned char &sso
+) {
+    if (tv != cs_value_type::Dict) {
+        cs_dictbuf *dict = new cs_dictbuf;
+        csv_cleanup(tv, stor, sso);
+        tv = cs_value_type::Dict;
+        sso = CsSsoHeap;
+        csv_get<cs_dictbuf *>(stor) = dict;
+        return dict;
+    }
+    cs_dictbuf *dict = csv_get<cs_dictbuf *>(stor);
+    if (dict->refc.load(std::memory_order_acquire) != 1) {
+        cs_dictbuf *ndict = new cs_dictbuf(*dict);
+        csv_dictbuf_unref(dict);
+        csv_get<cs_dictbuf *>(stor) = ndict;
+        return ndict;
+    }
+    if (char const *s = dict->str.exchange(
+        nullptr, std::memory_order_relaxed
+    )) {
+        csv_strbuf_unref(s);
+    }
+    return dict;
+}
+
+void cs_value::set_dict() {
+    cs_dictbuf *dict = new cs_dictbuf;
+    csv_cleanup(p_type, p_stor, p_sso);
+    p_type = cs_value_type::Dict;
+    p_sso = CsSsoHeap;
+    csv_get<cs_dictbuf *>(p_stor) = dict;
+}
+
+cs_value const *cs_value::dict_get(ostd::string_range key) const {
+    if (get_type() != cs_value_type::Dict) {
+        return nullptr;
+    }
+    auto *e = csv_get<cs_dictbuf *>(p_stor)->find(key);
+    return e ? &e->val : nullptr;
+}
+
+void cs_value::dict_set(ostd::string_range key, cs_value const &v) {
+    /* v may be this value or live in our table, which may both change */
+    cs_value val{v};
+    csv_dict_own(p_type, p_stor, p_sso)->set(key, val);
+}
+
+bool cs_value::dict_del(ostd::string_range key) {
+    if (!dict_get(key)) {
+        return false;
+    }
+    return csv_dict_own(p_type, p_stor, p_sso)->del(key);
+}
+
+size_t cs_value::dict_size() const {
+    if (get_type() != cs_value_type::Dict) {
+        return 0;
+    }
+    return csv_get<cs_dictbuf *>(p_stor)->count;
+}
+
+bool cs_value::dict_next(
+    size_t &pos, ostd::string_range &key, cs_value const *&val
+) const {
+    if (get_type() != cs_value_type::Dict) {
+        return false;
+    }
+    auto &entries = csv_get<cs_dictbuf *>(p_stor)->entries;
+    for (; pos < entries.size(); ++pos) {
+        if (entries[pos].live) {
+            key = entries[pos].key;
+            val = &entries[pos++].val;
+            return true;
+        }
+    }
+    return false;
+}
+
 void cs_value::get_val(cs_value &r) const {
     switch (get_type()) {
         case cs_value_type::String:
+        case cs_value_type::Array:
+        case cs_value_type::Dict:
+            r = *this;
+            break;
         case cs_value_type::Macro:
         case cs_value_type::Cstring:
-            r.set_str(
-                cs_string{csv_get<char const *>(p_stor), p_len}
-            );
+            if (p_sso == CsSsoIntern) {
+                r = *this;
+                break;
+            }
+            r.set_str(csv_strr(p_stor, p_sso));
             break;
         case cs_value_type::Int:
             r.set_int(csv_get<cs_int>(p_stor));
@@ -364,10 +871,10 @@ bool cs_value::get_bool() const {
         case cs_value_type::String:
         case cs_value_type::Macro:
         case cs_value_type::Cstring:
-            return cs_get_bool(ostd::string_range(
-                csv_get<char const *>(p_stor),
-                csv_get<char const *>(p_stor) + p_len
-            ));
+            return cs_get_bool(csv_strr(p_stor, p_sso));
+        case cs_value_type::Array:
+        case cs_value_type::Dict:
+            return cs_get_bool(get_strr());
         default:
             return false;
     }
@@ -375,15 +882,14 @@ bool cs_value::get_bool() const {
 
 /* stacked value for easy stack management */
 
-cs_stacked_value::cs_stacked_value(cs_ident *id):
-    cs_value(), p_a(nullptr), p_stack(), p_pushed(false)
+cs_stacked_value::cs_stacked_value(cs_state &cs, cs_ident *id):
+    cs_value(), p_cs(cs), p_a(nullptr), p_stack(), p_pushed(false)
 {
     set_alias(id);
 }
 
 cs_stacked_value::~cs_stacked_value() {
     pop();
-    static_cast<cs_value *>(this)->~cs_value();
 }
 
 cs_stacked_value &cs_stacked_value::operator=(cs_value const &v) {
@@ -416,7 +922,7 @@ bool cs_stacked_value::push() {
     if (!p_a) {
         return false;
     }
-    cs_alias_internal::push_arg(p_a, *this, p_stack);
+    cs_alias_internal::push_arg(p_cs, p_a, *this, p_stack);
     p_pushed = true;
     return true;
 }
@@ -425,9 +931,64 @@ bool cs_stacked_value::pop() {
     if (!p_pushed || !p_a) {
         return false;
     }
-    cs_alias_internal::pop_arg(p_a);
+    cs_alias_internal::pop_arg(p_cs, p_a);
     p_pushed = false;
     return true;
 }
 
+cs_list_index const *cs_list_index::get(
+    cs_state &cs, cs_value const &v
+) {
+    if ((v.get_type() != cs_value_type::String) || (v.p_sso != CsSsoHeap)) {
+        return nullptr;
+    }
+    cs_strref const &r = csv_get<cs_strref>(v.p_stor);
+    if (r.len < MinSize) {
+        return nullptr;
+    }
+    cs_strbuf *buf = csv_strbuf(r.ptr);
+    cs_list_index *ret = buf->list.load(std::memory_order_acquire);
+    if (!ret) {
+        auto *idx = new cs_list_index;
+        try {
+            idx->build(cs, ostd::string_range(r.ptr, r.ptr + r.len));
+        } catch (cs_error const &) {
+            /* left to the parser, which fails where it gets to the error */
+            delete idx;
+            return nullptr;
+        }
+        /* another thread may have indexed the same buffer meanwhile */
+        if (buf->list.compare_exchange_strong(
+            ret, idx, std::memory_order_acq_rel, std::memory_order_acquire
+        )) {
+            ret = idx;
+        } else {
+            delete idx;
+        }
+    }
+    return ret;
+}
+
+void cs_strman::set_value(cs_value &v, cs_strent const *s) {
+    v.set_macro(s->str());
+    v.p_sso = CsSsoIntern;
+}
+
+cs_strent const *cs_strman::get_value(cs_value const &v) {
+    switch (v.get_type()) {
+        case cs_value_type::String:
+        case cs_value_type::Macro:
+        case cs_value_type::Cstring:
+            if (v.p_sso == CsSsoIntern) {
+                return reinterpret_cast<cs_strent const *>(
+                    csv_get<cs_strref>(v.p_stor).ptr
+                ) - 1;
+            }
+            break;
+        default:
+            break;
+    }
+    return nullptr;
+}
+
 } /* namespace cscript */
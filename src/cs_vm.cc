@@ -2,14 +2,108 @@
 #include "cs_vm.hh"
 #include "cs_util.hh"
 
+#include <algorithm>
+#include <cctype>
+#include <cmath>
+#include <cstring>
+#include <iterator>
 #include <limits>
+#include <memory>
+
+#include <ostd/thread_pool.hh>
 
 namespace cscript {
 
+thread_local int cs_cmd_locked = 0;
+/* whether the calling thread is one of a thread pool */
+static thread_local bool cs_in_pool = false;
+
+void cs_profiler::enter(cs_ident *id) {
+    node *parent = frames.empty() ? &root : frames.back().n;
+    auto &child = parent->children[id];
+    if (!child) {
+        child = std::make_unique<node>(id, parent);
+    }
+    entry &e = idents[id];
+    frames.push_back({child.get(), &e, clock::now()});
+    ++e.calls;
+    ++e.active;
+}
+
+void cs_profiler::leave() noexcept {
+    frame f = frames.back();
+    frames.pop_back();
+    std::chrono::nanoseconds total = clock::now() - f.start;
+    std::chrono::nanoseconds self = total - f.children;
+    f.n->self += self;
+    f.e->exclusive += self;
+    if (!--f.e->active) {
+        f.e->inclusive += total;
+    }
+    if (!frames.empty()) {
+        frames.back().children += total;
+    }
+}
+
+static void cs_profile_clear(cs_profiler::node &n) {
+    n.self = std::chrono::nanoseconds{0};
+    for (auto &ch: n.children) {
+        cs_profile_clear(*ch.second);
+    }
+}
+
+void cs_profiler::clear() {
+    cs_profile_clear(root);
+    for (auto &e: idents) {
+        e.second.calls = 0;
+        e.second.inclusive = e.second.exclusive = std::chrono::nanoseconds{0};
+    }
+}
+
+/* times a call while the state is being profiled, under the shared ident,
+ * as the copies of aliases that threads and tasks make go away with them
+ */
+struct ProfileRef {
+    ProfileRef() = delete;
+    ProfileRef(cs_state &cs, cs_ident *id): p_prof(cs.p_profiler) {
+        if (p_prof) {
+            if (p_prof->active) {
+                p_prof->enter(cs.p_state->identmap[id->get_index()]);
+            } else {
+                p_prof = nullptr;
+            }
+        }
+    }
+    ProfileRef(ProfileRef const &) = delete;
+    ProfileRef(ProfileRef &&) = delete;
+    ~ProfileRef() {
+        if (p_prof) {
+            p_prof->leave();
+        }
+    }
+
+private:
+    cs_profiler *p_prof;
+};
+
 struct cs_cmd_internal {
     static void call(
         cs_state &cs, cs_command *c, cs_value_r args, cs_value &ret
     ) {
+        ProfileRef prof{cs, c};
+        if (
+            !(c->get_flags() & CS_IDF_THREADSAFE) &&
+            cs.p_state->threads.load(std::memory_order_relaxed)
+        ) {
+            std::lock_guard<std::recursive_mutex> l{cs.p_state->cmd_lock};
+            ++cs_cmd_locked;
+            cs_do_and_cleanup([&]() {
+                c->p_cb_cftv(cs, args, ret);
+            }, []() {
+                --cs_cmd_locked;
+            });
+            return;
+        }
         c->p_cb_cftv(cs, args, ret);
     }
 
@@ -22,16 +116,178 @@ struct cs_cmd_internal {
     }
 };
 
-static inline void cs_push_alias(cs_ident *id, cs_ident_stack &st) {
+static inline void cs_push_alias(
+    cs_state &cs, cs_ident *id, cs_ident_stack &st
+) {
     if (id->is_alias() && (id->get_index() >= MaxArguments)) {
         cs_value nv;
-        cs_alias_internal::push_arg(static_cast<cs_alias *>(id), nv, st);
+        cs_alias_internal::push_arg(cs, static_cast<cs_alias *>(id), nv, st);
     }
 }
 
-static inline void cs_pop_alias(cs_ident *id) {
+static inline void cs_pop_alias(cs_state &cs, cs_ident *id) {
     if (id->is_alias() && (id->get_index() >= MaxArguments)) {
-        cs_alias_internal::pop_arg(static_cast<cs_alias *>(id));
+        cs_alias_internal::pop_arg(cs, static_cast<cs_alias *>(id));
+    }
+}
+
+cs_alias *cs_alias_internal::get_thread(
+    cs_state &cs, cs_alias *a, bool write
+) {
+    cs_vector<cs_alias *> &aliases = cs.p_tstate->aliases;
+    size_t idx = size_t(a->get_index());
+    if ((idx < aliases.size()) && aliases[idx]) {
+        return aliases[idx];
+    }
+    /* arguments are set by every call, so they are never shared */
+    if (!write && (idx >= MaxArguments)) {
+        return a;
+    }
+    if (idx >= aliases.size()) {
+        aliases.resize(idx + 1, nullptr);
+    }
+    cs_value v;
+    if (idx >= MaxArguments) {
+        v = a->p_val;
+    }
+    cs_alias *ret = cs.p_state->create<cs_alias>(
+        a->get_name(), std::move(v), a->get_flags()
+    );
+    ret->p_index = a->p_index;
+    aliases[idx] = ret;
+    return ret;
+}
+
+void cs_alias_internal::drop_thread(cs_state &cs, cs_alias *a) noexcept {
+    size_t idx = size_t(a->get_index());
+    if (idx < MaxArguments) {
+        return;
+    }
+    cs.p_tstate->aliases[idx] = nullptr;
+    a->p_val.force_null();
+    clean_code(a);
+    cs.p_state->destroy(a);
+}
+
+void cs_alias_internal::destroy_thread(cs_state &cs) noexcept {
+    for (cs_alias *a: cs.p_tstate->aliases) {
+        if (a) {
+            a->p_val.force_null();
+            clean_code(a);
+            cs.p_state->destroy(a);
+        }
+    }
+}
+
+/* numargs is set by every call, so thread states keep it to themselves */
+static inline cs_int cs_get_ivar(cs_state &cs, cs_ident *id) {
+    if (cs.p_tstate && (id->get_index() == NumargsIdx)) {
+        return cs.p_tstate->numargs;
+    }
+    return static_cast<cs_ivar *>(id)->get_value();
+}
+
+void cs_alias_internal::inherit(cs_state &from, cs_state &to) {
+    for (int i = 0; i < MaxArguments; ++i) {
+        cs_alias *a = static_cast<cs_alias *>(from.p_state->identmap[i]);
+        if (cs_is_arg_used(from, a)) {
+            own(to, a)->p_val = get(from, a)->p_val;
+        }
+    }
+    if (from.p_tstate) {
+        for (cs_alias *a: from.p_tstate->aliases) {
+            if (a && (a->get_index() >= MaxArguments)) {
+                own(to, a)->p_val = a->p_val;
+            }
+        }
+    }
+    to.p_tstate->numargs = cs_get_ivar(
+        from, from.p_state->identmap[NumargsIdx]
+    );
+    to.identflags = from.identflags;
+}
+
+void cs_parallel_for(cs_state &cs, size_t n, cs_parallel_cb const &body) {
+    if (!n) {
+        return;
+    }
+    /* the workers copy the arguments off the aliases, all at once */
+    cs_alias_internal::spill_args(cs);
+    cs_shared_state &st = *cs.p_state;
+    size_t nthr = std::thread::hardware_concurrency();
+    /* a pool thread waiting on the pool could wait forever, and so could
+     * the pool on a command lock held by the caller; both run it here
+     */
+    size_t ntasks = 0;
+    if ((nthr > 1) && (n > 1) && !cs_in_pool && !cs_cmd_locked) {
+        std::call_once(st.pool_once, [&st, nthr]() {
+            st.pool = new ostd::thread_pool;
+            st.pool->start(nthr - 1);
+        });
+        ntasks = std::min(n, nthr) - 1;
+    }
+    /* several chunks per thread, so uneven items even out */
+    size_t nchunks = std::min(n, (ntasks + 1) * 4);
+    std::atomic<size_t> next = 0;
+    std::mutex elock;
+    bool failed = false;
+    cs_string emsg;
+    std::exception_ptr eptr;
+    auto fail = [&](cs_string msg, std::exception_ptr ep) {
+        std::lock_guard<std::mutex> l{elock};
+        if (!failed) {
+            failed = true;
+            emsg = std::move(msg);
+            eptr = ep;
+        }
+        next.store(nchunks);
+    };
+    auto work = [&]() {
+        if (next.load(std::memory_order_relaxed) >= nchunks) {
+            return;
+        }
+        try {
+            cs_state ts = cs.new_thread();
+            cs_alias_internal::inherit(cs, ts);
+            /* errors refer to the state they were raised on */
+            try {
+                for (size_t c; (c = next++) < nchunks;) {
+                    if (!body(ts, c * n / nchunks, (c + 1) * n / nchunks)) {
+                        next.store(nchunks);
+                    }
+                }
+            } catch (cs_error const &e) {
+                fail(cs_string{e.what()}, nullptr);
+            }
+        } catch (...) {
+            fail(cs_string{}, std::current_exception());
+        }
+    };
+    std::vector<std::future<void>> tasks;
+    for (size_t i = 0; i < ntasks; ++i) {
+        tasks.push_back(st.pool->push([&work]() {
+            cs_in_pool = true;
+            work();
+            cs_in_pool = false;
+        }));
+    }
+    work();
+    for (auto &t: tasks) {
+        t.wait();
+    }
+    if (failed) {
+        if (eptr) {
+            std::rethrow_exception(eptr);
+        }
+        throw cs_error(cs, emsg);
+    }
+}
+
+static inline void cs_set_numargs(cs_state &cs, cs_ivar *anargs, cs_int v) {
+    if (cs.p_tstate) {
+        cs.p_tstate->numargs = v;
+    } else {
+        anargs->set_value(v);
     }
 }
 
@@ -109,6 +365,7 @@ cs_stack_state cs_error::save_stack(cs_state &cs) {
 ostd::string_range cs_error::save_msg(
     cs_state &cs, ostd::string_range msg
 ) {
+    CS_STATS_INCR(exceptions);
     if (msg.size() > sizeof(cs.p_errbuf)) {
         msg = msg.slice(0, sizeof(cs.p_errbuf));
     }
@@ -206,11 +463,9 @@ static inline uint32_t *forcecode(cs_state &cs, cs_value &v) {
     if (!code) {
         cs_gen_state gs(cs);
         gs.code.reserve(64);
-        gs.gen_main(v.get_str());
+        gs.gen_main(v.force_str());
         gs.done();
-        uint32_t *cbuf = new uint32_t[gs.code.size()];
-        memcpy(cbuf, gs.code.data(), gs.code.size() * sizeof(uint32_t));
-        v.set_code(reinterpret_cast<cs_bcode *>(cbuf + 1));
+        v.set_code(reinterpret_cast<cs_bcode *>(gs.code.release() + 1));
         code = reinterpret_cast<uint32_t *>(v.get_code());
     }
     return code;
@@ -232,13 +487,23 @@ static inline void forcecond(cs_state &cs, cs_value &v) {
     }
 }
 
-static uint32_t emptyblock[CsValAny][2] = {
-    { CsCodeStart + 0x100, CsCodeExit | CsRetNull },
-    { CsCodeStart + 0x100, CsCodeExit | CsRetInt },
-    { CsCodeStart + 0x100, CsCodeExit | CsRetFloat },
-    { CsCodeStart + 0x100, CsCodeExit | CsRetString }
+/* never freed (the refcount starts at one), the header is only there so
+ * that copies can tell which allocator to use
+ */
+static struct {
+    cs_bcode_hdr hdr;
+    uint32_t code[2];
+} emptyblock[CsValAny] = {
+    { { nullptr, 2 }, { CsCodeStart + 0x100, CsCodeExit | CsRetNull } },
+    { { nullptr, 2 }, { CsCodeStart + 0x100, CsCodeExit | CsRetInt } },
+    { { nullptr, 2 }, { CsCodeStart + 0x100, CsCodeExit | CsRetFloat } },
+    { { nullptr, 2 }, { CsCodeStart + 0x100, CsCodeExit | CsRetString } }
 };
 
+static inline cs_bcode *cs_empty_block(int type) {
+    return reinterpret_cast<cs_bcode *>(emptyblock[type].code + 1);
+}
+
 static inline void force_arg(cs_value &v, int type) {
     switch (type) {
         case CsRetString:
@@ -270,6 +535,12 @@ static uint32_t *skipcode(uint32_t *code) {
                 code += len / sizeof(uint32_t) + 1;
                 continue;
             }
+            case CsCodeVal | CsRetInt:
+                code += CsTypeStorageSize<cs_int>;
+                continue;
+            case CsCodeVal | CsRetFloat:
+                code += CsTypeStorageSize<cs_float>;
+                continue;
             case CsCodeBlock:
             case CsCodeJump:
             case CsCodeJumpB | CsCodeFlagTrue:
@@ -280,6 +551,12 @@ static uint32_t *skipcode(uint32_t *code) {
                 code += len;
                 continue;
             }
+            case CsCodeLoop | CsRetNull:
+            case CsCodeLoop | CsRetString:
+            case CsCodeLoop | CsRetInt:
+            case CsCodeLoop | CsRetFloat:
+                code += op >> CsCodeLoopLen;
+                continue;
             case CsCodeEnter:
             case CsCodeEnterResult:
                 ++depth;
@@ -297,10 +574,68 @@ static uint32_t *skipcode(uint32_t *code) {
     }
 }
 
+/* the first word of the buffer the code is in */
+static uint32_t *bcode_head(uint32_t *code) {
+    if ((*code & CsCodeOpMask) == CsCodeStart) {
+        return code;
+    }
+    if ((code[-1] & CsCodeOpMask) == CsCodeOffset) {
+        return code - std::ptrdiff_t(code[-1] >> 8);
+    }
+    return &code[-1];
+}
+
+uint32_t *bcode_alloc(cs_shared_state *st, size_t cap) {
+    size_t sz = sizeof(cs_bcode_hdr) + cap * sizeof(uint32_t);
+    void *mem = st ? st->alloc(nullptr, 0, sz)
+                   : cs_default_alloc(nullptr, nullptr, 0, sz);
+    cs_bcode_hdr *hdr = new (mem) cs_bcode_hdr{st, cap};
+    return reinterpret_cast<uint32_t *>(hdr + 1);
+}
+
+void bcode_free(uint32_t *bc) noexcept {
+    cs_bcode_hdr *hdr = reinterpret_cast<cs_bcode_hdr *>(bc) - 1;
+    size_t sz = sizeof(cs_bcode_hdr) + hdr->cap * sizeof(uint32_t);
+    cs_shared_state *st = hdr->state;
+    hdr->~cs_bcode_hdr();
+    if (st) {
+        st->alloc(hdr, sz, 0);
+    } else {
+        cs_default_alloc(nullptr, hdr, sz, 0);
+    }
+}
+
+void cs_code_buf::reserve(size_t n) {
+    if (n <= p_cap) {
+        return;
+    }
+    uint32_t *nbuf = bcode_alloc(p_state, n);
+    if (p_buf) {
+        memcpy(nbuf, p_buf, p_len * sizeof(uint32_t));
+        bcode_free(p_buf);
+    }
+    p_buf = nbuf;
+    p_cap = n;
+}
+
+void cs_code_buf::insert(
+    uint32_t *pos, uint32_t const *first, uint32_t const *last
+) {
+    size_t off = pos - p_buf, n = last - first;
+    if ((p_len + n) > p_cap) {
+        reserve(std::max(p_len + n, p_cap * 2));
+    }
+    memmove(&p_buf[off + n], &p_buf[off], (p_len - off) * sizeof(uint32_t));
+    memcpy(&p_buf[off], first, n * sizeof(uint32_t));
+    p_len += n;
+}
+
 cs_bcode *cs_copy_code(cs_bcode *c) {
     uint32_t *bcode = reinterpret_cast<uint32_t *>(c);
     uint32_t *end = skipcode(bcode);
-    uint32_t *dst = new uint32_t[end - bcode + 1];
+    /* the copy comes from wherever the original did */
+    cs_bcode_hdr *hdr = reinterpret_cast<cs_bcode_hdr *>(bcode_head(bcode)) - 1;
+    uint32_t *dst = bcode_alloc(hdr->state, end - bcode + 1);
     *dst++ = CsCodeStart;
     memcpy(dst, bcode, (end - bcode) * sizeof(uint32_t));
     return reinterpret_cast<cs_bcode *>(dst);
@@ -406,9 +741,7 @@ static inline void callcommand(
                     if (rep) {
                         break;
                     }
-                    args[i].set_code(
-                        reinterpret_cast<cs_bcode *>(emptyblock[CsValNull] + 1)
-                    );
+                    args[i].set_code(cs_empty_block(CsValNull));
                     fakeargs++;
                 } else {
                     forcecode(cs, args[i]);
@@ -463,88 +796,234 @@ static inline void callcommand(
     cs_cmd_internal::call(cs, id, cs_value_r(args, args + i), res);
 }
 
+static uint32_t *runops(cs_state &cs, uint32_t *code, cs_value &result);
 static uint32_t *runcode(cs_state &cs, uint32_t *code, cs_value &result);
+static inline uint32_t *runcode(
+    cs_state &cs, uint32_t *code, cs_value &result, cs_value *args
+);
 
 static inline void cs_call_alias(
     cs_state &cs, cs_alias *a, cs_value *args, cs_value &result,
     int callargs, int &nargs, int offset, int skip, uint32_t op
 ) {
+    ProfileRef prof{cs, a};
     cs_ivar *anargs = static_cast<cs_ivar *>(cs.p_state->identmap[NumargsIdx]);
-    cs_ident_stack argstack[MaxArguments];
-    for(int i = 0; i < callargs; i++) {
-        cs_alias_internal::push_arg(
-            static_cast<cs_alias *>(cs.p_state->identmap[i]),
-            args[offset + i], argstack[i], false
-        );
-    }
-    int oldargs = anargs->get_value();
-    anargs->set_value(callargs);
+    cs_int oldargs = cs_get_ivar(cs, anargs);
+    cs_set_numargs(cs, anargs, callargs);
     int oldflags = cs.identflags;
     cs.identflags |= a->get_flags()&CS_IDF_OVERRIDDEN;
+    /* the arguments are read from our slots until spilled */
     cs_identLink aliaslink = {
-        a, cs.p_callstack, (1<<callargs)-1, argstack
+        a, cs.p_callstack, (1<<callargs)-1, nullptr, &args[offset]
     };
     cs.p_callstack = &aliaslink;
-    uint32_t *codep = reinterpret_cast<uint32_t *>(
-        cs_alias_internal::compile_code(a, cs)
-    );
-    bcode_incr(codep);
+    /* compiled in here, so an error in the body pops the frame too */
+    uint32_t *codep = nullptr;
     cs_do_and_cleanup([&]() {
+        codep = reinterpret_cast<uint32_t *>(
+            cs_alias_internal::compile_code(a, cs)
+        );
+        bcode_incr(codep);
         runcode(cs, codep+1, result);
     }, [&]() {
-        bcode_decr(codep);
-        cs.p_callstack = aliaslink.next;
-        cs.identflags = oldflags;
-        for (int i = 0; i < callargs; i++) {
-            cs_alias_internal::pop_arg(
-                static_cast<cs_alias *>(cs.p_state->identmap[i])
-            );
+        if (codep) {
+            bcode_decr(codep);
         }
-        int argmask = aliaslink.usedargs & int(~0U << callargs);
-        for (; argmask; ++callargs) {
-            if (argmask & (1 << callargs)) {
-                cs_alias_internal::pop_arg(static_cast<cs_alias *>(
-                    cs.p_state->identmap[callargs])
-                );
-                argmask &= ~(1 << callargs);
+        /* popped while still the top frame, so nothing spills again */
+        if (aliaslink.argstack) {
+            int argmask = aliaslink.usedargs;
+            for (int i = 0; argmask; argmask >>= 1, ++i) {
+                if (argmask & 1) {
+                    cs_alias_internal::pop_arg(
+                        cs, static_cast<cs_alias *>(cs.p_state->identmap[i])
+                    );
+                }
             }
+            cs.p_vstack->put_argstack(aliaslink.argstack);
         }
+        cs.p_callstack = aliaslink.next;
+        cs.identflags = oldflags;
         force_arg(result, op & CsCodeRetMask);
-        anargs->set_value(oldargs);
+        cs_set_numargs(cs, anargs, oldargs);
         nargs = offset - skip;
     });
 }
 
+cs_value *cs_value_stack::push(cs_shared_state &st, size_t n, mark &prev) {
+    prev = mark{chunk, top};
+    if (chunks.empty() || ((top + n) > ChunkSize)) {
+        /* the rest of the current chunk goes unused until we return here */
+        size_t next = chunks.empty() ? 0 : (chunk + 1);
+        if (next == chunks.size()) {
+            chunks.push_back(st.create_array<cs_value>(ChunkSize));
+        }
+        chunk = next;
+        top = 0;
+    }
+    cs_value *ret = chunks[chunk] + top;
+    top += n;
+    depth += n;
+    if (depth > peak) {
+        peak = depth;
+    }
+    return ret;
+}
+
+void cs_value_stack::pop(
+    cs_value *vals, size_t n, mark const &prev
+) noexcept {
+    /* slots may still own strings or code, or point into code that
+     * is about to go away, so they must not outlive the frame
+     */
+    for (size_t i = 0; i < n; ++i) {
+        vals[i].force_null();
+    }
+    chunk = prev.chunk;
+    top = prev.top;
+    depth -= n;
+}
+
+cs_ident_stack *cs_value_stack::get_argstack(cs_shared_state &st) {
+    if (!argstacks.empty()) {
+        cs_ident_stack *ret = argstacks.back();
+        argstacks.pop_back();
+        return ret;
+    }
+    /* room for it to come back without allocating on the way out */
+    argstacks.reserve(++nargstacks);
+    return st.create_array<cs_ident_stack>(MaxArguments);
+}
+
+void cs_value_stack::destroy(cs_shared_state &st) noexcept {
+    for (cs_value *c: chunks) {
+        for (size_t i = 0; i < ChunkSize; ++i) {
+            c[i].~cs_value();
+        }
+        st.alloc(c, ChunkSize * sizeof(cs_value), 0);
+    }
+    chunks.clear();
+    for (cs_ident_stack *as: argstacks) {
+        for (size_t i = 0; i < MaxArguments; ++i) {
+            as[i].~cs_ident_stack();
+        }
+        st.alloc(as, MaxArguments * sizeof(cs_ident_stack), 0);
+    }
+    argstacks.clear();
+}
+
+void cs_alias_internal::spill_frame(cs_state &cs, cs_identLink *l) {
+    if (l->next && l->next->argv) {
+        spill_frame(cs, l->next);
+    }
+    l->argstack = cs.p_vstack->get_argstack(*cs.p_state);
+    cs_value *argv = l->argv;
+    l->argv = nullptr;
+    int argmask = l->usedargs;
+    for (int i = 0; argmask; argmask >>= 1, ++i) {
+        if (!(argmask & 1)) {
+            continue;
+        }
+        /* not own, that would come back here for the frames above */
+        cs_alias *a = static_cast<cs_alias *>(cs.p_state->identmap[i]);
+        if (cs.p_tstate) {
+            a = get_thread(cs, a, true);
+        }
+        push_val(a, argv[i], l->argstack[i], false);
+    }
+}
+
+struct ValueStackRef {
+    ValueStackRef() = delete;
+    ValueStackRef(cs_state &cs, size_t n):
+        p_stack(*cs.p_vstack), p_size(n),
+        p_vals(p_stack.push(*cs.p_state, n, p_prev))
+    {}
+    ValueStackRef(ValueStackRef const &) = delete;
+    ValueStackRef(ValueStackRef &&) = delete;
+    ~ValueStackRef() { p_stack.pop(p_vals, p_size, p_prev); }
+
+    cs_value *get() const { return p_vals; }
+
+private:
+    cs_value_stack &p_stack;
+    cs_value_stack::mark p_prev;
+    size_t p_size;
+    cs_value *p_vals;
+};
+
+size_t cs_state::get_value_stack_depth() const {
+    return p_vstack ? p_vstack->depth : 0;
+}
+
+size_t cs_state::get_value_stack_peak() const {
+    return p_vstack ? p_vstack->peak : 0;
+}
+
 static constexpr int MaxRunDepth = 255;
-static thread_local int rundepth = 0;
 
 struct RunDepthRef {
     RunDepthRef() = delete;
-    RunDepthRef(cs_state &cs) {
-        if (rundepth >= MaxRunDepth) {
+    RunDepthRef(cs_state &cs): p_depth(cs.p_rundepth) {
+        if (p_depth >= MaxRunDepth) {
             throw cs_error(cs, "exceeded recursion limit");
         }
-        ++rundepth;
+        ++p_depth;
     }
     RunDepthRef(RunDepthRef const &) = delete;
     RunDepthRef(RunDepthRef &&) = delete;
-    ~RunDepthRef() { --rundepth; }
+    ~RunDepthRef() { --p_depth; }
+
+private:
+    int &p_depth;
 };
 
+static void cs_budget_exceeded(cs_state &cs) {
+    auto &bhook = cs.get_budget_hook();
+    if (bhook) {
+        bhook(cs);
+    }
+    if (cs.p_limited && (cs.p_budget <= 0)) {
+        throw cs_error(cs, "exceeded instruction budget");
+    }
+}
+
+
 static inline cs_alias *cs_get_lookup_id(cs_state &cs, uint32_t op) {
-    cs_ident *id = cs.p_state->identmap[op >> 8];
-    if (id->get_flags() & CS_IDF_UNKNOWN) {
-        throw cs_error(cs, "unknown alias lookup: %s", id->get_name());
+    cs_alias *a = cs_alias_internal::get(
+        cs, static_cast<cs_alias *>(cs.p_state->identmap[op >> 8])
+    );
+    if (a->get_flags() & CS_IDF_UNKNOWN) {
+        throw cs_error(cs, "unknown alias lookup: %s", a->get_name());
     }
-    return static_cast<cs_alias *>(id);
+    return a;
 }
 
-static inline cs_alias *cs_get_lookuparg_id(cs_state &cs, uint32_t op) {
-    cs_ident *id = cs.p_state->identmap[op >> 8];
+/* the value of an argument, straight from the call's slots unless it has
+ * been spilled onto its alias; null when it was not passed or set
+ */
+static inline cs_value const *cs_get_lookuparg_val(
+    cs_state &cs, uint32_t op
+) {
+    cs_identLink *l = cs.p_callstack;
+    int idx = op >> 8;
+    if (l && l->argv) {
+        return (l->usedargs & (1 << idx)) ? &l->argv[idx] : nullptr;
+    }
+    cs_ident *id = cs.p_state->identmap[idx];
     if (!cs_is_arg_used(cs, id)) {
         return nullptr;
     }
-    return static_cast<cs_alias *>(id);
+    return &cs_alias_internal::get(
+        cs, static_cast<cs_alias *>(id)
+    )->get_value();
+}
+
+static inline cs_value &cs_get_slot(cs_state &cs, uint32_t op) {
+    cs_local_frame *l = cs.p_locals;
+    for (uint32_t up = op >> CsCodeSlotUp; up; --up) {
+        l = l->next;
+    }
+    return l->slots[(op >> 8) & CsCodeSlotMask];
 }
 
 static inline int cs_get_lookupu_type(
@@ -557,10 +1036,11 @@ static inline int cs_get_lookupu_type(
     ) {
         return -2; /* default case */
     }
-    id = cs.get_ident(arg.get_strr());
+    id = cs_get_ident(cs, arg);
     if (id) {
         switch(id->get_type()) {
             case cs_ident_type::Alias:
+                id = cs_alias_internal::get(cs, static_cast<cs_alias *>(id));
                 if (id->get_flags() & CS_IDF_UNKNOWN) {
                     break;
                 }
@@ -576,8 +1056,10 @@ static inline int cs_get_lookupu_type(
                 return CsIdFvar;
             case cs_ident_type::Command: {
                 arg.set_null();
-                cs_value buf[MaxArguments];
-                callcommand(cs, static_cast<cs_command *>(id), buf, arg, 0, true);
+                ValueStackRef buf{cs, MaxArguments};
+                callcommand(
+                    cs, static_cast<cs_command *>(id), buf.get(), arg, 0, true
+                );
                 force_arg(arg, op & CsCodeRetMask);
                 return -2; /* ignore */
             }
@@ -588,153 +1070,556 @@ static inline int cs_get_lookupu_type(
     throw cs_error(cs, "unknown alias lookup: %s", arg.get_strr());
 }
 
-static uint32_t *runcode(cs_state &cs, uint32_t *code, cs_value &result) {
+/* CsCodeLoop takes the counter alias and the numbers off the stack; the code
+ * after it is the condition, if any, and the body, each ending in an exit,
+ * run in place with the counter updated the way cs_do_loop does it
+ */
+static inline int cs_loop_numargs(uint32_t op) {
+    return 2 + !!(op & CsCodeLoopOffset) +
+        !!(op & (CsCodeLoopStep | CsCodeLoopStepLast));
+}
+
+static void runloop(cs_state &cs, uint32_t op, uint32_t *code, cs_value *args) {
+    cs_ident *id = args[0].get_ident();
+    cs_value *nums = &args[1];
+    cs_int offset = 0, step = 1;
+    if (op & CsCodeLoopOffset) {
+        offset = (nums++)->get_int();
+    }
+    if (op & CsCodeLoopStep) {
+        step = (nums++)->get_int();
+    }
+    cs_int n = (nums++)->get_int();
+    if (op & CsCodeLoopStepLast) {
+        step = nums->get_int();
+    }
+    if ((n <= 0) || !id || !id->is_alias()) {
+        return;
+    }
+    cs_alias *a = static_cast<cs_alias *>(id);
+    uint32_t *body = (op & CsCodeLoopCond) ? (skipcode(code) + 1) : code;
+    /* one frame for all the runs instead of a fresh one each time; each
+     * run of the condition or body is still a nested runcode rather than
+     * a jump back, so the instruction budget is checked and charged for it
+     * the way it is for a call, and the op stats count its exit each time
+     */
+    ValueStackRef frame{cs, MaxArguments + MaxResults};
+    cs_ident_stack stack;
+    cs_value val, ret;
+    cs_do_and_cleanup([&]() {
+        for (cs_int i = 0; i < n; ++i) {
+            val.set_int(offset + i * step);
+            cs_alias_internal::push_arg(cs, a, val, stack);
+            if (op & CsCodeLoopCond) {
+                runcode(cs, code, ret, frame.get());
+                /* a break in the condition belongs to an outer loop */
+                if (
+                    (cs.p_loopstate != CsLoopState::Normal) || !ret.get_bool()
+                ) {
+                    return;
+                }
+            }
+            ++cs.p_inloop;
+            try {
+                runcode(cs, body, ret, frame.get());
+            } catch (...) {
+                --cs.p_inloop;
+                cs.p_loopstate = CsLoopState::Normal;
+                throw;
+            }
+            --cs.p_inloop;
+            CsLoopState st = cs.p_loopstate;
+            cs.p_loopstate = CsLoopState::Normal;
+            if (st == CsLoopState::Break) {
+                return;
+            }
+        }
+    }, [&]() {
+        cs_alias_internal::pop_arg(cs, a);
+    });
+}
+
+static cs_ident *cs_code_lookup_ident(cs_state &cs, uint32_t op) {
+    switch (op & CsCodeOpMask) {
+        case CsCodeLookup:
+        case CsCodeLookupM:
+            return cs.p_state->identmap[op >> 8];
+        default:
+            return nullptr;
+    }
+}
+
+bool cs_code_cmp(
+    cs_state &cs, cs_bcode *code, cs_ident *x, cs_ident *y, cs_cmp_code &ret
+) {
+    if (!code) {
+        return false;
+    }
+    /* each op is only looked at when the ones before it could not end */
+    uint32_t const *c = reinterpret_cast<uint32_t const *>(code);
+    cs_ident *a = cs_code_lookup_ident(cs, c[0]);
+    cs_ident *b = a ? cs_code_lookup_ident(cs, c[1]) : nullptr;
+    if ((a == x) && (b == y)) {
+        ret.swap = false;
+    } else if ((a == y) && (b == x)) {
+        ret.swap = true;
+    } else {
+        return false;
+    }
+    switch (c[2] & CsCodeOpMask) {
+        case CsCodeMath:
+            ret.op = (c[2] >> 8) & 0x1F;
+            ret.str = false;
+            break;
+        case CsCodeCom: {
+            /* only the builtins themselves, not commands replacing them */
+            cs_ident **ids = cs.p_state->strcmps;
+            size_t nids = sizeof(cs.p_state->strcmps) / sizeof(*ids);
+            cs_ident *id = cs.p_state->identmap[c[2] >> 8];
+            size_t i = std::find(ids, ids + nids, id) - ids;
+            if (i == nids) {
+                return false;
+            }
+            ret.op = CsMathEq + int(i);
+            ret.str = true;
+            break;
+        }
+        default:
+            return false;
+    }
+    if ((ret.op & ~CsMathFloat) < CsMathEq) {
+        return false;
+    }
+    return (c[3] & CsCodeOpMask) == CsCodeExit;
+}
+
+/* CsCodeMath, computed the way the math library does for two operands */
+static inline void runmath(uint32_t op, cs_value *args, cs_value &result) {
+    int mop = (op >> 8) & 0x1F;
+    if (mop & CsMathFloat) {
+        cs_float a = args[0].get_float(), b = args[1].get_float();
+        switch (mop & ~CsMathFloat) {
+            case CsMathAdd: result.set_float(a + b); return;
+            case CsMathSub: result.set_float(a - b); return;
+            case CsMathMul: result.set_float(a * b); return;
+            case CsMathDiv: result.set_float(b ? (a / b) : 0); return;
+            case CsMathMod:
+                result.set_float(b ? cs_float(fmod(a, b)) : 0);
+                return;
+            case CsMathEq: result.set_int(a == b); return;
+            case CsMathNe: result.set_int(a != b); return;
+            case CsMathLt: result.set_int(a < b); return;
+            case CsMathGt: result.set_int(a > b); return;
+            case CsMathLe: result.set_int(a <= b); return;
+            case CsMathGe: result.set_int(a >= b); return;
+        }
+        return;
+    }
+    cs_int a = args[0].get_int(), b = args[1].get_int();
+    switch (mop) {
+        case CsMathAdd: result.set_int(a + b); return;
+        case CsMathSub: result.set_int(a - b); return;
+        case CsMathMul: result.set_int(a * b); return;
+        case CsMathDiv: result.set_int(b ? (a / b) : 0); return;
+        case CsMathMod: result.set_int(b ? (a % b) : 0); return;
+        case CsMathEq: result.set_int(a == b); return;
+        case CsMathNe: result.set_int(a != b); return;
+        case CsMathLt: result.set_int(a < b); return;
+        case CsMathGt: result.set_int(a > b); return;
+        case CsMathLe: result.set_int(a <= b); return;
+        case CsMathGe: result.set_int(a >= b); return;
+    }
+}
+
+/* every (opcode, return flag) pair runcode handles; with threaded dispatch
+ * this list builds the label table, so it has to match the CS_VM_CASE uses
+ */
+#define CS_VM_OPS_RET(X, opc) \
+    X(opc, CsRetNull) X(opc, CsRetString) X(opc, CsRetInt) X(opc, CsRetFloat)
+
+#define CS_VM_OPS(X) \
+    X(CsCodeStart, 0) X(CsCodeOffset, 0) \
+    CS_VM_OPS_RET(X, CsCodeNull) \
+    CS_VM_OPS_RET(X, CsCodeFalse) \
+    CS_VM_OPS_RET(X, CsCodeTrue) \
+    CS_VM_OPS_RET(X, CsCodeNot) \
+    X(CsCodePop, 0) X(CsCodeEnter, 0) X(CsCodeEnterResult, 0) \
+    CS_VM_OPS_RET(X, CsCodeExit) \
+    CS_VM_OPS_RET(X, CsCodeResultArg) \
+    X(CsCodePrint, 0) X(CsCodeLocal, 0) X(CsCodeLocal, CsCodeFlagSlots) \
+    CS_VM_OPS_RET(X, CsCodeDoArgs) \
+    CS_VM_OPS_RET(X, CsCodeDo) \
+    X(CsCodeJump, 0) \
+    X(CsCodeJumpB, CsCodeFlagTrue) X(CsCodeJumpB, CsCodeFlagFalse) \
+    X(CsCodeJumpResult, CsCodeFlagTrue) X(CsCodeJumpResult, CsCodeFlagFalse) \
+    X(CsCodeBreak, CsCodeFlagFalse) X(CsCodeBreak, CsCodeFlagTrue) \
+    CS_VM_OPS_RET(X, CsCodeLoop) \
+    CS_VM_OPS_RET(X, CsCodeMath) \
+    X(CsCodeMacro, 0) X(CsCodeMacro, CsCodeFlagIntern) \
+    CS_VM_OPS_RET(X, CsCodeVal) \
+    CS_VM_OPS_RET(X, CsCodeValInt) \
+    CS_VM_OPS_RET(X, CsCodeDup) \
+    X(CsCodeForce, CsRetString) X(CsCodeForce, CsRetInt) \
+    X(CsCodeForce, CsRetFloat) \
+    CS_VM_OPS_RET(X, CsCodeResult) \
+    CS_VM_OPS_RET(X, CsCodeEmpty) \
+    X(CsCodeBlock, 0) X(CsCodeCompile, 0) X(CsCodeCond, 0) \
+    X(CsCodeIdent, 0) X(CsCodeIdentArg, 0) X(CsCodeIdentU, 0) \
+    CS_VM_OPS_RET(X, CsCodeLookupU) \
+    CS_VM_OPS_RET(X, CsCodeLookup) \
+    CS_VM_OPS_RET(X, CsCodeLookupArg) \
+    X(CsCodeLookupMu, CsRetString) X(CsCodeLookupMu, CsRetNull) \
+    X(CsCodeLookupM, CsRetString) X(CsCodeLookupM, CsRetNull) \
+    X(CsCodeLookupMarg, CsRetString) X(CsCodeLookupMarg, CsRetNull) \
+    CS_VM_OPS_RET(X, CsCodeLookupSlot) \
+    CS_VM_OPS_RET(X, CsCodeSvar) \
+    X(CsCodeSvarM, 0) X(CsCodeSvar1, 0) \
+    CS_VM_OPS_RET(X, CsCodeIvar) \
+    X(CsCodeIvar1, 0) X(CsCodeIvar2, 0) X(CsCodeIvar3, 0) \
+    CS_VM_OPS_RET(X, CsCodeFvar) \
+    X(CsCodeFvar1, 0) \
+    CS_VM_OPS_RET(X, CsCodeCom) \
+    CS_VM_OPS_RET(X, CsCodeComV) \
+    CS_VM_OPS_RET(X, CsCodeComC) \
+    CS_VM_OPS_RET(X, CsCodeConc) \
+    CS_VM_OPS_RET(X, CsCodeConcW) \
+    CS_VM_OPS_RET(X, CsCodeConcM) \
+    X(CsCodeAlias, 0) X(CsCodeAliasArg, 0) X(CsCodeAliasU, 0) \
+    X(CsCodeAliasSlot, 0) \
+    CS_VM_OPS_RET(X, CsCodeCall) \
+    CS_VM_OPS_RET(X, CsCodeCallArg) \
+    CS_VM_OPS_RET(X, CsCodeCallU)
+
+/* names for the statistics, made from the enumerators with the prefixes
+ * dropped, as in Val/Int
+ */
+#define CS_VM_NAME(opc, ret) {uint32_t(opc | ret), #opc, #ret},
+
+static ostd::string_range cs_vm_strip(ostd::string_range s) {
+    for (ostd::string_range pfx: {"CsCodeFlag", "CsCode", "CsRet"}) {
+        if (ostd::starts_with(s, pfx)) {
+            return s.slice(pfx.size());
+        }
+    }
+    return s;
+}
+
+ostd::string_range cs_opcode_name(size_t op) {
+    static auto const names = []() {
+        struct opname {
+            uint32_t op;
+            char const *opc, *ret;
+        };
+        static constexpr opname ops[] = { CS_VM_OPS(CS_VM_NAME) };
+        std::array<cs_string, 256> ret;
+        for (auto &o: ops) {
+            cs_string &s = ret[o.op];
+            ostd::string_range rs = cs_vm_strip(o.ret);
+            s = cs_string{cs_vm_strip(o.opc)};
+            if (rs != "0") {
+                s += '/';
+                s += cs_string{rs};
+            }
+        }
+        return ret;
+    }();
+    if (op >= names.size()) {
+        return ostd::string_range{};
+    }
+    return names[op];
+}
+
+#ifdef CS_VM_STATS
+static std::mutex cs_stats_lock;
+/* the threads counting right now, and what the ones gone have counted */
+static cs_vector<cs_stats_counters *> cs_stats_threads;
+static cs_stats cs_stats_gone;
+/* the counts at the last clear_stats */
+static cs_stats cs_stats_base;
+
+thread_local cs_stats_counters cs_stats_local;
+
+static void cs_stats_sum(cs_stats &st, cs_stats_counters const &c) {
+    for (size_t i = 0; i < st.ops.size(); ++i) {
+        st.ops[i] += c.ops[i].load(std::memory_order_relaxed);
+    }
+    st.compilations += c.compilations.load(std::memory_order_relaxed);
+    st.string_allocs += c.string_allocs.load(std::memory_order_relaxed);
+    st.lookups += c.lookups.load(std::memory_order_relaxed);
+    st.exceptions += c.exceptions.load(std::memory_order_relaxed);
+}
+
+static cs_stats cs_stats_total() {
+    cs_stats ret = cs_stats_gone;
+    for (auto *c: cs_stats_threads) {
+        cs_stats_sum(ret, *c);
+    }
+    return ret;
+}
+
+cs_stats_counters::cs_stats_counters() {
+    std::lock_guard<std::mutex> l{cs_stats_lock};
+    cs_stats_threads.push_back(this);
+}
+
+cs_stats_counters::~cs_stats_counters() {
+    std::lock_guard<std::mutex> l{cs_stats_lock};
+    cs_stats_sum(cs_stats_gone, *this);
+    cs_stats_threads.erase(
+        std::find(cs_stats_threads.begin(), cs_stats_threads.end(), this)
+    );
+}
+
+cs_stats cs_state::get_stats() {
+    std::lock_guard<std::mutex> l{cs_stats_lock};
+    cs_stats ret = cs_stats_total();
+    for (size_t i = 0; i < ret.ops.size(); ++i) {
+        ret.ops[i] -= cs_stats_base.ops[i];
+        ret.instructions += ret.ops[i];
+    }
+    ret.compilations -= cs_stats_base.compilations;
+    ret.string_allocs -= cs_stats_base.string_allocs;
+    ret.lookups -= cs_stats_base.lookups;
+    ret.exceptions -= cs_stats_base.exceptions;
+    return ret;
+}
+
+void cs_state::clear_stats() {
+    std::lock_guard<std::mutex> l{cs_stats_lock};
+    cs_stats_base = cs_stats_total();
+}
+#else
+cs_stats cs_state::get_stats() {
+    return cs_stats{};
+}
+
+void cs_state::clear_stats() {}
+#endif
+
+#ifdef CS_VM_THREADED_DISPATCH
+
+/* computed goto: each handler jumps straight to the next one through a
+ * table indexed by the low byte of the instruction (opcode + return flags)
+ */
+#define CS_VM_LABEL(opc, ret) &&cs_vm_op_##opc##_##ret,
+#define CS_VM_VALUE(opc, ret) uint32_t(opc | ret),
+
+#define CS_VM_DISPATCH(op) goto *cs_vm_dispatch[(op) & 0xFF];
+#define CS_VM_CASE(opc, ret) cs_vm_op_##opc##_##ret:
+#define CS_VM_DEFAULT cs_vm_op_default:
+#define CS_VM_NEXT() \
+    op = *code++; CS_STATS_OP(op); goto *cs_vm_dispatch[op & 0xFF]
+#define CS_VM_FALLTHROUGH
+
+using cs_vm_table = std::array<void *, 256>;
+
+static constexpr uint32_t cs_vm_opvals[] = { CS_VM_OPS(CS_VM_VALUE) };
+
+static cs_vm_table cs_vm_make_table(void *const *labels) {
+    cs_vm_table ret;
+    /* the default handler comes last in the label list */
+    ret.fill(labels[std::size(cs_vm_opvals)]);
+    for (size_t i = 0; i < std::size(cs_vm_opvals); ++i) {
+        ret[cs_vm_opvals[i]] = labels[i];
+    }
+    return ret;
+}
+
+#else
+
+#define CS_VM_DISPATCH(op) switch ((op) & 0xFF)
+#define CS_VM_CASE(opc, ret) case opc | ret:
+#define CS_VM_DEFAULT default:
+#define CS_VM_NEXT() continue
+#define CS_VM_FALLTHROUGH [[fallthrough]]
+
+#endif
+
+/* a pending break or continue makes each runcode return right away, until
+ * it gets to run_loop; checked after anything that may have run other code
+ */
+#define CS_VM_LOOPCHECK() \
+    if (cs.p_loopstate != CsLoopState::Normal) { \
+        return code; \
+    }
+
+/* args is a frame of MaxArguments + MaxResults values; the frame may be
+ * reused by consecutive runs, nothing in it is read before it is set
+ */
+static uint32_t *runops(
+    cs_state &cs, uint32_t *code, cs_value &result, cs_value *args
+) {
+#ifdef CS_VM_THREADED_DISPATCH
+    static void *const cs_vm_labels[] = {
+        CS_VM_OPS(CS_VM_LABEL) &&cs_vm_op_default
+    };
+    static cs_vm_table const cs_vm_dispatch = cs_vm_make_table(cs_vm_labels);
+#endif
     result.set_null();
+    CS_VM_LOOPCHECK();
     RunDepthRef level{cs}; /* incr and decr on scope exit */
     int numargs = 0;
-    cs_value args[MaxArguments + MaxResults];
     auto &chook = cs.get_call_hook();
     if (chook) {
         chook(cs);
     }
     for (;;) {
         uint32_t op = *code++;
-        switch (op & 0xFF) {
-            case CsCodeStart:
-            case CsCodeOffset:
-                continue;
+        CS_STATS_OP(op);
+        CS_VM_DISPATCH(op) {
+            CS_VM_CASE(CsCodeStart, 0)
+            CS_VM_CASE(CsCodeOffset, 0)
+                CS_VM_NEXT();
 
-            case CsCodeNull | CsRetNull:
+            CS_VM_CASE(CsCodeNull, CsRetNull)
                 result.set_null();
-                continue;
-            case CsCodeNull | CsRetString:
+                CS_VM_NEXT();
+            CS_VM_CASE(CsCodeNull, CsRetString)
                 result.set_str("");
-                continue;
-            case CsCodeNull | CsRetInt:
+                CS_VM_NEXT();
+            CS_VM_CASE(CsCodeNull, CsRetInt)
                 result.set_int(0);
-                continue;
-            case CsCodeNull | CsRetFloat:
+                CS_VM_NEXT();
+            CS_VM_CASE(CsCodeNull, CsRetFloat)
                 result.set_float(0.0f);
-                continue;
+                CS_VM_NEXT();
 
-            case CsCodeFalse | CsRetString:
+            CS_VM_CASE(CsCodeFalse, CsRetString)
                 result.set_str("0");
-                continue;
-            case CsCodeFalse | CsRetNull:
-            case CsCodeFalse | CsRetInt:
+                CS_VM_NEXT();
+            CS_VM_CASE(CsCodeFalse, CsRetNull)
+            CS_VM_CASE(CsCodeFalse, CsRetInt)
                 result.set_int(0);
-                continue;
-            case CsCodeFalse | CsRetFloat:
+                CS_VM_NEXT();
+            CS_VM_CASE(CsCodeFalse, CsRetFloat)
                 result.set_float(0.0f);
-                continue;
+                CS_VM_NEXT();
 
-            case CsCodeTrue | CsRetString:
+            CS_VM_CASE(CsCodeTrue, CsRetString)
                 result.set_str("1");
-                continue;
-            case CsCodeTrue | CsRetNull:
-            case CsCodeTrue | CsRetInt:
+                CS_VM_NEXT();
+            CS_VM_CASE(CsCodeTrue, CsRetNull)
+            CS_VM_CASE(CsCodeTrue, CsRetInt)
                 result.set_int(1);
-                continue;
-            case CsCodeTrue | CsRetFloat:
+                CS_VM_NEXT();
+            CS_VM_CASE(CsCodeTrue, CsRetFloat)
                 result.set_float(1.0f);
-                continue;
+                CS_VM_NEXT();
 
-            case CsCodeNot | CsRetString:
+            CS_VM_CASE(CsCodeNot, CsRetString)
                 --numargs;
                 result.set_str(args[numargs].get_bool() ? "0" : "1");
-                continue;
-            case CsCodeNot | CsRetNull:
-            case CsCodeNot | CsRetInt:
+                CS_VM_NEXT();
+            CS_VM_CASE(CsCodeNot, CsRetNull)
+            CS_VM_CASE(CsCodeNot, CsRetInt)
                 --numargs;
                 result.set_int(!args[numargs].get_bool());
-                continue;
-            case CsCodeNot | CsRetFloat:
+                CS_VM_NEXT();
+            CS_VM_CASE(CsCodeNot, CsRetFloat)
                 --numargs;
                 result.set_float(cs_float(!args[numargs].get_bool()));
-                continue;
+                CS_VM_NEXT();
 
-            case CsCodePop:
+            CS_VM_CASE(CsCodePop, 0)
                 numargs -= 1;
-                continue;
-            case CsCodeEnter:
-                code = runcode(cs, code, args[numargs++]);
-                continue;
-            case CsCodeEnterResult:
-                code = runcode(cs, code, result);
-                continue;
-            case CsCodeExit | CsRetString:
-            case CsCodeExit | CsRetInt:
-            case CsCodeExit | CsRetFloat:
+                CS_VM_NEXT();
+            CS_VM_CASE(CsCodeEnter, 0)
+                code = runops(cs, code, args[numargs++]);
+                CS_VM_LOOPCHECK();
+                CS_VM_NEXT();
+            CS_VM_CASE(CsCodeEnterResult, 0)
+                code = runops(cs, code, result);
+                CS_VM_LOOPCHECK();
+                CS_VM_NEXT();
+            CS_VM_CASE(CsCodeExit, CsRetString)
+            CS_VM_CASE(CsCodeExit, CsRetInt)
+            CS_VM_CASE(CsCodeExit, CsRetFloat)
                 force_arg(result, op & CsCodeRetMask);
-            /* fallthrough */
-            case CsCodeExit | CsRetNull:
+                CS_VM_FALLTHROUGH;
+            CS_VM_CASE(CsCodeExit, CsRetNull)
                 return code;
-            case CsCodeResultArg | CsRetString:
-            case CsCodeResultArg | CsRetInt:
-            case CsCodeResultArg | CsRetFloat:
+            CS_VM_CASE(CsCodeResultArg, CsRetString)
+            CS_VM_CASE(CsCodeResultArg, CsRetInt)
+            CS_VM_CASE(CsCodeResultArg, CsRetFloat)
                 force_arg(result, op & CsCodeRetMask);
-            /* fallthrough */
-            case CsCodeResultArg | CsRetNull:
+                CS_VM_FALLTHROUGH;
+            CS_VM_CASE(CsCodeResultArg, CsRetNull)
                 args[numargs++] = std::move(result);
-                continue;
-            case CsCodePrint:
+                CS_VM_NEXT();
+            CS_VM_CASE(CsCodePrint, 0)
                 cs.print_var(static_cast<cs_var *>(cs.p_state->identmap[op >> 8]));
-                continue;
+                CS_VM_NEXT();
 
-            case CsCodeLocal: {
+            CS_VM_CASE(CsCodeLocal, 0) {
                 int numlocals = op >> 8, offset = numargs - numlocals;
                 cs_ident_stack locals[MaxArguments];
                 for (int i = 0; i < numlocals; ++i) {
-                    cs_push_alias(args[offset + i].get_ident(), locals[i]);
+                    cs_push_alias(
+                        cs, args[offset + i].get_ident(), locals[i]
+                    );
                 }
                 cs_do_and_cleanup([&]() {
-                    code = runcode(cs, code, result);
+                    code = runops(cs, code, result);
                 }, [&]() {
                     for (int i = offset; i < numargs; i++) {
-                        cs_pop_alias(args[i].get_ident());
+                        cs_pop_alias(cs, args[i].get_ident());
                     }
                 });
                 return code;
             }
+            CS_VM_CASE(CsCodeLocal, CsCodeFlagSlots) {
+                /* the names are only there for the dynamic form */
+                ValueStackRef slots{cs, size_t(op >> 8)};
+                cs_local_frame frame{slots.get(), cs.p_locals};
+                cs.p_locals = &frame;
+                cs_do_and_cleanup([&]() {
+                    code = runops(cs, code, result);
+                }, [&]() {
+                    cs.p_locals = frame.next;
+                });
+                return code;
+            }
 
-            case CsCodeDoArgs | CsRetNull:
-            case CsCodeDoArgs | CsRetString:
-            case CsCodeDoArgs | CsRetInt:
-            case CsCodeDoArgs | CsRetFloat:
+            CS_VM_CASE(CsCodeDoArgs, CsRetNull)
+            CS_VM_CASE(CsCodeDoArgs, CsRetString)
+            CS_VM_CASE(CsCodeDoArgs, CsRetInt)
+            CS_VM_CASE(CsCodeDoArgs, CsRetFloat)
                 cs_do_args(cs, [&]() {
                     cs.run(args[--numargs].get_code(), result);
                     force_arg(result, op & CsCodeRetMask);
                 });
-                continue;
+                CS_VM_LOOPCHECK();
+                CS_VM_NEXT();
             /* fallthrough */
-            case CsCodeDo | CsRetNull:
-            case CsCodeDo | CsRetString:
-            case CsCodeDo | CsRetInt:
-            case CsCodeDo | CsRetFloat:
+            CS_VM_CASE(CsCodeDo, CsRetNull)
+            CS_VM_CASE(CsCodeDo, CsRetString)
+            CS_VM_CASE(CsCodeDo, CsRetInt)
+            CS_VM_CASE(CsCodeDo, CsRetFloat)
                 cs.run(args[--numargs].get_code(), result);
                 force_arg(result, op & CsCodeRetMask);
-                continue;
+                CS_VM_LOOPCHECK();
+                CS_VM_NEXT();
 
-            case CsCodeJump: {
+            CS_VM_CASE(CsCodeJump, 0) {
                 uint32_t len = op >> 8;
                 code += len;
-                continue;
+                CS_VM_NEXT();
             }
-            case CsCodeJumpB | CsCodeFlagTrue: {
+            CS_VM_CASE(CsCodeJumpB, CsCodeFlagTrue) {
                 uint32_t len = op >> 8;
                 if (args[--numargs].get_bool()) {
                     code += len;
                 }
-                continue;
+                CS_VM_NEXT();
             }
-            case CsCodeJumpB | CsCodeFlagFalse: {
+            CS_VM_CASE(CsCodeJumpB, CsCodeFlagFalse) {
                 uint32_t len = op >> 8;
                 if (!args[--numargs].get_bool()) {
                     code += len;
                 }
-                continue;
+                CS_VM_NEXT();
             }
-            case CsCodeJumpResult | CsCodeFlagTrue: {
+            CS_VM_CASE(CsCodeJumpResult, CsCodeFlagTrue) {
                 uint32_t len = op >> 8;
                 --numargs;
                 if (args[numargs].get_type() == cs_value_type::Code) {
@@ -745,9 +1630,10 @@ static uint32_t *runcode(cs_state &cs, uint32_t *code, cs_value &result) {
                 if (result.get_bool()) {
                     code += len;
                 }
-                continue;
+                CS_VM_LOOPCHECK();
+                CS_VM_NEXT();
             }
-            case CsCodeJumpResult | CsCodeFlagFalse: {
+            CS_VM_CASE(CsCodeJumpResult, CsCodeFlagFalse) {
                 uint32_t len = op >> 8;
                 --numargs;
                 if (args[numargs].get_type() == cs_value_type::Code) {
@@ -758,43 +1644,67 @@ static uint32_t *runcode(cs_state &cs, uint32_t *code, cs_value &result) {
                 if (!result.get_bool()) {
                     code += len;
                 }
-                continue;
+                CS_VM_LOOPCHECK();
+                CS_VM_NEXT();
             }
-            case CsCodeBreak | CsCodeFlagFalse:
-                if (cs.is_in_loop()) {
-                    throw CsBreakException();
-                } else {
+            CS_VM_CASE(CsCodeBreak, CsCodeFlagFalse)
+                if (!cs.is_in_loop()) {
                     throw cs_error(cs, "no loop to break");
                 }
-                break;
-            case CsCodeBreak | CsCodeFlagTrue:
-                if (cs.is_in_loop()) {
-                    throw CsContinueException();
-                } else {
+                cs.p_loopstate = CsLoopState::Break;
+                return code;
+            CS_VM_CASE(CsCodeBreak, CsCodeFlagTrue)
+                if (!cs.is_in_loop()) {
                     throw cs_error(cs, "no loop to continue");
                 }
-                break;
+                cs.p_loopstate = CsLoopState::Continue;
+                return code;
+            CS_VM_CASE(CsCodeMath, CsRetNull)
+            CS_VM_CASE(CsCodeMath, CsRetString)
+            CS_VM_CASE(CsCodeMath, CsRetInt)
+            CS_VM_CASE(CsCodeMath, CsRetFloat)
+                numargs -= 2;
+                runmath(op, &args[numargs], result);
+                force_arg(result, op & CsCodeRetMask);
+                CS_VM_NEXT();
+
+            CS_VM_CASE(CsCodeLoop, CsRetNull)
+            CS_VM_CASE(CsCodeLoop, CsRetString)
+            CS_VM_CASE(CsCodeLoop, CsRetInt)
+            CS_VM_CASE(CsCodeLoop, CsRetFloat)
+                numargs -= cs_loop_numargs(op);
+                runloop(cs, op, code, &args[numargs]);
+                code += op >> CsCodeLoopLen;
+                result.set_null();
+                force_arg(result, op & CsCodeRetMask);
+                CS_VM_LOOPCHECK();
+                CS_VM_NEXT();
 
-            case CsCodeMacro: {
+            CS_VM_CASE(CsCodeMacro, 0) {
                 uint32_t len = op >> 8;
                 args[numargs++].set_macro(ostd::string_range(
                     reinterpret_cast<char const *>(code),
                     reinterpret_cast<char const *>(code) + len
                 ));
                 code += len / sizeof(uint32_t) + 1;
-                continue;
+                CS_VM_NEXT();
             }
+            CS_VM_CASE(CsCodeMacro, CsCodeFlagIntern)
+                cs_strman::set_value(
+                    args[numargs++], cs.p_state->strings.get(op >> 8)
+                );
+                CS_VM_NEXT();
 
-            case CsCodeVal | CsRetString: {
+            CS_VM_CASE(CsCodeVal, CsRetString) {
                 uint32_t len = op >> 8;
-                args[numargs++].set_str(cs_string{
+                args[numargs++].set_str(ostd::string_range(
                     reinterpret_cast<char const *>(code),
                     reinterpret_cast<char const *>(code) + len
-                });
+                ));
                 code += len / sizeof(uint32_t) + 1;
-                continue;
+                CS_VM_NEXT();
             }
-            case CsCodeValInt | CsRetString: {
+            CS_VM_CASE(CsCodeValInt, CsRetString) {
                 char s[4] = {
                     char((op >> 8) & 0xFF),
                     char((op >> 16) & 0xFF),
@@ -802,97 +1712,89 @@ static uint32_t *runcode(cs_state &cs, uint32_t *code, cs_value &result) {
                 };
                 /* gotta cast or r.size() == potentially 3 */
                 args[numargs++].set_str(static_cast<char const *>(s));
-                continue;
+                CS_VM_NEXT();
             }
-            case CsCodeVal | CsRetNull:
-            case CsCodeValInt | CsRetNull:
+            CS_VM_CASE(CsCodeVal, CsRetNull)
+            CS_VM_CASE(CsCodeValInt, CsRetNull)
                 args[numargs++].set_null();
-                continue;
-            case CsCodeVal | CsRetInt:
+                CS_VM_NEXT();
+            CS_VM_CASE(CsCodeVal, CsRetInt)
                 args[numargs++].set_int(
                     *reinterpret_cast<cs_int const *>(code)
                 );
                 code += CsTypeStorageSize<cs_int>;
-                continue;
-            case CsCodeValInt | CsRetInt:
+                CS_VM_NEXT();
+            CS_VM_CASE(CsCodeValInt, CsRetInt)
                 args[numargs++].set_int(cs_int(op) >> 8);
-                continue;
-            case CsCodeVal | CsRetFloat:
+                CS_VM_NEXT();
+            CS_VM_CASE(CsCodeVal, CsRetFloat)
                 args[numargs++].set_float(
                     *reinterpret_cast<cs_float const *>(code)
                 );
                 code += CsTypeStorageSize<cs_float>;
-                continue;
-            case CsCodeValInt | CsRetFloat:
+                CS_VM_NEXT();
+            CS_VM_CASE(CsCodeValInt, CsRetFloat)
                 args[numargs++].set_float(cs_float(cs_int(op) >> 8));
-                continue;
+                CS_VM_NEXT();
 
-            case CsCodeDup | CsRetNull:
+            CS_VM_CASE(CsCodeDup, CsRetNull)
                 args[numargs - 1].get_val(args[numargs]);
                 numargs++;
-                continue;
-            case CsCodeDup | CsRetInt:
+                CS_VM_NEXT();
+            CS_VM_CASE(CsCodeDup, CsRetInt)
                 args[numargs].set_int(args[numargs - 1].get_int());
                 numargs++;
-                continue;
-            case CsCodeDup | CsRetFloat:
+                CS_VM_NEXT();
+            CS_VM_CASE(CsCodeDup, CsRetFloat)
                 args[numargs].set_float(args[numargs - 1].get_float());
                 numargs++;
-                continue;
-            case CsCodeDup | CsRetString:
-                args[numargs].set_str(args[numargs - 1].get_str());
-                numargs++;
-                continue;
+                CS_VM_NEXT();
+            CS_VM_CASE(CsCodeDup, CsRetString)
+                args[numargs - 1].get_val(args[numargs]);
+                args[numargs++].force_str();
+                CS_VM_NEXT();
 
-            case CsCodeForce | CsRetString:
+            CS_VM_CASE(CsCodeForce, CsRetString)
                 args[numargs - 1].force_str();
-                continue;
-            case CsCodeForce | CsRetInt:
+                CS_VM_NEXT();
+            CS_VM_CASE(CsCodeForce, CsRetInt)
                 args[numargs - 1].force_int();
-                continue;
-            case CsCodeForce | CsRetFloat:
+                CS_VM_NEXT();
+            CS_VM_CASE(CsCodeForce, CsRetFloat)
                 args[numargs - 1].force_float();
-                continue;
+                CS_VM_NEXT();
 
-            case CsCodeResult | CsRetNull:
+            CS_VM_CASE(CsCodeResult, CsRetNull)
                 result = std::move(args[--numargs]);
-                continue;
-            case CsCodeResult | CsRetString:
-            case CsCodeResult | CsRetInt:
-            case CsCodeResult | CsRetFloat:
+                CS_VM_NEXT();
+            CS_VM_CASE(CsCodeResult, CsRetString)
+            CS_VM_CASE(CsCodeResult, CsRetInt)
+            CS_VM_CASE(CsCodeResult, CsRetFloat)
                 result = std::move(args[--numargs]);
                 force_arg(result, op & CsCodeRetMask);
-                continue;
-
-            case CsCodeEmpty | CsRetNull:
-                args[numargs++].set_code(
-                    reinterpret_cast<cs_bcode *>(emptyblock[CsValNull] + 1)
-                );
-                break;
-            case CsCodeEmpty | CsRetString:
-                args[numargs++].set_code(
-                    reinterpret_cast<cs_bcode *>(emptyblock[CsValString] + 1)
-                );
-                break;
-            case CsCodeEmpty | CsRetInt:
-                args[numargs++].set_code(
-                    reinterpret_cast<cs_bcode *>(emptyblock[CsValInt] + 1)
-                );
-                break;
-            case CsCodeEmpty | CsRetFloat:
-                args[numargs++].set_code(
-                    reinterpret_cast<cs_bcode *>(emptyblock[CsValFloat] + 1)
-                );
-                break;
-            case CsCodeBlock: {
+                CS_VM_NEXT();
+
+            CS_VM_CASE(CsCodeEmpty, CsRetNull)
+                args[numargs++].set_code(cs_empty_block(CsValNull));
+                CS_VM_NEXT();
+            CS_VM_CASE(CsCodeEmpty, CsRetString)
+                args[numargs++].set_code(cs_empty_block(CsValString));
+                CS_VM_NEXT();
+            CS_VM_CASE(CsCodeEmpty, CsRetInt)
+                args[numargs++].set_code(cs_empty_block(CsValInt));
+                CS_VM_NEXT();
+            CS_VM_CASE(CsCodeEmpty, CsRetFloat)
+                args[numargs++].set_code(cs_empty_block(CsValFloat));
+                CS_VM_NEXT();
+            CS_VM_CASE(CsCodeBlock, 0) {
                 uint32_t len = op >> 8;
                 args[numargs++].set_code(
                     reinterpret_cast<cs_bcode *>(code + 1)
                 );
                 code += len;
-                continue;
+                CS_VM_NEXT();
             }
-            case CsCodeCompile: {
+            CS_VM_CASE(CsCodeCompile, 0) {
                 cs_value &arg = args[numargs - 1];
                 cs_gen_state gs(cs);
                 switch (arg.get_type()) {
@@ -913,6 +1815,8 @@ static uint32_t *runcode(cs_state &cs, uint32_t *code, cs_value &result) {
                     case cs_value_type::String:
                     case cs_value_type::Macro:
                     case cs_value_type::Cstring:
+                    case cs_value_type::Array:
+                    case cs_value_type::Dict:
                         gs.code.reserve(64);
                         gs.gen_main(arg.get_strr());
                         break;
@@ -925,14 +1829,12 @@ static uint32_t *runcode(cs_state &cs, uint32_t *code, cs_value &result) {
                         break;
                 }
                 gs.done();
-                uint32_t *cbuf = new uint32_t[gs.code.size()];
-                memcpy(cbuf, gs.code.data(), gs.code.size() * sizeof(uint32_t));
                 arg.set_code(
-                    reinterpret_cast<cs_bcode *>(cbuf + 1)
+                    reinterpret_cast<cs_bcode *>(gs.code.release() + 1)
                 );
-                continue;
+                CS_VM_NEXT();
             }
-            case CsCodeCond: {
+            CS_VM_CASE(CsCodeCond, 0) {
                 cs_value &arg = args[numargs - 1];
                 switch (arg.get_type()) {
                     case cs_value_type::String:
@@ -944,12 +1846,9 @@ static uint32_t *runcode(cs_state &cs, uint32_t *code, cs_value &result) {
                             gs.code.reserve(64);
                             gs.gen_main(s);
                             gs.done();
-                            uint32_t *cbuf = new uint32_t[gs.code.size()];
-                            memcpy(
-                                cbuf, gs.code.data(),
-                                gs.code.size() * sizeof(uint32_t)
-                            );
-                            arg.set_code(reinterpret_cast<cs_bcode *>(cbuf + 1));
+                            arg.set_code(reinterpret_cast<cs_bcode *>(
+                                gs.code.release() + 1
+                            ));
                         } else {
                             arg.force_null();
                         }
@@ -958,27 +1857,30 @@ static uint32_t *runcode(cs_state &cs, uint32_t *code, cs_value &result) {
                     default:
                         break;
                 }
-                continue;
+                CS_VM_NEXT();
             }
 
-            case CsCodeIdent:
+            CS_VM_CASE(CsCodeIdent, 0)
                 args[numargs++].set_ident(cs.p_state->identmap[op >> 8]);
-                continue;
-            case CsCodeIdentArg: {
+                CS_VM_NEXT();
+            CS_VM_CASE(CsCodeIdentArg, 0) {
                 cs_alias *a = static_cast<cs_alias *>(
                     cs.p_state->identmap[op >> 8]
                 );
+                /* whatever takes it looks at the alias */
+                cs_alias_internal::spill_args(cs);
                 if (!cs_is_arg_used(cs, a)) {
                     cs_value nv;
                     cs_alias_internal::push_arg(
-                        a, nv, cs.p_callstack->argstack[a->get_index()], false
+                        cs, a, nv, cs.p_callstack->argstack[a->get_index()],
+                        false
                     );
                     cs.p_callstack->usedargs |= 1 << a->get_index();
                 }
                 args[numargs++].set_ident(a);
-                continue;
+                CS_VM_NEXT();
             }
-            case CsCodeIdentU: {
+            CS_VM_CASE(CsCodeIdentU, 0) {
                 cs_value &arg = args[numargs - 1];
                 cs_ident *id = cs.p_state->identmap[DummyIdx];
                 if (
@@ -986,66 +1888,69 @@ static uint32_t *runcode(cs_state &cs, uint32_t *code, cs_value &result) {
                     arg.get_type() == cs_value_type::Macro ||
                     arg.get_type() == cs_value_type::Cstring
                 ) {
-                    id = cs.new_ident(arg.get_strr());
+                    id = cs_new_ident(cs, arg);
                 }
-                if ((id->get_index() < MaxArguments) && !cs_is_arg_used(cs, id)) {
-                    cs_value nv;
-                    cs_alias_internal::push_arg(
-                        static_cast<cs_alias *>(id), nv,
-                        cs.p_callstack->argstack[id->get_index()], false
-                    );
-                    cs.p_callstack->usedargs |= 1 << id->get_index();
+                if (id->get_index() < MaxArguments) {
+                    cs_alias_internal::spill_args(cs);
+                    if (!cs_is_arg_used(cs, id)) {
+                        cs_value nv;
+                        cs_alias_internal::push_arg(
+                            cs, static_cast<cs_alias *>(id), nv,
+                            cs.p_callstack->argstack[id->get_index()], false
+                        );
+                        cs.p_callstack->usedargs |= 1 << id->get_index();
+                    }
                 }
                 arg.set_ident(id);
-                continue;
+                CS_VM_NEXT();
             }
 
-            case CsCodeLookupU | CsRetString: {
+            CS_VM_CASE(CsCodeLookupU, CsRetString) {
                 cs_ident *id = nullptr;
                 cs_value &arg = args[numargs - 1];
                 switch (cs_get_lookupu_type(cs, arg, id, op)) {
                     case CsIdAlias:
-                        arg.set_str(
-                            static_cast<cs_alias *>(id)->get_value().get_str()
-                        );
-                        continue;
+                        static_cast<cs_alias *>(id)->get_value().get_val(arg);
+                        arg.force_str();
+                        CS_VM_NEXT();
                     case CsIdSvar:
-                        arg.set_str(cs_string{
+                        arg.set_str(
                             static_cast<cs_svar *>(id)->get_value()
-                        });
-                        continue;
+                        );
+                        CS_VM_NEXT();
                     case CsIdIvar:
                         arg.set_str(
-                            intstr(static_cast<cs_ivar *>(id)->get_value())
+                            intstr(cs_get_ivar(cs, id))
                         );
-                        continue;
+                        CS_VM_NEXT();
                     case CsIdFvar:
                         arg.set_str(
                             floatstr(static_cast<cs_fvar *>(id)->get_value())
                         );
-                        continue;
+                        CS_VM_NEXT();
                     case CsIdUnknown:
                         arg.set_str("");
-                        continue;
+                        CS_VM_NEXT();
                     default:
-                        continue;
+                        CS_VM_LOOPCHECK();
+                        CS_VM_NEXT();
                 }
             }
-            case CsCodeLookup | CsRetString:
-                args[numargs++].set_str(
-                    cs_get_lookup_id(cs, op)->get_value().get_str()
-                );
-                continue;
-            case CsCodeLookupArg | CsRetString: {
-                cs_alias *a = cs_get_lookuparg_id(cs, op);
+            CS_VM_CASE(CsCodeLookup, CsRetString)
+                cs_get_lookup_id(cs, op)->get_value().get_val(args[numargs]);
+                args[numargs++].force_str();
+                CS_VM_NEXT();
+            CS_VM_CASE(CsCodeLookupArg, CsRetString) {
+                cs_value const *a = cs_get_lookuparg_val(cs, op);
                 if (!a) {
                     args[numargs++].set_str("");
                 } else {
-                    args[numargs++].set_str(a->get_value().get_str());
+                    a->get_val(args[numargs]);
+                    args[numargs++].force_str();
                 }
-                continue;
+                CS_VM_NEXT();
             }
-            case CsCodeLookupU | CsRetInt: {
+            CS_VM_CASE(CsCodeLookupU, CsRetInt) {
                 cs_ident *id = nullptr;
                 cs_value &arg = args[numargs - 1];
                 switch (cs_get_lookupu_type(cs, arg, id, op)) {
@@ -1053,42 +1958,43 @@ static uint32_t *runcode(cs_state &cs, uint32_t *code, cs_value &result) {
                         arg.set_int(
                             static_cast<cs_alias *>(id)->get_value().get_int()
                         );
-                        continue;
+                        CS_VM_NEXT();
                     case CsIdSvar:
                         arg.set_int(cs_parse_int(
                             static_cast<cs_svar *>(id)->get_value()
                         ));
-                        continue;
+                        CS_VM_NEXT();
                     case CsIdIvar:
-                        arg.set_int(static_cast<cs_ivar *>(id)->get_value());
-                        continue;
+                        arg.set_int(cs_get_ivar(cs, id));
+                        CS_VM_NEXT();
                     case CsIdFvar:
                         arg.set_int(
                             cs_int(static_cast<cs_fvar *>(id)->get_value())
                         );
-                        continue;
+                        CS_VM_NEXT();
                     case CsIdUnknown:
                         arg.set_int(0);
-                        continue;
+                        CS_VM_NEXT();
                     default:
-                        continue;
+                        CS_VM_LOOPCHECK();
+                        CS_VM_NEXT();
                 }
             }
-            case CsCodeLookup | CsRetInt:
+            CS_VM_CASE(CsCodeLookup, CsRetInt)
                 args[numargs++].set_int(
                     cs_get_lookup_id(cs, op)->get_value().get_int()
                 );
-                continue;
-            case CsCodeLookupArg | CsRetInt: {
-                cs_alias *a = cs_get_lookuparg_id(cs, op);
+                CS_VM_NEXT();
+            CS_VM_CASE(CsCodeLookupArg, CsRetInt) {
+                cs_value const *a = cs_get_lookuparg_val(cs, op);
                 if (!a) {
                     args[numargs++].set_int(0);
                 } else {
-                    args[numargs++].set_int(a->get_value().get_int());
+                    args[numargs++].set_int(a->get_int());
                 }
-                continue;
+                CS_VM_NEXT();
             }
-            case CsCodeLookupU | CsRetFloat: {
+            CS_VM_CASE(CsCodeLookupU, CsRetFloat) {
                 cs_ident *id = nullptr;
                 cs_value &arg = args[numargs - 1];
                 switch (cs_get_lookupu_type(cs, arg, id, op)) {
@@ -1096,254 +2002,284 @@ static uint32_t *runcode(cs_state &cs, uint32_t *code, cs_value &result) {
                         arg.set_float(
                             static_cast<cs_alias *>(id)->get_value().get_float()
                         );
-                        continue;
+                        CS_VM_NEXT();
                     case CsIdSvar:
                         arg.set_float(cs_parse_float(
                             static_cast<cs_svar *>(id)->get_value()
                         ));
-                        continue;
+                        CS_VM_NEXT();
                     case CsIdIvar:
                         arg.set_float(cs_float(
-                            static_cast<cs_ivar *>(id)->get_value()
+                            cs_get_ivar(cs, id)
                         ));
-                        continue;
+                        CS_VM_NEXT();
                     case CsIdFvar:
                         arg.set_float(
                             static_cast<cs_fvar *>(id)->get_value()
                         );
-                        continue;
+                        CS_VM_NEXT();
                     case CsIdUnknown:
                         arg.set_float(cs_float(0));
-                        continue;
+                        CS_VM_NEXT();
                     default:
-                        continue;
+                        CS_VM_LOOPCHECK();
+                        CS_VM_NEXT();
                 }
             }
-            case CsCodeLookup | CsRetFloat:
+            CS_VM_CASE(CsCodeLookup, CsRetFloat)
                 args[numargs++].set_float(
                     cs_get_lookup_id(cs, op)->get_value().get_float()
                 );
-                continue;
-            case CsCodeLookupArg | CsRetFloat: {
-                cs_alias *a = cs_get_lookuparg_id(cs, op);
+                CS_VM_NEXT();
+            CS_VM_CASE(CsCodeLookupArg, CsRetFloat) {
+                cs_value const *a = cs_get_lookuparg_val(cs, op);
                 if (!a) {
                     args[numargs++].set_float(cs_float(0));
                 } else {
-                    args[numargs++].set_float(a->get_value().get_float());
+                    args[numargs++].set_float(a->get_float());
                 }
-                continue;
+                CS_VM_NEXT();
             }
-            case CsCodeLookupU | CsRetNull: {
+            CS_VM_CASE(CsCodeLookupU, CsRetNull) {
                 cs_ident *id = nullptr;
                 cs_value &arg = args[numargs - 1];
                 switch (cs_get_lookupu_type(cs, arg, id, op)) {
                     case CsIdAlias:
                         static_cast<cs_alias *>(id)->get_value().get_val(arg);
-                        continue;
+                        CS_VM_NEXT();
                     case CsIdSvar:
-                        arg.set_str(cs_string{
+                        arg.set_str(
                             static_cast<cs_svar *>(id)->get_value()
-                        });
-                        continue;
+                        );
+                        CS_VM_NEXT();
                     case CsIdIvar:
-                        arg.set_int(static_cast<cs_ivar *>(id)->get_value());
-                        continue;
+                        arg.set_int(cs_get_ivar(cs, id));
+                        CS_VM_NEXT();
                     case CsIdFvar:
                         arg.set_float(
                             static_cast<cs_fvar *>(id)->get_value()
                         );
-                        continue;
+                        CS_VM_NEXT();
                     case CsIdUnknown:
                         arg.set_null();
-                        continue;
+                        CS_VM_NEXT();
                     default:
-                        continue;
+                        CS_VM_LOOPCHECK();
+                        CS_VM_NEXT();
                 }
             }
-            case CsCodeLookup | CsRetNull:
+            CS_VM_CASE(CsCodeLookup, CsRetNull)
                 cs_get_lookup_id(cs, op)->get_value().get_val(args[numargs++]);
-                continue;
-            case CsCodeLookupArg | CsRetNull: {
-                cs_alias *a = cs_get_lookuparg_id(cs, op);
+                CS_VM_NEXT();
+            CS_VM_CASE(CsCodeLookupArg, CsRetNull) {
+                cs_value const *a = cs_get_lookuparg_val(cs, op);
                 if (!a) {
                     args[numargs++].set_null();
                 } else {
-                    a->get_value().get_val(args[numargs++]);
+                    a->get_val(args[numargs++]);
                 }
-                continue;
+                CS_VM_NEXT();
             }
 
-            case CsCodeLookupMu | CsRetString: {
+            CS_VM_CASE(CsCodeLookupMu, CsRetString) {
                 cs_ident *id = nullptr;
                 cs_value &arg = args[numargs - 1];
                 switch (cs_get_lookupu_type(cs, arg, id, op)) {
                     case CsIdAlias:
                         static_cast<cs_alias *>(id)->get_cstr(arg);
-                        continue;
+                        CS_VM_NEXT();
                     case CsIdSvar:
                         arg.set_cstr(static_cast<cs_svar *>(id)->get_value());
-                        continue;
+                        CS_VM_NEXT();
                     case CsIdIvar:
                         arg.set_str(
-                            intstr(static_cast<cs_ivar *>(id)->get_value())
+                            intstr(cs_get_ivar(cs, id))
                         );
-                        continue;
+                        CS_VM_NEXT();
                     case CsIdFvar:
                         arg.set_str(
                             floatstr(static_cast<cs_fvar *>(id)->get_value())
                         );
-                        continue;
+                        CS_VM_NEXT();
                     case CsIdUnknown:
                         arg.set_cstr("");
-                        continue;
+                        CS_VM_NEXT();
                     default:
-                        continue;
+                        CS_VM_LOOPCHECK();
+                        CS_VM_NEXT();
                 }
             }
-            case CsCodeLookupM | CsRetString:
+            CS_VM_CASE(CsCodeLookupM, CsRetString)
                 cs_get_lookup_id(cs, op)->get_cstr(args[numargs++]);
-                continue;
-            case CsCodeLookupMarg | CsRetString: {
-                cs_alias *a = cs_get_lookuparg_id(cs, op);
+                CS_VM_NEXT();
+            CS_VM_CASE(CsCodeLookupMarg, CsRetString) {
+                cs_value const *a = cs_get_lookuparg_val(cs, op);
                 if (!a) {
                     args[numargs++].set_cstr("");
                 } else {
-                    a->get_cstr(args[numargs++]);
+                    cs_value_get_cstr(*a, args[numargs++]);
                 }
-                continue;
+                CS_VM_NEXT();
             }
-            case CsCodeLookupMu | CsRetNull: {
+            CS_VM_CASE(CsCodeLookupMu, CsRetNull) {
                 cs_ident *id = nullptr;
                 cs_value &arg = args[numargs - 1];
                 switch (cs_get_lookupu_type(cs, arg, id, op)) {
                     case CsIdAlias:
                         static_cast<cs_alias *>(id)->get_cval(arg);
-                        continue;
+                        CS_VM_NEXT();
                     case CsIdSvar:
                         arg.set_cstr(static_cast<cs_svar *>(id)->get_value());
-                        continue;
+                        CS_VM_NEXT();
                     case CsIdIvar:
-                        arg.set_int(static_cast<cs_ivar *>(id)->get_value());
-                        continue;
+                        arg.set_int(cs_get_ivar(cs, id));
+                        CS_VM_NEXT();
                     case CsIdFvar:
                         arg.set_float(static_cast<cs_fvar *>(id)->get_value());
-                        continue;
+                        CS_VM_NEXT();
                     case CsIdUnknown:
                         arg.set_null();
-                        continue;
+                        CS_VM_NEXT();
                     default:
-                        continue;
+                        CS_VM_LOOPCHECK();
+                        CS_VM_NEXT();
                 }
             }
-            case CsCodeLookupM | CsRetNull:
+            CS_VM_CASE(CsCodeLookupM, CsRetNull)
                 cs_get_lookup_id(cs, op)->get_cval(args[numargs++]);
-                continue;
-            case CsCodeLookupMarg | CsRetNull: {
-                cs_alias *a = cs_get_lookuparg_id(cs, op);
+                CS_VM_NEXT();
+            CS_VM_CASE(CsCodeLookupMarg, CsRetNull) {
+                cs_value const *a = cs_get_lookuparg_val(cs, op);
                 if (!a) {
                     args[numargs++].set_null();
                 } else {
-                    a->get_cval(args[numargs++]);
+                    cs_value_get_cval(*a, args[numargs++]);
                 }
-                continue;
+                CS_VM_NEXT();
             }
 
-            case CsCodeSvar | CsRetString:
-            case CsCodeSvar | CsRetNull:
-                args[numargs++].set_str(cs_string{static_cast<cs_svar *>(
+            CS_VM_CASE(CsCodeLookupSlot, CsRetString) {
+                cs_value &v = cs_get_slot(cs, op);
+                if (op & CsCodeSlotM) {
+                    cs_value_get_cstr(v, args[numargs++]);
+                } else {
+                    v.get_val(args[numargs]);
+                    args[numargs++].force_str();
+                }
+                CS_VM_NEXT();
+            }
+            CS_VM_CASE(CsCodeLookupSlot, CsRetInt)
+                args[numargs++].set_int(cs_get_slot(cs, op).get_int());
+                CS_VM_NEXT();
+            CS_VM_CASE(CsCodeLookupSlot, CsRetFloat)
+                args[numargs++].set_float(cs_get_slot(cs, op).get_float());
+                CS_VM_NEXT();
+            CS_VM_CASE(CsCodeLookupSlot, CsRetNull) {
+                cs_value &v = cs_get_slot(cs, op);
+                if (op & CsCodeSlotM) {
+                    cs_value_get_cval(v, args[numargs++]);
+                } else {
+                    v.get_val(args[numargs++]);
+                }
+                CS_VM_NEXT();
+            }
+
+            CS_VM_CASE(CsCodeSvar, CsRetString)
+            CS_VM_CASE(CsCodeSvar, CsRetNull)
+                args[numargs++].set_str(static_cast<cs_svar *>(
                     cs.p_state->identmap[op >> 8]
-                )->get_value()});
-                continue;
-            case CsCodeSvar | CsRetInt:
+                )->get_value());
+                CS_VM_NEXT();
+            CS_VM_CASE(CsCodeSvar, CsRetInt)
                 args[numargs++].set_int(cs_parse_int(static_cast<cs_svar *>(
                     cs.p_state->identmap[op >> 8]
                 )->get_value()));
-                continue;
-            case CsCodeSvar | CsRetFloat:
+                CS_VM_NEXT();
+            CS_VM_CASE(CsCodeSvar, CsRetFloat)
                 args[numargs++].set_float(cs_parse_float(static_cast<cs_svar *>(
                     cs.p_state->identmap[op >> 8]
                 )->get_value()));
-                continue;
-            case CsCodeSvarM:
+                CS_VM_NEXT();
+            CS_VM_CASE(CsCodeSvarM, 0)
                 args[numargs++].set_cstr(static_cast<cs_svar *>(
                     cs.p_state->identmap[op >> 8]
                 )->get_value());
-                continue;
-            case CsCodeSvar1:
+                CS_VM_NEXT();
+            CS_VM_CASE(CsCodeSvar1, 0)
                 cs.set_var_str_checked(
                     static_cast<cs_svar *>(cs.p_state->identmap[op >> 8]),
                     args[--numargs].get_strr()
                 );
-                continue;
+                CS_VM_NEXT();
 
-            case CsCodeIvar | CsRetInt:
-            case CsCodeIvar | CsRetNull:
-                args[numargs++].set_int(static_cast<cs_ivar *>(
-                    cs.p_state->identmap[op >> 8]
-                )->get_value());
-                continue;
-            case CsCodeIvar | CsRetString:
-                args[numargs++].set_str(intstr(static_cast<cs_ivar *>(
-                    cs.p_state->identmap[op >> 8]
-                )->get_value()));
-                continue;
-            case CsCodeIvar | CsRetFloat:
-                args[numargs++].set_float(cs_float(static_cast<cs_ivar *>(
-                    cs.p_state->identmap[op >> 8]
-                )->get_value()));
-                continue;
-            case CsCodeIvar1:
+            CS_VM_CASE(CsCodeIvar, CsRetInt)
+            CS_VM_CASE(CsCodeIvar, CsRetNull)
+                args[numargs++].set_int(cs_get_ivar(
+                    cs, cs.p_state->identmap[op >> 8]
+                ));
+                CS_VM_NEXT();
+            CS_VM_CASE(CsCodeIvar, CsRetString)
+                args[numargs++].set_str(intstr(cs_get_ivar(
+                    cs, cs.p_state->identmap[op >> 8]
+                )));
+                CS_VM_NEXT();
+            CS_VM_CASE(CsCodeIvar, CsRetFloat)
+                args[numargs++].set_float(cs_float(cs_get_ivar(
+                    cs, cs.p_state->identmap[op >> 8]
+                )));
+                CS_VM_NEXT();
+            CS_VM_CASE(CsCodeIvar1, 0)
                 cs.set_var_int_checked(
                     static_cast<cs_ivar *>(cs.p_state->identmap[op >> 8]),
                     args[--numargs].get_int()
                 );
-                continue;
-            case CsCodeIvar2:
+                CS_VM_NEXT();
+            CS_VM_CASE(CsCodeIvar2, 0)
                 numargs -= 2;
                 cs.set_var_int_checked(
                     static_cast<cs_ivar *>(cs.p_state->identmap[op >> 8]),
                     (args[numargs].get_int() << 16)
                         | (args[numargs + 1].get_int() << 8)
                 );
-                continue;
-            case CsCodeIvar3:
+                CS_VM_NEXT();
+            CS_VM_CASE(CsCodeIvar3, 0)
                 numargs -= 3;
                 cs.set_var_int_checked(
                     static_cast<cs_ivar *>(cs.p_state->identmap[op >> 8]),
                     (args[numargs].get_int() << 16)
                         | (args[numargs + 1].get_int() << 8)
                         | (args[numargs + 2].get_int()));
-                continue;
+                CS_VM_NEXT();
 
-            case CsCodeFvar | CsRetFloat:
-            case CsCodeFvar | CsRetNull:
+            CS_VM_CASE(CsCodeFvar, CsRetFloat)
+            CS_VM_CASE(CsCodeFvar, CsRetNull)
                 args[numargs++].set_float(static_cast<cs_fvar *>(
                     cs.p_state->identmap[op >> 8]
                 )->get_value());
-                continue;
-            case CsCodeFvar | CsRetString:
+                CS_VM_NEXT();
+            CS_VM_CASE(CsCodeFvar, CsRetString)
                 args[numargs++].set_str(floatstr(
                     static_cast<cs_fvar *>(
                         cs.p_state->identmap[op >> 8]
                     )->get_value()
                 ));
-                continue;
-            case CsCodeFvar | CsRetInt:
+                CS_VM_NEXT();
+            CS_VM_CASE(CsCodeFvar, CsRetInt)
                 args[numargs++].set_int(int(static_cast<cs_fvar *>(
                     cs.p_state->identmap[op >> 8]
                 )->get_value()));
-                continue;
-            case CsCodeFvar1:
+                CS_VM_NEXT();
+            CS_VM_CASE(CsCodeFvar1, 0)
                 cs.set_var_float_checked(
                     static_cast<cs_fvar *>(cs.p_state->identmap[op >> 8]),
                     args[--numargs].get_float()
                 );
-                continue;
+                CS_VM_NEXT();
 
-            case CsCodeCom | CsRetNull:
-            case CsCodeCom | CsRetString:
-            case CsCodeCom | CsRetFloat:
-            case CsCodeCom | CsRetInt: {
+            CS_VM_CASE(CsCodeCom, CsRetNull)
+            CS_VM_CASE(CsCodeCom, CsRetString)
+            CS_VM_CASE(CsCodeCom, CsRetFloat)
+            CS_VM_CASE(CsCodeCom, CsRetInt) {
                 cs_command *id = static_cast<cs_command *>(
                     cs.p_state->identmap[op >> 8]
                 );
@@ -1354,13 +2290,14 @@ static uint32_t *runcode(cs_state &cs, uint32_t *code, cs_value &result) {
                 ), result);
                 force_arg(result, op & CsCodeRetMask);
                 numargs = offset;
-                continue;
+                CS_VM_LOOPCHECK();
+                CS_VM_NEXT();
             }
 
-            case CsCodeComV | CsRetNull:
-            case CsCodeComV | CsRetString:
-            case CsCodeComV | CsRetFloat:
-            case CsCodeComV | CsRetInt: {
+            CS_VM_CASE(CsCodeComV, CsRetNull)
+            CS_VM_CASE(CsCodeComV, CsRetString)
+            CS_VM_CASE(CsCodeComV, CsRetFloat)
+            CS_VM_CASE(CsCodeComV, CsRetInt) {
                 cs_command *id = static_cast<cs_command *>(
                     cs.p_state->identmap[op >> 13]
                 );
@@ -1371,12 +2308,13 @@ static uint32_t *runcode(cs_state &cs, uint32_t *code, cs_value &result) {
                 ), result);
                 force_arg(result, op & CsCodeRetMask);
                 numargs = offset;
-                continue;
+                CS_VM_LOOPCHECK();
+                CS_VM_NEXT();
             }
-            case CsCodeComC | CsRetNull:
-            case CsCodeComC | CsRetString:
-            case CsCodeComC | CsRetFloat:
-            case CsCodeComC | CsRetInt: {
+            CS_VM_CASE(CsCodeComC, CsRetNull)
+            CS_VM_CASE(CsCodeComC, CsRetString)
+            CS_VM_CASE(CsCodeComC, CsRetFloat)
+            CS_VM_CASE(CsCodeComC, CsRetInt) {
                 cs_command *id = static_cast<cs_command *>(
                     cs.p_state->identmap[op >> 13]
                 );
@@ -1393,17 +2331,18 @@ static uint32_t *runcode(cs_state &cs, uint32_t *code, cs_value &result) {
                 }
                 force_arg(result, op & CsCodeRetMask);
                 numargs = offset;
-                continue;
+                CS_VM_LOOPCHECK();
+                CS_VM_NEXT();
             }
 
-            case CsCodeConc | CsRetNull:
-            case CsCodeConc | CsRetString:
-            case CsCodeConc | CsRetFloat:
-            case CsCodeConc | CsRetInt:
-            case CsCodeConcW | CsRetNull:
-            case CsCodeConcW | CsRetString:
-            case CsCodeConcW | CsRetFloat:
-            case CsCodeConcW | CsRetInt: {
+            CS_VM_CASE(CsCodeConc, CsRetNull)
+            CS_VM_CASE(CsCodeConc, CsRetString)
+            CS_VM_CASE(CsCodeConc, CsRetFloat)
+            CS_VM_CASE(CsCodeConc, CsRetInt)
+            CS_VM_CASE(CsCodeConcW, CsRetNull)
+            CS_VM_CASE(CsCodeConcW, CsRetString)
+            CS_VM_CASE(CsCodeConcW, CsRetFloat)
+            CS_VM_CASE(CsCodeConcW, CsRetInt) {
                 int numconc = op >> 8;
                 auto buf = ostd::appender<cs_string>();
                 cscript::util::tvals_concat(
@@ -1414,13 +2353,13 @@ static uint32_t *runcode(cs_state &cs, uint32_t *code, cs_value &result) {
                 args[numargs].set_str(std::move(buf.get()));
                 force_arg(args[numargs], op & CsCodeRetMask);
                 numargs++;
-                continue;
+                CS_VM_NEXT();
             }
 
-            case CsCodeConcM | CsRetNull:
-            case CsCodeConcM | CsRetString:
-            case CsCodeConcM | CsRetFloat:
-            case CsCodeConcM | CsRetInt: {
+            CS_VM_CASE(CsCodeConcM, CsRetNull)
+            CS_VM_CASE(CsCodeConcM, CsRetString)
+            CS_VM_CASE(CsCodeConcM, CsRetFloat)
+            CS_VM_CASE(CsCodeConcM, CsRetInt) {
                 int numconc = op >> 8;
                 auto buf = ostd::appender<cs_string>();
                 cscript::util::tvals_concat(
@@ -1429,70 +2368,76 @@ static uint32_t *runcode(cs_state &cs, uint32_t *code, cs_value &result) {
                 numargs = numargs - numconc;
                 result.set_str(std::move(buf.get()));
                 force_arg(result, op & CsCodeRetMask);
-                continue;
+                CS_VM_NEXT();
             }
 
-            case CsCodeAlias:
+            CS_VM_CASE(CsCodeAlias, 0)
                 cs_alias_internal::set_alias(
                     static_cast<cs_alias *>(cs.p_state->identmap[op >> 8]),
                     cs, args[--numargs]
                 );
-                continue;
-            case CsCodeAliasArg:
+                CS_VM_NEXT();
+            CS_VM_CASE(CsCodeAliasArg, 0)
                 cs_alias_internal::set_arg(
                     static_cast<cs_alias *>(cs.p_state->identmap[op >> 8]),
                     cs, args[--numargs]
                 );
-                continue;
-            case CsCodeAliasU:
+                CS_VM_NEXT();
+            CS_VM_CASE(CsCodeAliasSlot, 0)
+                cs_get_slot(cs, op) = std::move(args[--numargs]);
+                CS_VM_NEXT();
+            CS_VM_CASE(CsCodeAliasU, 0)
                 numargs -= 2;
                 cs.set_alias(
-                    args[numargs].get_str(), std::move(args[numargs + 1])
+                    args[numargs].force_str(), std::move(args[numargs + 1])
                 );
-                continue;
+                CS_VM_NEXT();
 
-            case CsCodeCall | CsRetNull:
-            case CsCodeCall | CsRetString:
-            case CsCodeCall | CsRetFloat:
-            case CsCodeCall | CsRetInt: {
+            CS_VM_CASE(CsCodeCall, CsRetNull)
+            CS_VM_CASE(CsCodeCall, CsRetString)
+            CS_VM_CASE(CsCodeCall, CsRetFloat)
+            CS_VM_CASE(CsCodeCall, CsRetInt) {
                 result.force_null();
-                cs_ident *id = cs.p_state->identmap[op >> 13];
+                cs_alias *a = cs_alias_internal::get(
+                    cs, static_cast<cs_alias *>(cs.p_state->identmap[op >> 13])
+                );
                 int callargs = (op >> 8) & 0x1F, offset = numargs - callargs;
-                if (id->get_flags() & CS_IDF_UNKNOWN) {
+                if (a->get_flags() & CS_IDF_UNKNOWN) {
                     force_arg(result, op & CsCodeRetMask);
                     throw cs_error(
-                        cs, "unknown command: %s", id->get_name()
+                        cs, "unknown command: %s", a->get_name()
                     );
                 }
                 cs_call_alias(
-                    cs, static_cast<cs_alias *>(id), args, result, callargs,
-                    numargs, offset, 0, op
+                    cs, a, args, result, callargs, numargs, offset, 0, op
                 );
-                continue;
+                CS_VM_LOOPCHECK();
+                CS_VM_NEXT();
             }
-            case CsCodeCallArg | CsRetNull:
-            case CsCodeCallArg | CsRetString:
-            case CsCodeCallArg | CsRetFloat:
-            case CsCodeCallArg | CsRetInt: {
+            CS_VM_CASE(CsCodeCallArg, CsRetNull)
+            CS_VM_CASE(CsCodeCallArg, CsRetString)
+            CS_VM_CASE(CsCodeCallArg, CsRetFloat)
+            CS_VM_CASE(CsCodeCallArg, CsRetInt) {
                 result.force_null();
                 cs_ident *id = cs.p_state->identmap[op >> 13];
                 int callargs = (op >> 8) & 0x1F, offset = numargs - callargs;
                 if (!cs_is_arg_used(cs, id)) {
                     numargs = offset;
                     force_arg(result, op & CsCodeRetMask);
-                    continue;
+                    CS_VM_NEXT();
                 }
                 cs_call_alias(
-                    cs, static_cast<cs_alias *>(id), args, result, callargs,
-                    numargs, offset, 0, op
+                    cs, cs_alias_internal::get(cs, static_cast<cs_alias *>(id)),
+                    args, result, callargs, numargs, offset, 0, op
                 );
-                continue;
+                CS_VM_LOOPCHECK();
+                CS_VM_NEXT();
             }
 
-            case CsCodeCallU | CsRetNull:
-            case CsCodeCallU | CsRetString:
-            case CsCodeCallU | CsRetFloat:
-            case CsCodeCallU | CsRetInt: {
+            CS_VM_CASE(CsCodeCallU, CsRetNull)
+            CS_VM_CASE(CsCodeCallU, CsRetString)
+            CS_VM_CASE(CsCodeCallU, CsRetFloat)
+            CS_VM_CASE(CsCodeCallU, CsRetInt) {
                 int callargs = op >> 8, offset = numargs - callargs;
                 cs_value &idarg = args[offset - 1];
                 if (
@@ -1504,9 +2449,9 @@ litval:
                     result = std::move(idarg);
                     force_arg(result, op & CsCodeRetMask);
                     numargs = offset - 1;
-                    continue;
+                    CS_VM_NEXT();
                 }
-                cs_ident *id = cs.get_ident(idarg.get_strr());
+                cs_ident *id = cs_get_ident(cs, idarg);
                 if (!id) {
 noid:
                     if (cs_check_num(idarg.get_strr())) {
@@ -1524,7 +2469,7 @@ noid:
                         if (!cs_cmd_internal::has_cb(id)) {
                             numargs = offset - 1;
                             force_arg(result, op & CsCodeRetMask);
-                            continue;
+                            CS_VM_NEXT();
                         }
                     /* fallthrough */
                     case CsIdCommand:
@@ -1534,19 +2479,20 @@ noid:
                         );
                         force_arg(result, op & CsCodeRetMask);
                         numargs = offset - 1;
-                        continue;
+                        CS_VM_LOOPCHECK();
+                        CS_VM_NEXT();
                     case CsIdLocal: {
                         cs_ident_stack locals[MaxArguments];
                         for (size_t j = 0; j < size_t(callargs); ++j) {
-                            cs_push_alias(cs.force_ident(
+                            cs_push_alias(cs, cs.force_ident(
                                 args[offset + j]
                             ), locals[j]);
                         }
                         cs_do_and_cleanup([&]() {
-                            code = runcode(cs, code, result);
+                            code = runops(cs, code, result);
                         }, [&]() {
                             for (size_t j = 0; j < size_t(callargs); ++j) {
-                                cs_pop_alias(args[offset + j].get_ident());
+                                cs_pop_alias(cs, args[offset + j].get_ident());
                             }
                         });
                         return code;
@@ -1562,7 +2508,7 @@ noid:
                         }
                         numargs = offset - 1;
                         force_arg(result, op & CsCodeRetMask);
-                        continue;
+                        CS_VM_NEXT();
                     case CsIdFvar:
                         if (callargs <= 0) {
                             cs.print_var(static_cast<cs_var *>(id));
@@ -1574,7 +2520,7 @@ noid:
                         }
                         numargs = offset - 1;
                         force_arg(result, op & CsCodeRetMask);
-                        continue;
+                        CS_VM_NEXT();
                     case CsIdSvar:
                         if (callargs <= 0) {
                             cs.print_var(static_cast<cs_var *>(id));
@@ -1586,16 +2532,18 @@ noid:
                         }
                         numargs = offset - 1;
                         force_arg(result, op & CsCodeRetMask);
-                        continue;
+                        CS_VM_NEXT();
                     case CsIdAlias: {
-                        cs_alias *a = static_cast<cs_alias *>(id);
+                        cs_alias *a = cs_alias_internal::get(
+                            cs, static_cast<cs_alias *>(id)
+                        );
                         if (
                             (a->get_index() < MaxArguments) &&
                             !cs_is_arg_used(cs, a)
                         ) {
                             numargs = offset - 1;
                             force_arg(result, op & CsCodeRetMask);
-                            continue;
+                            CS_VM_NEXT();
                         }
                         if (a->get_value().get_type() == cs_value_type::Null) {
                             goto noid;
@@ -1604,33 +2552,79 @@ noid:
                             cs, a, args, result, callargs, numargs,
                             offset, 1, op
                         );
-                        continue;
+                        CS_VM_LOOPCHECK();
+                        CS_VM_NEXT();
                     }
                 }
             }
+            CS_VM_DEFAULT
+                CS_VM_NEXT();
         }
     }
     return code;
 }
 
+/* a budget is counted in the code words runs go through, from where they
+ * start to where they return, so the dispatch loop has nothing to count;
+ * that includes operands and code jumped over, and leaves out runs that
+ * fail; each run that starts with none left is where it is enforced
+ */
+static uint32_t *runcode_limited(
+    cs_state &cs, uint32_t *code, cs_value &result, cs_value *args
+) {
+    if (cs.p_budget <= 0) {
+        cs_budget_exceeded(cs);
+    }
+    uint32_t *ret = runops(cs, code, result, args);
+    if (cs.p_limited) {
+        cs.p_budget -= (ret - code);
+    }
+    return ret;
+}
+
+static inline uint32_t *runcode(
+    cs_state &cs, uint32_t *code, cs_value &result, cs_value *args
+) {
+    if (cs.p_limited) {
+        return runcode_limited(cs, code, result, args);
+    }
+    return runops(cs, code, result, args);
+}
+
+/* for code inside the run, which the run counts as its own */
+static uint32_t *runops(cs_state &cs, uint32_t *code, cs_value &result) {
+    ValueStackRef frame{cs, MaxArguments + MaxResults};
+    return runops(cs, code, result, frame.get());
+}
+
+static uint32_t *runcode(cs_state &cs, uint32_t *code, cs_value &result) {
+    ValueStackRef frame{cs, MaxArguments + MaxResults};
+    return runcode(cs, code, result, frame.get());
+}
+
 void cs_state::run(cs_bcode *code, cs_value &ret) {
     runcode(*this, reinterpret_cast<uint32_t *>(code), ret);
 }
 
-static void cs_run(
-    cs_state &cs, ostd::string_range file, ostd::string_range code,
-    cs_value &ret
+static uint32_t *cs_compile(
+    cs_state &cs, ostd::string_range file, ostd::string_range code
 ) {
     cs_gen_state gs(cs);
     gs.src_name = file;
     gs.code.reserve(64);
     gs.gen_main(code, CsValAny);
     gs.done();
-    uint32_t *cbuf = new uint32_t[gs.code.size()];
-    memcpy(cbuf, gs.code.data(), gs.code.size() * sizeof(uint32_t));
+    return gs.code.release();
+}
+
+static void cs_run(
+    cs_state &cs, ostd::string_range file, ostd::string_range code,
+    cs_value &ret
+) {
+    uint32_t *cbuf = cs_compile(cs, file, code);
     runcode(cs, cbuf + 1, ret);
     if (int(cbuf[0]) < 0x100) {
-        delete[] cbuf;
+        bcode_free(cbuf);
     }
 }
 
@@ -1651,10 +2645,12 @@ void cs_state::run(cs_ident *id, cs_value_r args, cs_value &ret) {
             /* fallthrough */
             case cs_ident_type::Command:
                 if (nargs < static_cast<cs_command *>(id)->get_num_args()) {
-                    cs_value buf[MaxArguments];
-                    memcpy(buf, &args[0], args.size() * sizeof(cs_value));
+                    ValueStackRef buf{*this, MaxArguments};
+                    for (size_t i = 0; i < args.size(); ++i) {
+                        buf.get()[i] = args[i];
+                    }
                     callcommand(
-                        *this, static_cast<cs_command *>(id), buf, ret,
+                        *this, static_cast<cs_command *>(id), buf.get(), ret,
                         nargs, false
                     );
                 } else {
@@ -1691,7 +2687,9 @@ void cs_state::run(cs_ident *id, cs_value_r args, cs_value &ret) {
                 }
                 break;
             case cs_ident_type::Alias: {
-                cs_alias *a = static_cast<cs_alias *>(id);
+                cs_alias *a = cs_alias_internal::get(
+                    *this, static_cast<cs_alias *>(id)
+                );
                 if (
                     (a->get_index() < MaxArguments) && !cs_is_arg_used(*this, a)
                 ) {
@@ -1800,17 +2798,15 @@ CsLoopState cs_state::run_loop(cs_bcode *code, cs_value &ret) {
     ++p_inloop;
     try {
         run(code, ret);
-    } catch (CsBreakException) {
-        --p_inloop;
-        return CsLoopState::Break;
-    } catch (CsContinueException) {
-        --p_inloop;
-        return CsLoopState::Continue;
     } catch (...) {
         --p_inloop;
+        p_loopstate = CsLoopState::Normal;
         throw;
     }
-    return CsLoopState::Normal;
+    --p_inloop;
+    CsLoopState st = p_loopstate;
+    p_loopstate = CsLoopState::Normal;
+    return st;
 }
 
 CsLoopState cs_state::run_loop(cs_bcode *code) {
@@ -1818,6 +2814,63 @@ CsLoopState cs_state::run_loop(cs_bcode *code) {
     return run_loop(code, ret);
 }
 
+void cs_file_cache::trim() noexcept {
+    while (files.size() > limit) {
+        auto old = files.begin();
+        for (auto it = files.begin(); it != files.end(); ++it) {
+            if (it->second.used < old->second.used) {
+                old = it;
+            }
+        }
+        bcode_decr(old->second.code);
+        files.erase(old);
+    }
+}
+
+void cs_file_cache::clear() noexcept {
+    for (auto &p: files) {
+        bcode_decr(p.second.code);
+    }
+    files.clear();
+}
+
+size_t cs_state::get_file_cache_hits() const {
+    std::lock_guard<std::mutex> l{p_state->files.lock};
+    return p_state->files.hits;
+}
+
+size_t cs_state::get_file_cache_misses() const {
+    std::lock_guard<std::mutex> l{p_state->files.lock};
+    return p_state->files.misses;
+}
+
+size_t cs_state::get_file_cache_limit() const {
+    std::lock_guard<std::mutex> l{p_state->files.lock};
+    return p_state->files.limit;
+}
+
+void cs_state::set_file_cache_limit(size_t n) {
+    std::lock_guard<std::mutex> l{p_state->files.lock};
+    p_state->files.limit = n;
+    p_state->files.trim();
+}
+
+void cs_state::clear_file_cache() {
+    std::lock_guard<std::mutex> l{p_state->files.lock};
+    p_state->files.clear();
+}
+
+/* the entry may get replaced while running, by the file itself or another
+ * thread, so the code is run with a ref taken while the cache was locked
+ */
+static void cs_run_cached(cs_state &cs, uint32_t *code, cs_value &ret) {
+    cs_do_and_cleanup([&]() {
+        runcode(cs, code + 1, ret);
+    }, [code]() {
+        bcode_decr(code);
+    });
+}
+
 static bool cs_run_file(
     cs_state &cs, ostd::string_range fname, cs_value &ret
 ) {
@@ -1841,7 +2894,43 @@ static bool cs_run_file(
     }
     buf[len] = '\0';
 
-    cs_run(cs, fname, ostd::string_range(buf.get(), buf.get() + len), ret);
+    ostd::string_range src{buf.get(), buf.get() + len};
+    cs_file_cache &fc = cs.p_state->files;
+    cs_string key{fname};
+    size_t h = cs_hash_str(src);
+    std::unique_lock<std::mutex> lk{fc.lock};
+    auto ent = fc.files.find(key);
+    if (
+        (ent != fc.files.end()) &&
+        (ent->second.hash == h) && (ent->second.size == len)
+    ) {
+        ++fc.hits;
+        ent->second.used = ++fc.clock;
+        uint32_t *code = ent->second.code;
+        bcode_incr(code);
+        lk.unlock();
+        cs_run_cached(cs, code, ret);
+        return true;
+    }
+    ++fc.misses;
+    lk.unlock();
+    uint32_t *code = cs_compile(cs, fname, src);
+    /* one ref for the cache and one for the run */
+    bcode_incr(code);
+    bcode_incr(code);
+    lk.lock();
+    ent = fc.files.find(key);
+    if (ent != fc.files.end()) {
+        bcode_decr(ent->second.code);
+        ent->second = cs_file_cache::entry{code, len, h, ++fc.clock};
+    } else {
+        fc.files.emplace(
+            std::move(key), cs_file_cache::entry{code, len, h, ++fc.clock}
+        );
+    }
+    fc.trim();
+    lk.unlock();
+    cs_run_cached(cs, code, ret);
     return true;
 }
 
@@ -1889,4 +2978,845 @@ bool cs_state::run_file(ostd::string_range fname) {
     return true;
 }
 
+cs_bcode_ref cs_state::compile(
+    ostd::string_range code, ostd::string_range src_name
+) {
+    uint32_t *cbuf = cs_compile(*this, src_name, code);
+    return cs_bcode_ref{reinterpret_cast<cs_bcode *>(cbuf + 1)};
+}
+
+/* saved code is a header, the identifiers and interned strings the code
+ * refers to and the instructions with those references turned into indices
+ * into the two tables; it is in native byte order, which the magic number
+ * also checks, and locals are saved without slots; loading checks all of
+ * it before anything can run, see bcode_check, and gives out the slots
+ */
+static constexpr uint32_t CsBcodeMagic = 0x43534243;
+
+enum {
+    CsOperandNone = 0, CsOperandIdent, CsOperandCall, CsOperandString
+};
+
+/* what the operand of an instruction refers to, and how many words of
+ * inline data follow it
+ */
+static int bcode_operand(uint32_t op, size_t &extra) {
+    extra = 0;
+    switch (op & 0xFF) {
+        case CsCodeMacro:
+        case CsCodeVal | CsRetString:
+            extra = (op >> 8) / sizeof(uint32_t) + 1;
+            return CsOperandNone;
+        case CsCodeVal | CsRetInt:
+            extra = CsTypeStorageSize<cs_int>;
+            return CsOperandNone;
+        case CsCodeVal | CsRetFloat:
+            extra = CsTypeStorageSize<cs_float>;
+            return CsOperandNone;
+        case CsCodeMacro | CsCodeFlagIntern:
+            return CsOperandString;
+    }
+    switch (op & CsCodeOpMask) {
+        case CsCodePrint:
+        case CsCodeIdent: case CsCodeIdentArg:
+        case CsCodeLookup: case CsCodeLookupArg:
+        case CsCodeLookupM: case CsCodeLookupMarg:
+        case CsCodeSvar: case CsCodeSvarM: case CsCodeSvar1:
+        case CsCodeIvar: case CsCodeIvar1: case CsCodeIvar2: case CsCodeIvar3:
+        case CsCodeFvar: case CsCodeFvar1:
+        case CsCodeCom:
+        case CsCodeAlias: case CsCodeAliasArg:
+            return CsOperandIdent;
+        case CsCodeComC: case CsCodeComV:
+        case CsCodeCall: case CsCodeCallArg:
+        case CsCodeMath:
+            /* the argument count sits below the index */
+            return CsOperandCall;
+    }
+    return CsOperandNone;
+}
+
+/* whether name is in s as a word of its own, the way a string looked up or
+ * run as code would refer to it
+ */
+static bool cs_str_names(ostd::string_range s, ostd::string_range name) {
+    auto delim = [](char c) {
+        return isspace(static_cast<unsigned char>(c)) ||
+            strchr("\"/;()[]$@^=", c);
+    };
+    for (size_t i = 0; (i + name.size()) <= s.size(); ++i) {
+        size_t e = i + name.size();
+        if (
+            (!i || delim(s[i - 1])) && ((e == s.size()) || delim(s[e])) &&
+            !memcmp(&s[i], &name[0], name.size())
+        ) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/* the string a value instruction pushes, if any; short ones are put
+ * together in buf
+ */
+static bool cs_code_str(
+    cs_state &cs, uint32_t const *code, char (&buf)[4],
+    ostd::string_range &ret
+) {
+    uint32_t op = *code;
+    switch (op & 0xFF) {
+        case CsCodeMacro:
+        case CsCodeVal | CsRetString:
+            ret = ostd::string_range(
+                reinterpret_cast<char const *>(code + 1),
+                reinterpret_cast<char const *>(code + 1) + (op >> 8)
+            );
+            return true;
+        case CsCodeMacro | CsCodeFlagIntern:
+            ret = cs.p_state->strings.get(op >> 8)->str();
+            return true;
+        case CsCodeValInt | CsRetString: {
+            size_t len = 0;
+            while ((len < 3) && (buf[len] = char(op >> ((len + 1) * 8)))) {
+                ++len;
+            }
+            ret = ostd::string_range(buf, buf + len);
+            return true;
+        }
+    }
+    return false;
+}
+
+/* a local stays on its alias when anything could get at it by name: calls
+ * of aliases, which see it as dynamic scoping has it, commands other than
+ * those flagged CS_IDF_NONAMES and variable callbacks, which may look up
+ * or run anything, names or code made at runtime, passing it as an
+ * identifier, strings naming it or blocks using it, which may be run from
+ * anywhere; the rest of the block then reads and writes the slots,
+ * counting the frames of other such locals in between
+ */
+void cs_code_locals(
+    cs_state &cs, uint32_t *code, cs_vector<size_t> const &locals
+) {
+    cs_vector<std::pair<size_t, uint32_t>> uses;
+    cs_vector<size_t> blocks, frames;
+    /* the inner ones first, so their frames are known to the outer ones */
+    for (size_t li = locals.size(); li--;) {
+        size_t p = locals[li];
+        uint32_t lop = code[p];
+        size_t n = lop >> 8;
+        if (((lop & 0xFF) != CsCodeLocal) || !n || (n >= p)) {
+            continue;
+        }
+        cs_ident *names[MaxArguments];
+        bool slots = true;
+        for (size_t i = 0; slots && (i < n); ++i) {
+            uint32_t iop = code[p - n + i];
+            /* the words before may be inline data rather than names */
+            if ((iop & 0xFF) != CsCodeIdent) {
+                slots = false;
+                break;
+            }
+            cs_ident *id = cs.p_state->identmap[iop >> 8];
+            slots = id->is_alias() && (id->get_index() >= MaxArguments) &&
+                (std::find(names, names + i, id) == (names + i));
+            names[i] = id;
+        }
+        size_t end = skipcode(&code[p + 1]) - code;
+        uses.clear();
+        blocks.clear();
+        frames.clear();
+        for (size_t q = p + 1; slots && (q < end); ++q) {
+            while (!blocks.empty() && (blocks.back() <= q)) {
+                blocks.pop_back();
+            }
+            while (!frames.empty() && (frames.back() <= q)) {
+                frames.pop_back();
+            }
+            uint32_t op = code[q];
+            size_t extra;
+            bcode_operand(op, extra);
+            char sbuf[4];
+            ostd::string_range str;
+            if (cs_code_str(cs, &code[q], sbuf, str)) {
+                for (size_t i = 0; slots && (i < n); ++i) {
+                    slots = !cs_str_names(str, names[i]->get_name());
+                }
+            }
+            switch (op & CsCodeOpMask) {
+                case CsCodeCall: case CsCodeCallU: case CsCodeCallArg:
+                case CsCodeIdentU: case CsCodeLookupU: case CsCodeLookupMu:
+                case CsCodeAliasU: case CsCodeCompile: case CsCodeCond:
+                case CsCodeIvar1: case CsCodeIvar2: case CsCodeIvar3:
+                case CsCodeFvar1: case CsCodeSvar1: case CsCodePrint:
+                    slots = false;
+                    break;
+                case CsCodeCom:
+                    slots = cs.p_state->identmap[op >> 8]->get_flags() &
+                        CS_IDF_NONAMES;
+                    break;
+                case CsCodeComC: case CsCodeComV:
+                    slots = cs.p_state->identmap[op >> 13]->get_flags() &
+                        CS_IDF_NONAMES;
+                    break;
+                case CsCodeIdent:
+                case CsCodeLookup: case CsCodeLookupM: case CsCodeAlias: {
+                    cs_ident *id = cs.p_state->identmap[op >> 8];
+                    size_t i = std::find(names, names + n, id) - names;
+                    if (i == n) {
+                        break;
+                    }
+                    uint32_t up = uint32_t(frames.size());
+                    if (
+                        ((op & CsCodeOpMask) == CsCodeIdent) ||
+                        !blocks.empty() || (up >> (32 - CsCodeSlotUp))
+                    ) {
+                        slots = false;
+                        break;
+                    }
+                    uint32_t sop = uint32_t(i << 8) | (up << CsCodeSlotUp);
+                    switch (op & CsCodeOpMask) {
+                        case CsCodeLookupM:
+                            sop |= CsCodeSlotM;
+                            /* fallthrough */
+                        case CsCodeLookup:
+                            sop |= CsCodeLookupSlot | (op & CsCodeRetMask);
+                            break;
+                        default:
+                            sop |= CsCodeAliasSlot;
+                            break;
+                    }
+                    uses.emplace_back(q, sop);
+                    break;
+                }
+                case CsCodeBlock:
+                    blocks.push_back(q + 1 + (op >> 8));
+                    break;
+                case CsCodeLocal:
+                    if (op & CsCodeFlagSlots) {
+                        frames.push_back(skipcode(&code[q + 1]) - code);
+                    }
+                    break;
+            }
+            q += extra;
+        }
+        if (!slots) {
+            continue;
+        }
+        code[p] = lop | CsCodeFlagSlots;
+        for (auto &u: uses) {
+            code[u.first] = u.second;
+        }
+    }
+}
+
+template<typename T>
+static uint32_t bcode_table_idx(
+    T *v, cs_vector<T *> &tbl, cs_map<T *, uint32_t> &idxs
+) {
+    auto it = idxs.emplace(v, uint32_t(tbl.size()));
+    if (it.second) {
+        tbl.push_back(v);
+    }
+    return it.first->second;
+}
+
+static void bcode_put_str(ostd::stream &s, ostd::string_range str) {
+    s.put<uint32_t>(uint32_t(str.size()));
+    s.put(str.data(), str.size());
+}
+
+/* reads n items a piece at a time, so that a count that is off runs into
+ * the end of the stream instead of allocating all of it up front
+ */
+template<typename C>
+static void bcode_read(cs_state &cs, ostd::stream &s, C &out, size_t n) {
+    out.clear();
+    while (out.size() < n) {
+        size_t off = out.size(), k = std::min(n - off, size_t(4096));
+        out.resize(off + k);
+        if (s.get(&out[off], k) != k) {
+            throw cs_error(cs, "truncated bytecode");
+        }
+    }
+}
+
+static cs_string bcode_get_str(cs_state &cs, ostd::stream &s) {
+    cs_string ret;
+    bcode_read(cs, s, ret, s.get<uint32_t>());
+    return ret;
+}
+
+void cs_state::save_code(cs_bcode *code, ostd::stream &s) {
+    uint32_t *beg = reinterpret_cast<uint32_t *>(code);
+    cs_vector<uint32_t> out(beg, skipcode(beg));
+    cs_vector<cs_ident *> ids;
+    cs_vector<cs_strent *> strs;
+    cs_map<cs_ident *, uint32_t> ididx;
+    cs_map<cs_strent *, uint32_t> stridx;
+    /* which locals get slots is up to the state loading the code, so the
+     * slots are turned back into the names: the end of each frame of slots
+     * and the identifiers naming them
+     */
+    cs_vector<std::pair<size_t, uint32_t const *>> frames;
+    for (size_t i = 0; i < out.size(); ++i) {
+        while (!frames.empty() && (frames.back().first <= i)) {
+            frames.pop_back();
+        }
+        uint32_t op = out[i];
+        switch (op & CsCodeOpMask) {
+            case CsCodeLocal:
+                if (op & CsCodeFlagSlots) {
+                    op &= ~uint32_t(CsCodeFlagSlots);
+                    frames.emplace_back(
+                        skipcode(&beg[i + 1]) - beg, &beg[i - (op >> 8)]
+                    );
+                }
+                break;
+            case CsCodeLookupSlot:
+            case CsCodeAliasSlot: {
+                auto &fr = frames[frames.size() - 1 - (op >> CsCodeSlotUp)];
+                uint32_t idx = fr.second[(op >> 8) & CsCodeSlotMask] >> 8;
+                if ((op & CsCodeOpMask) == CsCodeAliasSlot) {
+                    op = CsCodeAlias;
+                } else {
+                    op = (op & CsCodeRetMask) |
+                        ((op & CsCodeSlotM) ? CsCodeLookupM : CsCodeLookup);
+                }
+                op |= idx << 8;
+                break;
+            }
+        }
+        size_t extra;
+        switch (bcode_operand(op, extra)) {
+            case CsOperandIdent:
+                out[i] = (op & 0xFF) | (bcode_table_idx(
+                    p_state->identmap[op >> 8], ids, ididx
+                ) << 8);
+                break;
+            case CsOperandCall:
+                out[i] = (op & 0x1FFF) | (bcode_table_idx(
+                    p_state->identmap[op >> 13], ids, ididx
+                ) << 13);
+                break;
+            case CsOperandString:
+                out[i] = (op & 0xFF) | (bcode_table_idx(
+                    p_state->strings.get(op >> 8), strs, stridx
+                ) << 8);
+                break;
+            default:
+                if ((op & CsCodeOpMask) == CsCodeOffset) {
+                    /* depends on where the code is, redone on load */
+                    op = CsCodeOffset;
+                }
+                out[i] = op;
+                break;
+        }
+        i += extra;
+    }
+    s.put<uint32_t>(CsBcodeMagic);
+    s.put<uint32_t>(CsBcodeVersion);
+    s.put<uint32_t>((sizeof(cs_int) << 8) | sizeof(cs_float));
+    s.put<uint32_t>(uint32_t(ids.size()));
+    for (cs_ident *id: ids) {
+        s.put<uint32_t>(uint32_t(id->get_type_raw()));
+        bcode_put_str(s, id->get_name());
+    }
+    s.put<uint32_t>(uint32_t(strs.size()));
+    for (cs_strent *str: strs) {
+        bcode_put_str(s, str->str());
+    }
+    s.put<uint32_t>(uint32_t(out.size()));
+    s.put(out.data(), out.size());
+}
+
+static int bcode_id_type(int type) {
+    return (type == CsIdMath) ? CsIdCommand : type;
+}
+
+/* what loading knows of a value on the stack; code and identifiers are
+ * what some instructions and commands take without checking the type
+ */
+enum {
+    CsKindAny = 0, CsKindCode, CsKindIdent
+};
+
+struct cs_bcode_stack {
+    int depth = 0;
+    uint8_t kinds[MaxArguments + MaxResults];
+};
+
+struct cs_bcode_check {
+    cs_state &cs;
+    uint32_t const *code;
+    /* which words are instructions rather than inline data */
+    cs_vector<bool> insns;
+    cs_vector<size_t> locals;
+    int nest;
+};
+
+/* the kind of value a command takes as argument i, from its format */
+static int bcode_arg_kind(ostd::string_range fmt, size_t i) {
+    int kinds[MaxArguments];
+    size_t n = 0, rep = 0;
+    for (; !fmt.empty() && (n < MaxArguments); ++fmt) {
+        switch (*fmt) {
+            case 'e':
+                kinds[n++] = CsKindCode;
+                break;
+            case 'r':
+            case '$':
+                kinds[n++] = CsKindIdent;
+                break;
+            case '1':
+            case '2':
+            case '3':
+            case '4':
+                rep = size_t(*fmt - '0');
+                break;
+            case 'C':
+            case 'V':
+                break;
+            default:
+                kinds[n++] = CsKindAny;
+                break;
+        }
+    }
+    if (i < n) {
+        return kinds[i];
+    }
+    if (!rep || (rep > n)) {
+        return CsKindAny;
+    }
+    return kinds[n - rep + (i - n) % rep];
+}
+
+static bool bcode_is_alias(cs_ident *id, bool arg) {
+    return id->is_alias() && ((id->get_index() < MaxArguments) == arg);
+}
+
+/* goes through the region of code from pos to the exit ending it, which
+ * has to come before end, the way runops would; the instructions have to
+ * be valid, take identifiers of the kind they expect and keep the stack of
+ * the frame in bounds, and jumps have to land on an instruction of the
+ * region with the same stack from wherever they come from
+ */
+static size_t bcode_check(cs_bcode_check &bc, size_t pos, size_t end) {
+    cs_state &cs = bc.cs;
+    uint32_t const *code = bc.code;
+    auto bad = [&cs]() {
+        return cs_error(cs, "malformed bytecode");
+    };
+    if (++bc.nest > MaxRunDepth) {
+        throw bad();
+    }
+    cs_bcode_stack st;
+    cs_vector<std::pair<size_t, cs_bcode_stack>> jumps;
+    /* after a jump or a break, until something jumps here */
+    bool dead = false;
+    auto pop = [&](size_t n) {
+        if (n > size_t(st.depth)) {
+            throw bad();
+        }
+        st.depth -= int(n);
+    };
+    auto push = [&](int kind) {
+        if (st.depth >= (MaxArguments + MaxResults)) {
+            throw bad();
+        }
+        st.kinds[st.depth++] = uint8_t(kind);
+    };
+    auto top = [&](int kind) -> uint8_t & {
+        if (
+            !st.depth ||
+            ((kind != CsKindAny) && (st.kinds[st.depth - 1] != kind))
+        ) {
+            throw bad();
+        }
+        return st.kinds[st.depth - 1];
+    };
+    auto want = [&](bool v) {
+        if (!v) {
+            throw bad();
+        }
+    };
+    auto jump = [&](size_t to) {
+        want(to < end);
+        jumps.emplace_back(to, st);
+    };
+    /* any command but local, which has no callback */
+    auto call = [&](cs_ident *id, int n) {
+        want(
+            (id->is_command() || id->is_special()) &&
+            (id->get_type_raw() != CsIdLocal)
+        );
+        cs_command *cmd = static_cast<cs_command *>(id);
+        if (n < 0) {
+            n = cmd->get_num_args();
+        }
+        want((n <= MaxArguments) && (n <= st.depth));
+        auto fmt = cmd->get_args();
+        for (int i = 0; i < n; ++i) {
+            int kind = bcode_arg_kind(fmt, i);
+            want(
+                (kind == CsKindAny) || (st.kinds[st.depth - n + i] == kind)
+            );
+        }
+        pop(n);
+    };
+    while (pos < end) {
+        bool hit = false;
+        for (size_t i = 0; i < jumps.size();) {
+            if (jumps[i].first != pos) {
+                ++i;
+                continue;
+            }
+            cs_bcode_stack &js = jumps[i].second;
+            if (dead && !hit) {
+                st = js;
+            } else {
+                want(js.depth == st.depth);
+                for (int j = 0; j < st.depth; ++j) {
+                    if (st.kinds[j] != js.kinds[j]) {
+                        st.kinds[j] = CsKindAny;
+                    }
+                }
+            }
+            hit = true;
+            jumps[i] = jumps.back();
+            jumps.pop_back();
+        }
+        dead = false;
+        uint32_t op = code[pos];
+        size_t extra;
+        int opr = bcode_operand(op, extra);
+        want(!cs_opcode_name(op & 0xFF).empty() && ((pos + extra) < end));
+        bc.insns[pos] = true;
+        cs_ident *id = nullptr;
+        if (opr == CsOperandIdent) {
+            id = cs.p_state->identmap[op >> 8];
+        } else if (opr == CsOperandCall) {
+            id = cs.p_state->identmap[op >> 13];
+        }
+        size_t next = pos + 1 + extra;
+        switch (op & CsCodeOpMask) {
+            case CsCodeStart:
+            case CsCodeLookupSlot:
+            case CsCodeAliasSlot:
+                /* slots are only ever given out on load */
+                throw bad();
+            case CsCodeOffset:
+            case CsCodeNull:
+            case CsCodeTrue:
+            case CsCodeFalse:
+                break;
+            case CsCodeNot:
+            case CsCodePop:
+            case CsCodeResult:
+            case CsCodeAliasU:
+                pop(((op & CsCodeOpMask) == CsCodeAliasU) ? 2 : 1);
+                break;
+            case CsCodeEnter:
+            case CsCodeEnterResult:
+                next = bcode_check(bc, pos + 1, end);
+                if ((op & CsCodeOpMask) == CsCodeEnter) {
+                    push(CsKindAny);
+                }
+                break;
+            case CsCodeExit:
+                want(jumps.empty());
+                --bc.nest;
+                return pos + 1;
+            case CsCodeResultArg:
+            case CsCodeVal:
+            case CsCodeValInt:
+            case CsCodeMacro:
+                push(CsKindAny);
+                break;
+            case CsCodeDup: {
+                int kind = top(CsKindAny);
+                push(((op & CsCodeRetMask) == CsRetNull) ? kind : CsKindAny);
+                break;
+            }
+            case CsCodeBlock:
+                /* values of the block find the buffer through the offset */
+                next += op >> 8;
+                want(
+                    (next < end) && ((op >> 8) >= 2) &&
+                    ((code[pos + 1] & CsCodeOpMask) == CsCodeOffset) &&
+                    (bcode_check(bc, pos + 1, next) == next)
+                );
+                push(CsKindCode);
+                break;
+            case CsCodeEmpty:
+                push(CsKindCode);
+                break;
+            case CsCodeCompile:
+                top(CsKindAny) = CsKindCode;
+                break;
+            case CsCodeCond:
+            case CsCodeForce:
+            case CsCodeLookupU:
+            case CsCodeLookupMu:
+                top(CsKindAny) = CsKindAny;
+                break;
+            case CsCodeIdent:
+                push(CsKindIdent);
+                break;
+            case CsCodeIdentArg:
+                want(bcode_is_alias(id, true));
+                push(CsKindIdent);
+                break;
+            case CsCodeIdentU:
+                top(CsKindAny) = CsKindIdent;
+                break;
+            case CsCodeCom:
+                call(id, -1);
+                break;
+            case CsCodeComC:
+            case CsCodeComV:
+                call(id, int((op >> 8) & 0x1F));
+                break;
+            case CsCodeConc:
+            case CsCodeConcW:
+                pop(op >> 8);
+                push(CsKindAny);
+                break;
+            case CsCodeConcM:
+                pop(op >> 8);
+                break;
+            case CsCodeSvar:
+            case CsCodeSvarM:
+                want(id->get_type_raw() == CsIdSvar);
+                push(CsKindAny);
+                break;
+            case CsCodeIvar:
+                want(id->get_type_raw() == CsIdIvar);
+                push(CsKindAny);
+                break;
+            case CsCodeFvar:
+                want(id->get_type_raw() == CsIdFvar);
+                push(CsKindAny);
+                break;
+            case CsCodeSvar1:
+                want(id->get_type_raw() == CsIdSvar);
+                pop(1);
+                break;
+            case CsCodeIvar1:
+            case CsCodeIvar2:
+            case CsCodeIvar3:
+                want(id->get_type_raw() == CsIdIvar);
+                pop((op & CsCodeOpMask) - CsCodeIvar);
+                break;
+            case CsCodeFvar1:
+                want(id->get_type_raw() == CsIdFvar);
+                pop(1);
+                break;
+            case CsCodePrint:
+                want(id->is_var());
+                break;
+            case CsCodeLookup:
+            case CsCodeLookupM:
+                want(bcode_is_alias(id, false));
+                push(CsKindAny);
+                break;
+            case CsCodeLookupArg:
+            case CsCodeLookupMarg:
+                want(bcode_is_alias(id, true));
+                push(CsKindAny);
+                break;
+            case CsCodeAlias:
+            case CsCodeAliasArg:
+                want(bcode_is_alias(
+                    id, (op & CsCodeOpMask) == CsCodeAliasArg
+                ));
+                pop(1);
+                break;
+            case CsCodeCall:
+            case CsCodeCallArg:
+                want(
+                    bcode_is_alias(id, (op & CsCodeOpMask) == CsCodeCallArg) &&
+                    (((op >> 8) & 0x1F) <= MaxArguments)
+                );
+                pop((op >> 8) & 0x1F);
+                break;
+            case CsCodeCallU:
+                want((op >> 8) <= MaxArguments);
+                pop((op >> 8) + 1);
+                break;
+            case CsCodeLocal: {
+                /* the rest of the region runs in a frame of its own */
+                size_t n = op >> 8;
+                want(
+                    !(op & CsCodeFlagSlots) && (n <= MaxArguments) &&
+                    (n <= size_t(st.depth)) && jumps.empty()
+                );
+                bool names = (n < pos);
+                for (size_t i = 0; i < n; ++i) {
+                    want(st.kinds[st.depth - 1 - i] == CsKindIdent);
+                    names = names && bc.insns[pos - 1 - i];
+                }
+                if (names) {
+                    bc.locals.push_back(pos);
+                }
+                st.depth = 0;
+                break;
+            }
+            case CsCodeDo:
+            case CsCodeDoArgs:
+                top(CsKindCode);
+                pop(1);
+                break;
+            case CsCodeJump:
+                jump(next + (op >> 8));
+                dead = true;
+                break;
+            case CsCodeJumpB:
+            case CsCodeJumpResult:
+                pop(1);
+                jump(next + (op >> 8));
+                break;
+            case CsCodeBreak:
+                dead = true;
+                break;
+            case CsCodeLoop: {
+                want(
+                    !(op & CsCodeLoopStep) || !(op & CsCodeLoopStepLast)
+                );
+                pop(cs_loop_numargs(op));
+                size_t body = next;
+                next += op >> CsCodeLoopLen;
+                want(next < end);
+                if (op & CsCodeLoopCond) {
+                    body = bcode_check(bc, body, next);
+                    want(
+                        (body < next) &&
+                        (code[body] == (CsCodeBlock | ((next - body - 1) << 8)))
+                    );
+                    bc.insns[body++] = true;
+                }
+                want(bcode_check(bc, body, next) == next);
+                break;
+            }
+            case CsCodeMath:
+                want(
+                    (id->get_type_raw() == CsIdMath) &&
+                    (cs_math_op(id->get_name()) == int((op >> 8) & 0x1F))
+                );
+                pop(2);
+                break;
+        }
+        pos = next;
+    }
+    throw bad();
+}
+
+static cs_bcode_ref cs_load_code(cs_state &cs, ostd::stream &s) {
+    if (s.get<uint32_t>() != CsBcodeMagic) {
+        throw cs_error(cs, "not a bytecode stream");
+    }
+    uint32_t ver = s.get<uint32_t>();
+    if (ver != CsBcodeVersion) {
+        throw cs_error(cs, "unsupported bytecode version %d", ver);
+    }
+    if (s.get<uint32_t>() != ((sizeof(cs_int) << 8) | sizeof(cs_float))) {
+        throw cs_error(cs, "bytecode built with different value types");
+    }
+    /* nothing is allocated by the counts, they only run out the stream */
+    cs_vector<cs_ident *> ids;
+    for (size_t n = s.get<uint32_t>(); ids.size() < n;) {
+        int type = int(s.get<uint32_t>());
+        cs_string name = bcode_get_str(cs, s);
+        cs_ident *id = cs.get_ident(name);
+        if (!id && (type == CsIdAlias)) {
+            id = cs.new_ident(name);
+        }
+        /* math builtins and other commands may stand in for each other,
+         * CsCodeMath for a command that is not a builtin becomes a call
+         */
+        if (
+            !id || (bcode_id_type(id->get_type_raw()) != bcode_id_type(type))
+        ) {
+            throw cs_error(
+                cs, "bytecode identifier '%s' does not match", name
+            );
+        }
+        ids.push_back(id);
+    }
+    cs_vector<cs_strent *> strs;
+    for (size_t n = s.get<uint32_t>(); strs.size() < n;) {
+        strs.push_back(
+            cs.p_state->strings.intern(*cs.p_state, bcode_get_str(cs, s))
+        );
+    }
+    cs_vector<uint32_t> words;
+    bcode_read(cs, s, words, s.get<uint32_t>());
+    size_t len = words.size();
+    uint32_t *buf = bcode_alloc(cs.p_state, len + 1);
+    buf[0] = CsCodeStart;
+    /* owns the buffer from here on, even if anything below throws */
+    cs_bcode_ref ret{reinterpret_cast<cs_bcode *>(buf + 1)};
+    std::copy(words.begin(), words.end(), buf + 1);
+    for (size_t i = 1; i <= len; ++i) {
+        uint32_t op = buf[i];
+        size_t extra, idx = op >> 8, maxidx = 0xFFFFFF;
+        int opr = bcode_operand(op, extra);
+        if (opr == CsOperandCall) {
+            idx = op >> 13;
+            maxidx = 0x7FFFF;
+        }
+        if (
+            ((i + extra) > len) ||
+            ((opr == CsOperandString) && (idx >= strs.size())) ||
+            ((opr == CsOperandIdent || opr == CsOperandCall) &&
+                (idx >= ids.size()))
+        ) {
+            throw cs_error(cs, "malformed bytecode");
+        }
+        switch (opr) {
+            case CsOperandIdent:
+            case CsOperandCall:
+                idx = ids[idx]->get_index();
+                break;
+            case CsOperandString:
+                idx = strs[idx]->index;
+                break;
+            default:
+                if ((op & CsCodeOpMask) == CsCodeOffset) {
+                    buf[i] = CsCodeOffset | uint32_t((i + 1) << 8);
+                }
+                i += extra;
+                continue;
+        }
+        if (idx > maxidx) {
+            throw cs_error(cs, "too many identifiers to load bytecode");
+        }
+        buf[i] = (opr == CsOperandCall)
+            ? ((op & 0x1FFF) | uint32_t(idx << 13))
+            : ((op & 0xFF) | uint32_t(idx << 8));
+        if (
+            ((op & CsCodeOpMask) == CsCodeMath) &&
+            (ids[op >> 13]->get_type_raw() != CsIdMath)
+        ) {
+            buf[i] = CsCodeComV | (op & CsCodeRetMask) | (2 << 8) |
+                uint32_t(idx << 13);
+        }
+    }
+    cs_bcode_check bc{cs, buf, cs_vector<bool>(len + 1), {}, 0};
+    if (!len || (bcode_check(bc, 1, len + 1) != (len + 1))) {
+        throw cs_error(cs, "malformed bytecode");
+    }
+    /* the slots are given out by what this state knows of its commands */
+    cs_code_locals(cs, buf, bc.locals);
+    return ret;
+}
+
+cs_bcode_ref cs_state::load_code(ostd::stream &s) {
+    try {
+        return cs_load_code(*this, s);
+    } catch (ostd::stream_error const &) {
+        throw cs_error(*this, "truncated bytecode");
+    }
+}
+
 } /* namespace cscript */
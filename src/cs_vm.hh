@@ -5,10 +5,19 @@
 
 #include <cstdlib>
 #include <array>
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
 #include <vector>
 
 #include "cs_util.hh"
 
+namespace ostd {
+    struct thread_pool;
+}
+
 namespace cscript {
 
 static constexpr int MaxArguments = 25;
@@ -21,14 +30,20 @@ static constexpr int DbgaliasIdx = MaxArguments + 2;
 enum {
     CsIdUnknown = -1, CsIdIvar, CsIdFvar, CsIdSvar, CsIdCommand, CsIdAlias,
     CsIdLocal, CsIdDo, CsIdDoArgs, CsIdIf, CsIdBreak, CsIdContinue, CsIdResult,
-    CsIdNot, CsIdAnd, CsIdOr
+    CsIdNot, CsIdAnd, CsIdOr, CsIdLoop, CsIdMath
 };
 
+/* a call frame; the arguments of an alias call are read from the slots
+ * the caller evaluated them into (argv) until something needs them on the
+ * argument aliases, see cs_alias_internal::spill_args, after which argv is
+ * null and argstack holds what the aliases had before
+ */
 struct cs_identLink {
     cs_ident *id;
     cs_identLink *next;
     int usedargs;
     cs_ident_stack *argstack;
+    cs_value *argv;
 };
 
 enum {
@@ -37,16 +52,11 @@ enum {
     CsValCany, CsValWord, CsValPop, CsValCond
 };
 
-static const int cs_valtypet[] = {
-    CsValNull, CsValInt, CsValFloat, CsValString,
-    CsValCstring, CsValCode, CsValMacro, CsValIdent
-};
-
-static inline int cs_vtype_to_int(cs_value_type v) {
-    return cs_valtypet[int(v)];
-}
+/* instruction: uint32 [length 24][retflag 2][opcode 6]; saved bytecode
+ * records this version, so bump it whenever the instruction set changes
+ */
+static constexpr uint32_t CsBcodeVersion = 5;
 
-/* instruction: uint32 [length 24][retflag 2][opcode 6] */
 enum {
     CsCodeStart = 0,
     CsCodeOffset,
@@ -77,6 +87,9 @@ enum {
     CsCodeDo, CsCodeDoArgs,
     CsCodeJump, CsCodeJumpB, CsCodeJumpResult,
     CsCodeBreak,
+    CsCodeLoop,
+    CsCodeMath,
+    CsCodeLookupSlot, CsCodeAliasSlot,
 
     CsCodeOpMask = 0x3F,
     CsCodeRet = 6,
@@ -90,14 +103,269 @@ enum {
 
     /* CsCodeJumpB, CsCodeJumpResult */
     CsCodeFlagTrue = 1 << CsCodeRet,
-    CsCodeFlagFalse = 0 << CsCodeRet
+    CsCodeFlagFalse = 0 << CsCodeRet,
+
+    /* CsCodeMacro: the operand is an index into the string table */
+    CsCodeFlagIntern = 1 << CsCodeRet,
+
+    /* CsCodeLoop: the numbers on the stack besides the count, whether the
+     * inlined body has a condition before it and the length of both
+     */
+    CsCodeLoopCond = 1 << 8,
+    CsCodeLoopOffset = 1 << 9,
+    CsCodeLoopStep = 1 << 10,
+    CsCodeLoopStepLast = 1 << 11,
+    CsCodeLoopLen = 12,
+
+    /* CsCodeLocal: the locals live in slots of their own, see
+     * cs_code_locals, rather than pushed on the aliases
+     */
+    CsCodeFlagSlots = 1 << CsCodeRet,
+
+    /* CsCodeLookupSlot, CsCodeAliasSlot: the slot, whether the lookup is
+     * one of CsCodeLookupM and how many frames of locals out the slot is
+     */
+    CsCodeSlotMask = 0x1F,
+    CsCodeSlotM = 1 << 13,
+    CsCodeSlotUp = 14
+};
+
+static_assert(CsCodeAliasSlot <= CsCodeOpMask, "too many opcodes");
+static_assert(MaxArguments <= (CsCodeSlotMask + 1), "too many locals");
+
+/* CsCodeMath: two operand forms of math library builtins; the operation
+ * sits where CsCodeComV has the argument count, below the command index
+ */
+enum {
+    CsMathAdd = 0, CsMathSub, CsMathMul, CsMathDiv, CsMathMod,
+    CsMathEq, CsMathNe, CsMathLt, CsMathGt, CsMathLe, CsMathGe,
+    CsMathFloat = 1 << 4
+};
+
+/* the CsMath operation of a math builtin, or -1 */
+int cs_math_op(ostd::string_range name);
+
+/* what code compares when it is nothing but a comparison builtin called on
+ * the values of two aliases, as in [< $x $y], so it can be done natively
+ */
+struct cs_cmp_code {
+    /* CsMathEq to CsMathGe, with CsMathFloat for the float builtins */
+    int op;
+    /* the string builtins, which compare as strings */
+    bool str;
+    /* the operands are given as y and x */
+    bool swap;
+};
+
+bool cs_code_cmp(
+    cs_state &cs, cs_bcode *code, cs_ident *x, cs_ident *y, cs_cmp_code &ret
+);
+
+/* gives the CsCodeLocal at the given positions slots where the names do
+ * not escape the rest of their block
+ */
+void cs_code_locals(
+    cs_state &cs, uint32_t *code, cs_vector<size_t> const &locals
+);
+
+/* the slots of the locals of a CsCodeLocal running with CsCodeFlagSlots */
+struct cs_local_frame {
+    cs_value *slots;
+    cs_local_frame *next;
+};
+
+struct cs_shared_state;
+
+/* a vector appended to by one thread at a time, under a lock, while any
+ * thread reads it without one; storage it outgrows is kept until the
+ * vector goes away, as readers may still be looking into it
+ */
+template<typename T>
+struct cs_append_vector {
+    cs_append_vector() {}
+    cs_append_vector(cs_append_vector const &) = delete;
+    cs_append_vector &operator=(cs_append_vector const &) = delete;
+
+    ~cs_append_vector() {
+        clear();
+    }
+
+    T const &operator[](size_t i) const {
+        return p_data.load(std::memory_order_acquire)[i];
+    }
+
+    size_t size() const {
+        return p_size.load(std::memory_order_acquire);
+    }
+
+    bool empty() const {
+        return !size();
+    }
+
+    /* holds at least size() items when loaded after it */
+    T *data() const {
+        return p_data.load(std::memory_order_acquire);
+    }
+
+    void push_back(T v) {
+        size_t n = p_size.load(std::memory_order_relaxed);
+        T *d = p_data.load(std::memory_order_relaxed);
+        if (n == p_cap) {
+            p_cap = p_cap ? (p_cap * 2) : 16;
+            T *nd = new T[p_cap];
+            for (size_t i = 0; i < n; ++i) {
+                nd[i] = d[i];
+            }
+            p_data.store(nd, std::memory_order_release);
+            if (d) {
+                p_old.push_back(d);
+            }
+            d = nd;
+        }
+        d[n] = v;
+        p_size.store(n + 1, std::memory_order_release);
+    }
+
+    void clear() noexcept {
+        for (T *d: p_old) {
+            delete[] d;
+        }
+        p_old.clear();
+        delete[] p_data.load(std::memory_order_relaxed);
+        p_data.store(nullptr, std::memory_order_relaxed);
+        p_size.store(0, std::memory_order_relaxed);
+        p_cap = 0;
+    }
+
+private:
+    std::atomic<T *> p_data{nullptr};
+    std::atomic<size_t> p_size{0};
+    size_t p_cap = 0;
+    cs_vector<T *> p_old;
+};
+
+/* a string stored once per shared state along with its hash; entries are
+ * never freed before the state is, so values may point at them freely
+ */
+struct cs_strent {
+    size_t hash;
+    size_t len;
+    size_t index;
+    /* set once the ident is in the identmap, read without locking */
+    std::atomic<cs_ident *> id;
+
+    char const *data() const {
+        return reinterpret_cast<char const *>(this + 1);
+    }
+
+    ostd::string_range str() const {
+        return ostd::string_range(data(), data() + len);
+    }
+};
+
+/* the string table; identifier names are looked up through it, and the
+ * compiler interns the names it emits for dynamic lookups and calls, so
+ * the VM can resolve those without hashing anything; lookups take no lock
+ */
+struct cs_strman {
+    cs_strman() {}
+    cs_strman(cs_strman const &) = delete;
+    cs_strman &operator=(cs_strman const &) = delete;
+
+    cs_strent *find(ostd::string_range s) const;
+    /* takes the lock of the state if the string is not there yet */
+    cs_strent *intern(cs_shared_state &st, ostd::string_range s);
+    /* the same with the lock held already */
+    cs_strent *intern_locked(cs_shared_state &st, ostd::string_range s);
+
+    cs_strent *get(size_t idx) const {
+        return strs[idx];
+    }
+
+    size_t size() const {
+        return strs.size();
+    }
+
+    void destroy(cs_shared_state &st) noexcept;
+
+    /* values holding interned strings, the entry is kept in the value */
+    static void set_value(cs_value &v, cs_strent const *s);
+    static cs_strent const *get_value(cs_value const &v);
+
+private:
+    /* open addressing, power of two size, at most half full; a bigger one
+     * replaces it as a whole, so lookups see either the old or the new
+     */
+    struct table {
+        table(size_t n): slots(n) {}
+        cs_vector<std::atomic<cs_strent *>> slots;
+    };
+
+    void rehash(size_t nsize);
+
+    std::atomic<table *> buckets{nullptr};
+    cs_vector<table *> old_buckets;
+    cs_append_vector<cs_strent *> strs;
+};
+
+/* compiled code of the files run through run_file, reused while the file
+ * stays the same; the file is read and hashed on every run, as an mtime
+ * is too coarse to catch a quick rewrite of the same size, only the
+ * compile is skipped; past the limit the least recently run ones go
+ */
+struct cs_file_cache {
+    struct entry {
+        uint32_t *code; /* holds a ref */
+        size_t size;
+        size_t hash;
+        size_t used;
+    };
+
+    cs_map<cs_string, entry> files;
+    size_t hits = 0, misses = 0;
+    size_t limit = 256, clock = 0;
+    /* not held while compiling or running */
+    std::mutex lock;
+
+    void trim() noexcept;
+    void clear() noexcept;
 };
 
 struct cs_shared_state {
-    cs_map<ostd::string_range, cs_ident *> idents;
-    cs_vector<cs_ident *> identmap;
+    cs_strman strings;
+    cs_file_cache files;
+    cs_append_vector<cs_ident *> identmap;
     cs_alloc_cb allocf;
     void *aptr;
+    /* taken to add to the string table and the idents */
+    std::mutex lock;
+    /* commands not flagged CS_IDF_THREADSAFE run under this while
+     * there are any thread states
+     */
+    std::recursive_mutex cmd_lock;
+    std::atomic<int> threads{0};
+    /* for cs_parallel_for, started on first use */
+    ostd::thread_pool *pool = nullptr;
+    std::once_flag pool_once;
+    /* the string comparison builtins from CsMathEq on, for cs_code_cmp */
+    cs_ident *strcmps[CsMathGe - CsMathEq + 1] = {};
+
+    /* with the lock held */
+    cs_ident *add_ident(cs_ident *id);
+
+    /* the commands registered since the ident at first are thread safe */
+    void mark_threadsafe(size_t first) {
+        mark_commands(first, CS_IDF_THREADSAFE);
+    }
+
+    void mark_commands(size_t first, int flags) {
+        for (size_t i = first; i < identmap.size(); ++i) {
+            cs_ident *id = identmap[i];
+            if (id->is_command() || id->is_special()) {
+                id->p_flags |= flags;
+            }
+        }
+    }
 
     void *alloc(void *ptr, size_t os, size_t ns) {
         return allocf(aptr, ptr, os, ns);
@@ -132,10 +400,207 @@ struct cs_shared_state {
     }
 };
 
-struct CsBreakException {
+/* the part of a state made by new_thread that is its own */
+struct cs_task;
+
+struct cs_thread_state {
+    /* copies of the aliases written so far, by ident index */
+    cs_vector<cs_alias *> aliases;
+    cs_int numargs = 0;
+    /* set on the states tasks run on */
+    cs_task *task = nullptr;
+};
+
+/* how many command locks the calling thread holds */
+extern thread_local int cs_cmd_locked;
+
+#ifdef CS_VM_STATS
+/* the counters of a thread, written by it alone and read by get_stats */
+struct cs_stats_counters {
+    std::atomic<size_t> ops[256]{};
+    std::atomic<size_t> compilations{0};
+    std::atomic<size_t> string_allocs{0};
+    std::atomic<size_t> lookups{0};
+    std::atomic<size_t> exceptions{0};
+
+    cs_stats_counters();
+    ~cs_stats_counters();
+};
+
+extern thread_local cs_stats_counters cs_stats_local;
+
+/* no other thread writes it, so no atomic increment is needed */
+static inline void cs_stats_incr(std::atomic<size_t> &c) {
+    c.store(c.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+}
+
+#  define CS_STATS_OP(op) cs_stats_incr(cs_stats_local.ops[(op) & 0xFF])
+#  define CS_STATS_INCR(name) cs_stats_incr(cs_stats_local.name)
+#else
+#  define CS_STATS_OP(op) ((void)0)
+#  define CS_STATS_INCR(name) ((void)0)
+#endif
+
+/* the calls are kept as a tree for the folded stacks and summed up by
+ * ident for the profile; stopping only stops new calls from being timed,
+ * and clearing keeps the tree, as both may happen inside calls that are
+ * still to be recorded
+ */
+struct cs_profiler {
+    using clock = std::chrono::steady_clock;
+
+    struct node {
+        cs_ident *id;
+        node *parent;
+        std::unordered_map<cs_ident *, std::unique_ptr<node>> children;
+        std::chrono::nanoseconds self{0};
+
+        node(cs_ident *i, node *p): id(i), parent(p) {}
+    };
+
+    struct entry {
+        size_t calls = 0;
+        std::chrono::nanoseconds inclusive{0};
+        std::chrono::nanoseconds exclusive{0};
+        /* calls of it in progress, for recursion */
+        int active = 0;
+    };
+
+    struct frame {
+        node *n;
+        entry *e;
+        clock::time_point start;
+        std::chrono::nanoseconds children{0};
+    };
+
+    bool active = false;
+    node root{nullptr, nullptr};
+    std::unordered_map<cs_ident *, entry> idents;
+    cs_vector<frame> frames;
+
+    void enter(cs_ident *id);
+    void leave() noexcept;
+    void clear();
+};
+
+/* resolves the name held by a value; interned names need no hashing */
+static inline cs_ident *cs_get_ident(cs_state &cs, cs_value const &v) {
+    cs_strent const *s = cs_strman::get_value(v);
+    if (s) {
+        return s->id.load(std::memory_order_acquire);
+    }
+    return cs.get_ident(v.get_strr());
+}
+
+static inline cs_ident *cs_new_ident(cs_state &cs, cs_value const &v) {
+    cs_strent const *s = cs_strman::get_value(v);
+    if (s) {
+        cs_ident *id = s->id.load(std::memory_order_acquire);
+        if (id) {
+            return id;
+        }
+    }
+    return cs.new_ident(v.get_strr());
+}
+
+/* per-state stack the VM takes its argument and result slots from; values
+ * live in fixed size chunks, so growing never moves the slots of outer
+ * frames, which commands and nested blocks hold references into
+ */
+struct cs_value_stack {
+    static constexpr size_t ChunkSize = 512;
+
+    struct mark {
+        size_t chunk, top;
+    };
+
+    cs_vector<cs_value *> chunks;
+    size_t chunk = 0, top = 0;
+    size_t depth = 0, peak = 0;
+    /* argument stacks of spilled call frames, kept for reuse */
+    cs_vector<cs_ident_stack *> argstacks;
+    size_t nargstacks = 0;
+
+    cs_value *push(cs_shared_state &st, size_t n, mark &prev);
+    void pop(cs_value *vals, size_t n, mark const &prev) noexcept;
+    cs_ident_stack *get_argstack(cs_shared_state &st);
+    void put_argstack(cs_ident_stack *as) {
+        argstacks.push_back(as);
+    }
+    void destroy(cs_shared_state &st) noexcept;
+};
+
+/* bytecode lives in memory from the state allocator, behind this header;
+ * buffers not tied to a state (state is null) use cs_default_alloc
+ */
+struct cs_bcode_hdr {
+    cs_shared_state *state;
+    size_t cap;
 };
 
-struct CsContinueException {
+uint32_t *bcode_alloc(cs_shared_state *st, size_t cap);
+void bcode_free(uint32_t *bc) noexcept;
+
+/* the buffer the compiler emits into; once done, the code is released to
+ * the refcounting as is (the first word being CsCodeStart), without a copy
+ */
+struct cs_code_buf {
+    cs_code_buf(cs_shared_state &st): p_state(&st) {}
+    cs_code_buf(cs_code_buf const &) = delete;
+    cs_code_buf &operator=(cs_code_buf const &) = delete;
+
+    ~cs_code_buf() {
+        if (p_buf) {
+            bcode_free(p_buf);
+        }
+    }
+
+    uint32_t *data() { return p_buf; }
+    uint32_t *begin() { return p_buf; }
+    uint32_t *end() { return p_buf + p_len; }
+
+    size_t size() const { return p_len; }
+    size_t capacity() const { return p_cap; }
+    bool empty() const { return !p_len; }
+
+    uint32_t &operator[](size_t i) { return p_buf[i]; }
+    uint32_t &back() { return p_buf[p_len - 1]; }
+
+    void reserve(size_t n);
+
+    void resize(size_t n) {
+        reserve(n);
+        for (size_t i = p_len; i < n; ++i) {
+            p_buf[i] = 0;
+        }
+        p_len = n;
+    }
+
+    void push_back(uint32_t v) {
+        if (p_len == p_cap) {
+            reserve(p_cap ? (p_cap * 2) : 16);
+        }
+        p_buf[p_len++] = v;
+    }
+
+    void pop_back() {
+        --p_len;
+    }
+
+    void insert(uint32_t *pos, uint32_t const *first, uint32_t const *last);
+
+    /* the caller owns the code from here on */
+    uint32_t *release() {
+        uint32_t *ret = p_buf;
+        p_buf = nullptr;
+        p_len = p_cap = 0;
+        return ret;
+    }
+
+private:
+    cs_shared_state *p_state;
+    uint32_t *p_buf = nullptr;
+    size_t p_len = 0, p_cap = 0;
 };
 
 template<typename T>
@@ -146,14 +611,16 @@ struct cs_gen_state {
     cs_state &cs;
     cs_gen_state *prevps;
     bool parsing = true;
-    cs_vector<uint32_t> code;
+    cs_code_buf code;
+    /* where each CsCodeLocal is, for cs_code_locals */
+    cs_vector<size_t> locals;
     ostd::string_range source;
     size_t current_line;
     ostd::string_range src_name;
 
     cs_gen_state() = delete;
     cs_gen_state(cs_state &csr):
-        cs(csr), prevps(csr.p_pstate), code(),
+        cs(csr), prevps(csr.p_pstate), code(*csr.p_state),
         source(nullptr), current_line(1), src_name()
     {
         csr.p_pstate = this;
@@ -208,6 +675,16 @@ struct cs_gen_state {
         code.push_back(CsCodeValInt | CsRetString);
     }
 
+    /* like gen_str(word, true), for names that are looked up at runtime */
+    void gen_name(ostd::string_range word) {
+        cs_strent *s = cs.p_state->strings.intern(*cs.p_state, word);
+        if (s->index > 0xFFFFFF) {
+            gen_str(word, true);
+            return;
+        }
+        code.push_back(CsCodeMacro | CsCodeFlagIntern | (s->index << 8));
+    }
+
     void gen_null() {
         code.push_back(CsCodeValInt | CsRetNull);
     }
@@ -287,8 +764,14 @@ struct cs_gen_state {
 
     ostd::string_range read_macro_name();
 
-    char skip_until(ostd::string_range chars);
-    char skip_until(char cf);
+    /* moves the source on to p, keeping track of the lines it passes */
+    void skip_to(char const *p) {
+        char const *beg = source.data();
+        current_line += cs_scan_count(beg, p, '\n');
+        source = source.slice(p - beg, source.size());
+    }
+
+    char skip_until(cs_charset const &chars);
 
     void skip_comments();
 };
@@ -298,14 +781,21 @@ cs_string floatstr(cs_float v);
 
 bool cs_check_num(ostd::string_range s);
 
+/* what cs_alias::get_cstr and get_cval give for an alias holding val */
+void cs_value_get_cstr(cs_value const &val, cs_value &v);
+void cs_value_get_cval(cs_value const &val, cs_value &v);
+
+/* code is referenced from any thread running it, so the count is atomic */
 static inline void bcode_incr(uint32_t *bc) {
-    *bc += 0x100;
+    std::atomic_ref<uint32_t>{*bc}.fetch_add(0x100, std::memory_order_relaxed);
 }
 
 static inline void bcode_decr(uint32_t *bc) {
-    *bc -= 0x100;
-    if (std::int32_t(*bc) < 0x100) {
-        delete[] bc;
+    uint32_t n = std::atomic_ref<uint32_t>{*bc}.fetch_sub(
+        0x100, std::memory_order_acq_rel
+    ) - 0x100;
+    if (std::int32_t(n) < 0x100) {
+        bcode_free(bc);
     }
 }
 
@@ -317,8 +807,66 @@ static inline bool cs_is_arg_used(cs_state &cs, cs_ident *id) {
 }
 
 struct cs_alias_internal {
+    /* the alias as seen by cs; thread states look at their own copy once
+     * they have one and get it made for arguments or on writes
+     */
+    static cs_alias *get(cs_state &cs, cs_alias *a) {
+        if (a->get_index() < MaxArguments) {
+            spill_args(cs);
+        }
+        if (!cs.p_tstate) {
+            return a;
+        }
+        return get_thread(cs, a, false);
+    }
+
+    static cs_alias *own(cs_state &cs, cs_alias *a) {
+        if (a->get_index() < MaxArguments) {
+            spill_args(cs);
+        }
+        if (!cs.p_tstate) {
+            return a;
+        }
+        return get_thread(cs, a, true);
+    }
+
+    /* moves the arguments of the frames still holding them in slots onto
+     * the argument aliases, outermost first, for code that looks at the
+     * aliases themselves
+     */
+    static void spill_args(cs_state &cs) {
+        if (cs.p_callstack && cs.p_callstack->argv) {
+            spill_frame(cs, cs.p_callstack);
+        }
+    }
+
+    static void spill_frame(cs_state &cs, cs_identLink *l);
+
+    static cs_alias *get_thread(cs_state &cs, cs_alias *a, bool write);
+    static void destroy_thread(cs_state &cs) noexcept;
+
+    static bool is_task(cs_state &cs) {
+        return cs.p_tstate && cs.p_tstate->task;
+    }
+
+    /* tasks go back to the shared alias once the last push of their copy
+     * is popped, arguments excepted
+     */
+    static void drop_thread(cs_state &cs, cs_alias *a) noexcept;
+    /* gives a thread state what from sees of the arguments, numargs and
+     * the aliases from has copies of
+     */
+    static void inherit(cs_state &from, cs_state &to);
+
     static void push_arg(
-        cs_alias *a, cs_value &v, cs_ident_stack &st, bool um = true
+        cs_state &cs, cs_alias *a, cs_value &v, cs_ident_stack &st,
+        bool um = true
+    ) {
+        push_val(own(cs, a), v, st, um);
+    }
+
+    static void push_val(
+        cs_alias *a, cs_value &v, cs_ident_stack &st, bool um
     ) {
         if (a->p_astack == &st) {
             /* prevent cycles and unnecessary code elsewhere */
@@ -336,17 +884,22 @@ struct cs_alias_internal {
         }
     }
 
-    static void pop_arg(cs_alias *a) {
-        if (!a->p_astack) {
+    static void pop_arg(cs_state &cs, cs_alias *a) {
+        cs_alias *ta = own(cs, a);
+        if (!ta->p_astack) {
             return;
         }
-        cs_ident_stack *st = a->p_astack;
-        a->p_val = std::move(a->p_astack->val_s);
-        clean_code(a);
-        a->p_astack = st->next;
+        cs_ident_stack *st = ta->p_astack;
+        ta->p_val = std::move(ta->p_astack->val_s);
+        clean_code(ta);
+        ta->p_astack = st->next;
+        if (!ta->p_astack && is_task(cs)) {
+            drop_thread(cs, ta);
+        }
     }
 
-    static void undo_arg(cs_alias *a, cs_ident_stack &st) {
+    static void undo_arg(cs_state &cs, cs_alias *a, cs_ident_stack &st) {
+        a = own(cs, a);
         cs_ident_stack *prev = a->p_astack;
         st.val_s = std::move(a->p_val);
         st.next = prev;
@@ -355,7 +908,8 @@ struct cs_alias_internal {
         clean_code(a);
     }
 
-    static void redo_arg(cs_alias *a, cs_ident_stack &st) {
+    static void redo_arg(cs_state &cs, cs_alias *a, cs_ident_stack &st) {
+        a = own(cs, a);
         cs_ident_stack *prev = st.next;
         prev->val_s = std::move(a->p_val);
         a->p_astack = prev;
@@ -364,21 +918,47 @@ struct cs_alias_internal {
     }
 
     static void set_arg(cs_alias *a, cs_state &cs, cs_value &v) {
+        spill_args(cs);
         if (cs_is_arg_used(cs, a)) {
+            a = own(cs, a);
             a->p_val = std::move(v);
             clean_code(a);
         } else {
-            push_arg(a, v, cs.p_callstack->argstack[a->get_index()], false);
+            push_arg(
+                cs, a, v, cs.p_callstack->argstack[a->get_index()], false
+            );
             cs.p_callstack->usedargs |= 1 << a->get_index();
         }
     }
 
     static void set_alias(cs_alias *a, cs_state &cs, cs_value &v) {
+        /* tasks assign to what they see, which is the shared alias unless
+         * they have it pushed
+         */
+        a = is_task(cs) ? get(cs, a) : own(cs, a);
         a->p_val = std::move(v);
         clean_code(a);
         a->p_flags = (a->p_flags & cs.identflags) | cs.identflags;
     }
 
+    /* what assigning to a would replace, moved out to be changed without
+     * copies and given back with set_arg or set_alias; arguments not yet
+     * set give null
+     */
+    static cs_value take_value(cs_alias *a, cs_state &cs) {
+        cs_value ret;
+        if (a->get_index() < MaxArguments) {
+            if (!cs_is_arg_used(cs, a)) {
+                return ret;
+            }
+            a = own(cs, a);
+        } else {
+            a = is_task(cs) ? get(cs, a) : own(cs, a);
+        }
+        ret = std::move(a->p_val);
+        return ret;
+    }
+
     static void clean_code(cs_alias *a) {
         uint32_t *bcode = reinterpret_cast<uint32_t *>(a->p_acode);
         if (bcode) {
@@ -387,18 +967,28 @@ struct cs_alias_internal {
         }
     }
 
+    /* shared aliases may be compiled by several threads at once, the
+     * first to finish gets its code kept
+     */
     static cs_bcode *compile_code(cs_alias *a, cs_state &cs) {
-        if (!a->p_acode) {
+        std::atomic_ref<cs_bcode *> acode{a->p_acode};
+        cs_bcode *ret = acode.load(std::memory_order_acquire);
+        if (!ret) {
             cs_gen_state gs(cs);
             gs.code.reserve(64);
             gs.gen_main(a->get_value().get_str());
-            /* i wish i could steal the memory somehow */
-            uint32_t *code = new uint32_t[gs.code.size()];
-            memcpy(code, gs.code.data(), gs.code.size() * sizeof(uint32_t));
+            uint32_t *code = gs.code.release();
             bcode_incr(code);
-            a->p_acode = reinterpret_cast<cs_bcode *>(code);
+            if (acode.compare_exchange_strong(
+                ret, reinterpret_cast<cs_bcode *>(code),
+                std::memory_order_acq_rel, std::memory_order_acquire
+            )) {
+                ret = reinterpret_cast<cs_bcode *>(code);
+            } else {
+                bcode_decr(code);
+            }
         }
-        return a->p_acode;
+        return ret;
     }
 };
 
@@ -408,12 +998,14 @@ static void cs_do_args(cs_state &cs, F body) {
         body();
         return;
     }
+    cs_alias_internal::spill_args(cs);
     cs_ident_stack argstack[MaxArguments];
     int argmask1 = cs.p_callstack->usedargs;
     for (int i = 0; argmask1; argmask1 >>= 1, ++i) {
         if (argmask1 & 1) {
             cs_alias_internal::undo_arg(
-                static_cast<cs_alias *>(cs.p_state->identmap[i]), argstack[i]
+                cs, static_cast<cs_alias *>(cs.p_state->identmap[i]),
+                argstack[i]
             );
         }
     }
@@ -421,7 +1013,7 @@ static void cs_do_args(cs_state &cs, F body) {
     cs_identLink aliaslink = {
         cs.p_callstack->id, cs.p_callstack,
         prevstack ? prevstack->usedargs : ((1 << MaxArguments) - 1),
-        prevstack ? prevstack->argstack : nullptr
+        prevstack ? prevstack->argstack : nullptr, nullptr
     };
     cs.p_callstack = &aliaslink;
     cs_do_and_cleanup(std::move(body), [&]() {
@@ -433,7 +1025,8 @@ static void cs_do_args(cs_state &cs, F body) {
         for (int i = 0; argmask2; argmask2 >>= 1, ++i) {
             if (argmask2 & 1) {
                 cs_alias_internal::redo_arg(
-                    static_cast<cs_alias *>(cs.p_state->identmap[i]), argstack[i]
+                    cs, static_cast<cs_alias *>(cs.p_state->identmap[i]),
+                    argstack[i]
                 );
             }
         }
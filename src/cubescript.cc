@@ -1,6 +1,13 @@
 #include <cubescript/cubescript.hh>
 #include "cs_vm.hh"
 
+#include <algorithm>
+#include <climits>
+#include <deque>
+
+#include <ostd/coroutine.hh>
+#include <ostd/thread_pool.hh>
+
 namespace cscript {
 
 cs_string intstr(cs_int v) {
@@ -88,9 +95,9 @@ cs_alias::cs_alias(ostd::string_range name, cs_value v, int fl):
 
 cs_command::cs_command(
     ostd::string_range name, ostd::string_range args,
-    int nargs, cs_command_cb f
+    int nargs, cs_command_cb f, int flags
 ):
-    cs_ident(cs_ident_type::Command, name, 0),
+    cs_ident(cs_ident_type::Command, name, flags),
     p_cargs(args), p_cb_cftv(std::move(f)), p_numargs(nargs)
 {}
 
@@ -315,6 +322,7 @@ cs_state::cs_state(cs_alloc_cb func, void *data):
     /* set up allocator, from now we can call into alloc() */
     p_state->allocf = func;
     p_state->aptr = data;
+    p_vstack = p_state->create<cs_value_stack>();
 
     for (int i = 0; i < MaxArguments; ++i) {
         char buf[32];
@@ -397,34 +405,107 @@ cs_state::cs_state(cs_alloc_cb func, void *data):
     new_command("local", nullptr, nullptr)->p_type = CsIdLocal;
 
     new_command("break", "", [](auto &cs, auto, auto &) {
-        if (cs.is_in_loop()) {
-            throw CsBreakException();
-        } else {
+        if (!cs.is_in_loop()) {
             throw cs_error(cs, "no loop to break");
         }
+        cs.p_loopstate = CsLoopState::Break;
     })->p_type = CsIdBreak;
 
     new_command("continue", "", [](auto &cs, auto, auto &) {
-        if (cs.is_in_loop()) {
-            throw CsContinueException();
-        } else {
+        if (!cs.is_in_loop()) {
             throw cs_error(cs, "no loop to continue");
         }
+        cs.p_loopstate = CsLoopState::Continue;
     })->p_type = CsIdContinue;
 
     cs_init_lib_base(*this);
-}
+
+    /* numeric loops with a literal body are compiled into CsCodeLoop */
+    for (char const *name: {
+        "loop", "loop+", "loop*", "loop+*",
+        "loopwhile", "loopwhile+", "loopwhile*", "loopwhile+*"
+    }) {
+        get_ident(name)->p_type = CsIdLoop;
+    }
+    p_state->mark_threadsafe(0);
+}
+
+/* as much as the main thread usually gets; the stack is only committed as
+ * it is used, and runs nested as deep as the recursion limit allows need
+ * far more than the default one, more so in unoptimized builds
+ */
+static constexpr size_t TaskStackSize = 8 << 20;
+
+struct cs_task {
+    using coro_t = ostd::coroutine<void()>;
+
+    cs_state cs;
+    cs_bcode_ref code;
+    std::chrono::steady_clock::time_point wake{};
+    /* the instructions it may run per step, if limited */
+    size_t slice = 0;
+    /* destroyed first, so that unwinding it still has the state */
+    coro_t coro;
+
+    cs_task(cs_state &&ts, cs_bcode *c):
+        cs(std::move(ts)), code(c), coro([this](coro_t::yield_type) {
+            cs.run(code);
+        }, ostd::protected_fixedsize_stack{TaskStackSize})
+    {
+        cs.p_tstate->task = this;
+        /* preempted when out of instructions, as if it yielded; a command
+         * holding the lock gets to finish first
+         */
+        cs.set_budget_hook([this](cs_state &tcs) {
+            if (cs_cmd_locked) {
+                tcs.set_instruction_budget(slice);
+                return;
+            }
+            wake = std::chrono::steady_clock::time_point{};
+            coro_t::yield_type{coro}();
+        });
+    }
+};
+
+struct cs_task_queue {
+    std::deque<cs_task *> tasks;
+};
 
 OSTD_EXPORT cs_state::~cs_state() {
     destroy();
 }
 
 OSTD_EXPORT void cs_state::destroy() {
+    if (p_tasks) {
+        /* suspended tasks are unwound here, on their own states */
+        for (cs_task *t: p_tasks->tasks) {
+            p_state->destroy(t);
+        }
+        p_state->destroy(p_tasks);
+        p_tasks = nullptr;
+    }
+    if (p_profiler) {
+        p_state->destroy(p_profiler);
+        p_profiler = nullptr;
+    }
+    if (p_vstack) {
+        p_vstack->destroy(*p_state);
+        p_state->destroy(p_vstack);
+        p_vstack = nullptr;
+    }
+    if (p_tstate) {
+        cs_alias_internal::destroy_thread(*this);
+        p_state->destroy(p_tstate);
+        p_tstate = nullptr;
+        --p_state->threads;
+    }
     if (!p_state || !p_owner) {
         return;
     }
-    for (auto &p: p_state->idents) {
-        cs_ident *i = p.second;
+    delete p_state->pool;
+    p_state->pool = nullptr;
+    for (size_t n = 0; n < p_state->identmap.size(); ++n) {
+        cs_ident *i = p_state->identmap[n];
         cs_alias *a = i->get_alias();
         if (a) {
             a->get_value().force_null();
@@ -432,17 +513,110 @@ OSTD_EXPORT void cs_state::destroy() {
         }
         p_state->destroy(i);
     }
+    p_state->identmap.clear();
+    p_state->files.clear();
+    p_state->strings.destroy(*p_state);
     p_state->destroy(p_state);
 }
 
 cs_state::cs_state(cs_shared_state *s):
     p_state(s), p_owner(false)
-{}
+{
+    p_vstack = p_state->create<cs_value_stack>();
+    p_tstate = p_state->create<cs_thread_state>();
+    ++p_state->threads;
+}
 
 OSTD_EXPORT cs_state cs_state::new_thread() {
     return cs_state{p_state};
 }
 
+static void cs_task_suspend(cs_state &cs, cs_int ms) {
+    cs_task *t = cs.p_tstate ? cs.p_tstate->task : nullptr;
+    if (!t) {
+        throw cs_error(cs, "no task to suspend");
+    }
+    /* other threads would be kept out of commands until it resumes */
+    if (cs_cmd_locked) {
+        throw cs_error(cs, "cannot suspend a task inside this command");
+    }
+    t->wake = std::chrono::steady_clock::now() + std::chrono::milliseconds(
+        std::max(ms, cs_int(0))
+    );
+    cs_task::coro_t::yield_type{t->coro}();
+}
+
+OSTD_EXPORT void cs_state::spawn(cs_bcode *code) {
+    if (!p_tasks) {
+        p_tasks = p_state->create<cs_task_queue>();
+    }
+    cs_task *t = p_state->create<cs_task>(new_thread(), code);
+    try {
+        p_tasks->tasks.push_back(t);
+    } catch (...) {
+        p_state->destroy(t);
+        throw;
+    }
+}
+
+OSTD_EXPORT void cs_state::spawn(ostd::string_range code) {
+    spawn(compile(code, "<task>"));
+}
+
+OSTD_EXPORT size_t cs_state::step(
+    std::chrono::nanoseconds budget, size_t insns
+) {
+    if (!p_tasks) {
+        return 0;
+    }
+    auto &q = p_tasks->tasks;
+    auto start = std::chrono::steady_clock::now();
+    /* the ones spawned meanwhile wait for the next step */
+    for (size_t n = q.size(); n; --n) {
+        auto now = std::chrono::steady_clock::now();
+        if ((now - start) >= budget) {
+            break;
+        }
+        cs_task *t = q.front();
+        q.pop_front();
+        if (t->wake > now) {
+            q.push_back(t);
+            continue;
+        }
+        t->slice = insns;
+        if (insns) {
+            t->cs.set_instruction_budget(insns);
+        } else {
+            t->cs.clear_instruction_budget();
+        }
+        /* the error refers to the task's state, so it is copied out */
+        cs_string emsg;
+        bool failed = false;
+        try {
+            t->coro();
+        } catch (cs_error const &e) {
+            emsg = e.what();
+            failed = true;
+        } catch (...) {
+            p_state->destroy(t);
+            throw;
+        }
+        if (failed || !t->coro) {
+            p_state->destroy(t);
+            if (failed) {
+                throw cs_error(*this, emsg);
+            }
+            continue;
+        }
+        q.push_back(t);
+    }
+    return q.size();
+}
+
+OSTD_EXPORT size_t cs_state::get_task_count() const {
+    return p_tasks ? p_tasks->tasks.size() : 0;
+}
+
 OSTD_EXPORT cs_hook_cb cs_state::set_call_hook(cs_hook_cb func) {
     auto hk = std::move(p_callhook);
     p_callhook = std::move(func);
@@ -457,6 +631,110 @@ OSTD_EXPORT cs_hook_cb &cs_state::get_call_hook() {
     return p_callhook;
 }
 
+OSTD_EXPORT void cs_state::set_instruction_budget(size_t n) {
+    p_budget = (n > size_t(LLONG_MAX))
+        ? LLONG_MAX : static_cast<long long>(n);
+    p_limited = true;
+}
+
+OSTD_EXPORT void cs_state::clear_instruction_budget() {
+    p_budget = 0;
+    p_limited = false;
+}
+
+OSTD_EXPORT std::optional<size_t> cs_state::get_instruction_budget() const {
+    if (!p_limited) {
+        return std::nullopt;
+    }
+    return size_t(std::max(p_budget, 0LL));
+}
+
+OSTD_EXPORT cs_hook_cb cs_state::set_budget_hook(cs_hook_cb func) {
+    auto hk = std::move(p_budgethook);
+    p_budgethook = std::move(func);
+    return hk;
+}
+
+OSTD_EXPORT cs_hook_cb const &cs_state::get_budget_hook() const {
+    return p_budgethook;
+}
+
+OSTD_EXPORT cs_hook_cb &cs_state::get_budget_hook() {
+    return p_budgethook;
+}
+
+OSTD_EXPORT void cs_state::start_profile() {
+    if (!p_profiler) {
+        p_profiler = p_state->create<cs_profiler>();
+    }
+    p_profiler->active = true;
+}
+
+OSTD_EXPORT void cs_state::stop_profile() {
+    if (p_profiler) {
+        p_profiler->active = false;
+    }
+}
+
+OSTD_EXPORT void cs_state::clear_profile() {
+    if (p_profiler) {
+        p_profiler->clear();
+    }
+}
+
+OSTD_EXPORT bool cs_state::is_profiling() const {
+    return p_profiler && p_profiler->active;
+}
+
+OSTD_EXPORT std::vector<cs_profile_entry> cs_state::get_profile() const {
+    std::vector<cs_profile_entry> ret;
+    if (!p_profiler) {
+        return ret;
+    }
+    for (auto &e: p_profiler->idents) {
+        if (e.second.calls) {
+            ret.push_back({
+                e.first, e.second.calls, e.second.inclusive,
+                e.second.exclusive
+            });
+        }
+    }
+    std::sort(ret.begin(), ret.end(), [](auto const &a, auto const &b) {
+        return a.exclusive > b.exclusive;
+    });
+    return ret;
+}
+
+static void cs_profile_fold(
+    cs_profiler::node const &n, cs_string &path, cs_string &out
+) {
+    size_t len = path.size();
+    if (n.id) {
+        if (len) {
+            path += ';';
+        }
+        path += n.id->get_name();
+        if (n.self.count() > 0) {
+            out += path;
+            out += ' ';
+            out += std::to_string(n.self.count());
+            out += '\n';
+        }
+    }
+    for (auto &ch: n.children) {
+        cs_profile_fold(*ch.second, path, out);
+    }
+    path.resize(len);
+}
+
+OSTD_EXPORT cs_string cs_state::get_profile_folded() const {
+    cs_string path, ret;
+    if (p_profiler) {
+        cs_profile_fold(p_profiler->root, path, ret);
+    }
+    return ret;
+}
+
 void *cs_state::alloc(void *ptr, size_t os, size_t ns) {
     return p_state->alloc(ptr, os, ns);
 }
@@ -497,19 +775,116 @@ OSTD_EXPORT void cs_state::clear_override(cs_ident &id) {
 }
 
 OSTD_EXPORT void cs_state::clear_overrides() {
-    for (auto &p: p_state->idents) {
-        clear_override(*(p.second));
+    for (size_t i = 0; i < p_state->identmap.size(); ++i) {
+        clear_override(*p_state->identmap[i]);
+    }
+}
+
+cs_strent *cs_strman::find(ostd::string_range s) const {
+    table *tb = buckets.load(std::memory_order_acquire);
+    if (!tb) {
+        return nullptr;
+    }
+    size_t h = cs_hash_str(s), mask = tb->slots.size() - 1;
+    for (size_t i = h & mask;; i = (i + 1) & mask) {
+        cs_strent *e = tb->slots[i].load(std::memory_order_acquire);
+        if (!e) {
+            return nullptr;
+        }
+        if ((e->hash == h) && (e->str() == s)) {
+            return e;
+        }
     }
 }
 
+void cs_strman::rehash(size_t nsize) {
+    table *nb = new table{nsize};
+    for (size_t n = 0; n < strs.size(); ++n) {
+        cs_strent *e = strs[n];
+        size_t i = e->hash & (nsize - 1);
+        while (nb->slots[i].load(std::memory_order_relaxed)) {
+            i = (i + 1) & (nsize - 1);
+        }
+        nb->slots[i].store(e, std::memory_order_relaxed);
+    }
+    table *ob = buckets.exchange(nb, std::memory_order_acq_rel);
+    if (ob) {
+        /* lookups may still be going through it */
+        old_buckets.push_back(ob);
+    }
+}
+
+cs_strent *cs_strman::intern(cs_shared_state &st, ostd::string_range s) {
+    cs_strent *e = find(s);
+    if (e) {
+        return e;
+    }
+    std::lock_guard<std::mutex> l{st.lock};
+    return intern_locked(st, s);
+}
+
+cs_strent *cs_strman::intern_locked(
+    cs_shared_state &st, ostd::string_range s
+) {
+    /* may have been added since the caller looked */
+    cs_strent *e = find(s);
+    if (e) {
+        return e;
+    }
+    table *tb = buckets.load(std::memory_order_relaxed);
+    if (!tb || ((strs.size() + 1) * 2 > tb->slots.size())) {
+        rehash(tb ? (tb->slots.size() * 2) : 256);
+        tb = buckets.load(std::memory_order_relaxed);
+    }
+    e = static_cast<cs_strent *>(
+        st.alloc(nullptr, 0, sizeof(cs_strent) + s.size() + 1)
+    );
+    new (e) cs_strent{cs_hash_str(s), s.size(), strs.size(), nullptr};
+    char *data = const_cast<char *>(e->data());
+    memcpy(data, s.data(), s.size());
+    data[s.size()] = '\0';
+    /* in strs first, anyone finding it may look it up by index */
+    strs.push_back(e);
+    size_t mask = tb->slots.size() - 1, i = e->hash & mask;
+    while (tb->slots[i].load(std::memory_order_relaxed)) {
+        i = (i + 1) & mask;
+    }
+    tb->slots[i].store(e, std::memory_order_release);
+    return e;
+}
+
+void cs_strman::destroy(cs_shared_state &st) noexcept {
+    for (size_t n = 0; n < strs.size(); ++n) {
+        cs_strent *e = strs[n];
+        size_t len = e->len;
+        e->~cs_strent();
+        st.alloc(e, sizeof(cs_strent) + len + 1, 0);
+    }
+    strs.clear();
+    for (table *tb: old_buckets) {
+        delete tb;
+    }
+    old_buckets.clear();
+    delete buckets.exchange(nullptr, std::memory_order_relaxed);
+}
+
+/* the ident is in the identmap before its name leads to it, so whoever
+ * finds it can look it up by index as well
+ */
+cs_ident *cs_shared_state::add_ident(cs_ident *id) {
+    cs_strent *s = strings.intern_locked(*this, id->get_name());
+    id->p_index = identmap.size();
+    identmap.push_back(id);
+    s->id.store(id, std::memory_order_release);
+    return id;
+}
+
 OSTD_EXPORT cs_ident *cs_state::add_ident(cs_ident *id) {
     if (!id) {
         return nullptr;
     }
-    p_state->idents[id->get_name()] = id;
-    id->p_index = p_state->identmap.size();
-    p_state->identmap.push_back(id);
-    return p_state->identmap.back();
+    std::lock_guard<std::mutex> l{p_state->lock};
+    return p_state->add_ident(id);
 }
 
 OSTD_EXPORT cs_ident *cs_state::new_ident(ostd::string_range name, int flags) {
@@ -520,7 +895,12 @@ OSTD_EXPORT cs_ident *cs_state::new_ident(ostd::string_range name, int flags) {
                 *this, "number %s is not a valid identifier name", name
             );
         }
-        id = add_ident(p_state->create<cs_alias>(name, flags));
+        std::lock_guard<std::mutex> l{p_state->lock};
+        /* another thread may have made it meanwhile */
+        id = get_ident(name);
+        if (!id) {
+            id = p_state->add_ident(p_state->create<cs_alias>(name, flags));
+        }
     }
     return id;
 }
@@ -532,7 +912,7 @@ OSTD_EXPORT cs_ident *cs_state::force_ident(cs_value &v) {
         case cs_value_type::Macro:
         case cs_value_type::Cstring:
         case cs_value_type::String: {
-            cs_ident *id = new_ident(v.get_strr());
+            cs_ident *id = cs_new_ident(*this, v);
             v.set_ident(id);
             return id;
         }
@@ -544,11 +924,14 @@ OSTD_EXPORT cs_ident *cs_state::force_ident(cs_value &v) {
 }
 
 OSTD_EXPORT cs_ident *cs_state::get_ident(ostd::string_range name) {
-    auto id = p_state->idents.find(name);
-    if (id != p_state->idents.end()) {
-        return id->second;
+    CS_STATS_INCR(lookups);
+    cs_strent *s = p_state->strings.find(name);
+    cs_ident *id = s ? s->id.load(std::memory_order_acquire) : nullptr;
+    /* so that the argument aliases hold what the caller may look at */
+    if (id && (id->get_index() < MaxArguments)) {
+        cs_alias_internal::spill_args(*this);
     }
-    return nullptr;
+    return id;
 }
 
 OSTD_EXPORT cs_alias *cs_state::get_alias(ostd::string_range name) {
@@ -560,19 +943,20 @@ OSTD_EXPORT cs_alias *cs_state::get_alias(ostd::string_range name) {
 }
 
 OSTD_EXPORT bool cs_state::have_ident(ostd::string_range name) {
-    return p_state->idents.find(name) != p_state->idents.end();
+    return get_ident(name) != nullptr;
 }
 
 OSTD_EXPORT cs_ident_r cs_state::get_idents() {
-    return cs_ident_r(
-        p_state->identmap.data(),
-        p_state->identmap.data() + p_state->identmap.size()
-    );
+    /* the size first, the storage loaded after it holds as many */
+    size_t n = p_state->identmap.size();
+    cs_ident **ptr = p_state->identmap.data();
+    return cs_ident_r(ptr, ptr + n);
 }
 
 OSTD_EXPORT cs_const_ident_r cs_state::get_idents() const {
+    size_t n = p_state->identmap.size();
     auto ptr = const_cast<cs_ident const **>(p_state->identmap.data());
-    return cs_const_ident_r(ptr, ptr + p_state->identmap.size());
+    return cs_const_ident_r(ptr, ptr + n);
 }
 
 OSTD_EXPORT cs_ivar *cs_state::new_ivar(
@@ -656,12 +1040,20 @@ OSTD_EXPORT void cs_state::print_var(cs_var *v) {
     ostd::writeln(v->to_printable());
 }
 
-void cs_alias::get_cstr(cs_value &v) const {
+void cs_value_get_cstr(cs_value const &p_val, cs_value &v) {
     switch (p_val.get_type()) {
         case cs_value_type::Macro:
             v.set_macro(p_val.get_strr());
             break;
         case cs_value_type::String:
+            /* shares the buffer; a pointer could dangle once p_val moves */
+            v = p_val;
+            break;
+        case cs_value_type::Array:
+        case cs_value_type::Dict:
+            v = p_val;
+            v.force_str();
+            break;
         case cs_value_type::Cstring:
             v.set_cstr(p_val.get_strr());
             break;
@@ -677,12 +1069,17 @@ void cs_alias::get_cstr(cs_value &v) const {
     }
 }
 
-void cs_alias::get_cval(cs_value &v) const {
+void cs_value_get_cval(cs_value const &p_val, cs_value &v) {
     switch (p_val.get_type()) {
         case cs_value_type::Macro:
             v.set_macro(p_val.get_strr());
             break;
         case cs_value_type::String:
+        case cs_value_type::Array:
+        case cs_value_type::Dict:
+            /* shares the buffer; a pointer could dangle once p_val moves */
+            v = p_val;
+            break;
         case cs_value_type::Cstring:
             v.set_cstr(p_val.get_strr());
             break;
@@ -698,7 +1095,19 @@ void cs_alias::get_cval(cs_value &v) const {
     }
 }
 
+void cs_alias::get_cstr(cs_value &v) const {
+    cs_value_get_cstr(p_val, v);
+}
+
+void cs_alias::get_cval(cs_value &v) const {
+    cs_value_get_cval(p_val, v);
+}
+
 cs_ident_type cs_ident::get_type() const {
+    /* commands the compiler has its own code for are still commands */
+    if ((p_type == CsIdLoop) || (p_type == CsIdMath)) {
+        return cs_ident_type::Command;
+    }
     if (p_type > CsIdAlias) {
         return cs_ident_type::Special;
     }
@@ -870,7 +1279,7 @@ cs_state::get_alias_val(ostd::string_range name) {
     if ((a->get_index() < MaxArguments) && !cs_is_arg_used(*this, a)) {
         return std::nullopt;
     }
-    return a->get_value().get_str();
+    return cs_alias_internal::get(*this, a)->get_value().get_str();
 }
 
 cs_int cs_clamp_var(cs_state &cs, cs_ivar *iv, cs_int v) {
@@ -971,7 +1380,8 @@ OSTD_EXPORT void cs_state::set_var_str_checked(
 }
 
 OSTD_EXPORT cs_command *cs_state::new_command(
-    ostd::string_range name, ostd::string_range args, cs_command_cb func
+    ostd::string_range name, ostd::string_range args, cs_command_cb func,
+    int flags
 ) {
     int nargs = 0;
     for (ostd::string_range fmt(args); !fmt.empty(); ++fmt) {
@@ -1018,7 +1428,9 @@ OSTD_EXPORT cs_command *cs_state::new_command(
         }
     }
     return static_cast<cs_command *>(
-        add_ident(p_state->create<cs_command>(name, args, nargs, std::move(func)))
+        add_ident(p_state->create<cs_command>(
+            name, args, nargs, std::move(func), flags
+        ))
     );
 }
 
@@ -1026,7 +1438,7 @@ static inline void cs_do_loop(
     cs_state &cs, cs_ident &id, cs_int offset, cs_int n, cs_int step,
     cs_bcode *cond, cs_bcode *body
 ) {
-    cs_stacked_value idv{&id};
+    cs_stacked_value idv{cs, &id};
     if (n <= 0 || !idv.has_alias()) {
         return;
     }
@@ -1051,7 +1463,7 @@ static inline void cs_loop_conc(
     cs_state &cs, cs_value &res, cs_ident &id, cs_int offset, cs_int n,
     cs_int step, cs_bcode *body, bool space
 ) {
-    cs_stacked_value idv{&id};
+    cs_stacked_value idv{cs, &id};
     if (n <= 0 || !idv.has_alias()) {
         return;
     }
@@ -1082,6 +1494,78 @@ void cs_init_lib_base(cs_state &gcs) {
         throw cs_error(cs, args[0].get_strr());
     });
 
+    gcs.new_command("profile", "s", [](auto &cs, auto args, auto &res) {
+        ostd::string_range act = args[0].get_strr();
+        if (act == "start") {
+            cs.start_profile();
+        } else if (act == "stop") {
+            cs.stop_profile();
+        } else if (act == "clear") {
+            cs.clear_profile();
+        } else if (act == "folded") {
+            res.set_str(cs.get_profile_folded());
+        } else if (act.empty() || (act == "report")) {
+            /* a line per ident with the calls and the times in ms */
+            auto app = ostd::appender<cs_string>();
+            try {
+                for (auto &e: cs.get_profile()) {
+                    format(
+                        app, "%s %d %.3f %.3f\n", e.id->get_name(), e.calls,
+                        e.inclusive.count() / 1e6, e.exclusive.count() / 1e6
+                    );
+                }
+            } catch (ostd::format_error const &e) {
+                throw cs_internal_error{e.what()};
+            }
+            res.set_str(std::move(app.get()));
+        } else {
+            throw cs_error(cs, "unknown profile action \"%s\"", act);
+        }
+    });
+
+    gcs.new_command("vmstats", "s", [](auto &cs, auto args, auto &res) {
+        ostd::string_range act = args[0].get_strr();
+        if (act == "clear") {
+            cs.clear_stats();
+            return;
+        } else if (!act.empty() && (act != "report")) {
+            throw cs_error(cs, "unknown vmstats action \"%s\"", act);
+        }
+        cs_stats st = cs.get_stats();
+        /* the totals first, then the instructions run, most run first */
+        std::vector<size_t> ops;
+        for (size_t i = 0; i < st.ops.size(); ++i) {
+            if (st.ops[i]) {
+                ops.push_back(i);
+            }
+        }
+        std::sort(ops.begin(), ops.end(), [&st](size_t a, size_t b) {
+            return st.ops[a] > st.ops[b];
+        });
+        auto app = ostd::appender<cs_string>();
+        try {
+            format(
+                app, "instructions %d\ncompilations %d\nstring_allocs %d\n"
+                "lookups %d\nexceptions %d\n", st.instructions,
+                st.compilations, st.string_allocs, st.lookups, st.exceptions
+            );
+            for (size_t op: ops) {
+                format(app, "op %s %d\n", cs_opcode_name(op), st.ops[op]);
+            }
+        } catch (ostd::format_error const &e) {
+            throw cs_internal_error{e.what()};
+        }
+        res.set_str(std::move(app.get()));
+    });
+
+    gcs.new_command("yield", "", [](auto &cs, auto, auto &) {
+        cs_task_suspend(cs, 0);
+    });
+
+    gcs.new_command("sleep", "i", [](auto &cs, auto args, auto &) {
+        cs_task_suspend(cs, args[0].get_int());
+    });
+
     gcs.new_command("pcall", "err", [](auto &cs, auto args, auto &ret) {
         cs_alias *cret = args[1].get_ident()->get_alias(),
                 *css  = args[2].get_ident()->get_alias();
@@ -1169,7 +1653,7 @@ void cs_init_lib_base(cs_state &gcs) {
     });
 
     gcs.new_command("pushif", "rTe", [](auto &cs, auto args, auto &res) {
-        cs_stacked_value idv{args[0].get_ident()};
+        cs_stacked_value idv{cs, args[0].get_ident()};
         if (!idv.has_alias() || (idv.get_alias()->get_index() < MaxArguments)) {
             return;
         }
@@ -1313,7 +1797,7 @@ end:
     });
 
     gcs.new_command("push", "rTe", [](auto &cs, auto args, auto &res) {
-        cs_stacked_value idv{args[0].get_ident()};
+        cs_stacked_value idv{cs, args[0].get_ident()};
         if (!idv.has_alias() || (idv.get_alias()->get_index() < MaxArguments)) {
             return;
         }
@@ -1352,6 +1836,17 @@ end:
             std::move(cs.get_alias_val(args[0].get_strr()).value_or(""))
         );
     });
+    gcs.new_command("filecachehits", "", [](auto &cs, auto, auto &res) {
+        res.set_int(cs_int(cs.get_file_cache_hits()));
+    });
+
+    gcs.new_command("filecachemisses", "", [](auto &cs, auto, auto &res) {
+        res.set_int(cs_int(cs.get_file_cache_misses()));
+    });
+
+    gcs.new_command("clearfilecache", "", [](auto &cs, auto, auto &) {
+        cs.clear_file_cache();
+    });
 }
 
 void cs_init_lib_math(cs_state &cs);
@@ -1359,15 +1854,32 @@ void cs_init_lib_string(cs_state &cs);
 void cs_init_lib_list(cs_state &cs);
 
 OSTD_EXPORT void cs_state::init_libs(int libs) {
+    size_t first = p_state->identmap.size();
     if (libs & CsLibMath) {
         cs_init_lib_math(*this);
+        /* two operand calls to these are compiled into CsCodeMath */
+        for (size_t i = first; i < p_state->identmap.size(); ++i) {
+            cs_ident *id = p_state->identmap[i];
+            if (cs_math_op(id->get_name()) >= 0) {
+                id->p_type = CsIdMath;
+            }
+        }
     }
     if (libs & CsLibString) {
         cs_init_lib_string(*this);
+        static char const *strcmps[] = {"=s", "!=s", "<s", ">s", "<=s", ">=s"};
+        for (size_t i = 0; i < (sizeof(strcmps) / sizeof(*strcmps)); ++i) {
+            p_state->strcmps[i] = get_ident(strcmps[i]);
+        }
     }
     if (libs & CsLibList) {
         cs_init_lib_list(*this);
     }
+    /* unlike getalias, exec and such of the base library, none of these
+     * look up names from strings or run code other than what they get
+     */
+    p_state->mark_commands(first, CS_IDF_NONAMES);
+    p_state->mark_threadsafe(first);
 }
 
 } /* namespace cscript */
@@ -1,6 +1,9 @@
 #include <functional>
+#include <numeric>
+#include <unordered_set>
 
 #include <cubescript/cubescript.hh>
+#include "cs_vm.hh"
 #include "cs_util.hh"
 
 namespace cscript {
@@ -36,7 +39,7 @@ static inline void cs_list_find(
     cs_int n = 0, skip = args[2].get_int();
     T val = cs_arg_val<T>::get(args[1]);
     for (util::list_parser p(cs, args[0].get_strr()); p.parse(); ++n) {
-        if (cmp(p, val)) {
+        if (cmp(p.get_raw_item(), val)) {
             res.set_int(n);
             return;
         }
@@ -56,8 +59,21 @@ static inline void cs_list_assoc(
     cs_state &cs, cs_value_r args, cs_value &res, F cmp
 ) {
     T val = cs_arg_val<T>::get(args[1]);
+    if (args[0].get_type() == cs_value_type::Dict) {
+        size_t pos = 0;
+        ostd::string_range key;
+        cs_value const *v;
+        while (args[0].dict_next(pos, key, v)) {
+            if (cmp(key, val)) {
+                res = *v;
+                return;
+            }
+        }
+        return;
+    }
+    args[0].force_str();
     for (util::list_parser p(cs, args[0].get_strr()); p.parse();) {
-        if (cmp(p, val)) {
+        if (cmp(p.get_raw_item(), val)) {
             if (p.parse()) {
                 res.set_str(p.get_item());
             }
@@ -73,7 +89,7 @@ static void cs_loop_list_conc(
     cs_state &cs, cs_value &res, cs_ident *id, ostd::string_range list,
     cs_bcode *body, bool space
 ) {
-    cs_stacked_value idv{id};
+    cs_stacked_value idv{cs, id};
     if (!idv.has_alias()) {
         return;
     }
@@ -101,8 +117,12 @@ end:
 }
 
 int cs_list_includes(
-    cs_state &cs, ostd::string_range list, ostd::string_range needle
+    cs_state &cs, cs_value const &v, ostd::string_range needle
 ) {
+    ostd::string_range list = v.get_strr();
+    if (auto *idx = cs_list_index::get(cs, v)) {
+        return idx->find(list, needle);
+    }
     int offset = 0;
     for (util::list_parser p(cs, list); p.parse();) {
         if (p.get_raw_item() == needle) {
@@ -117,14 +137,14 @@ template<bool PushList, bool Swap, typename F>
 static inline void cs_list_merge(
     cs_state &cs, cs_value_r args, cs_value &res, F cmp
 ) {
-    ostd::string_range list = args[0].get_strr();
-    ostd::string_range elems = args[1].get_strr();
+    /* long lists of elems get looked up through their index rather than
+     * reparsed for every item, which keeps these linear
+     */
+    cs_value const &elems = args[Swap ? 0 : 1];
+    ostd::string_range list = args[Swap ? 1 : 0].get_strr();
     cs_string buf;
     if (PushList) {
-        buf += list;
-    }
-    if (Swap) {
-        std::swap(list, elems);
+        buf += args[0].get_strr();
     }
     for (util::list_parser p(cs, list); p.parse();) {
         if (cmp(cs_list_includes(cs, elems, p.get_raw_item()), 0)) {
@@ -137,17 +157,86 @@ static inline void cs_list_merge(
     res.set_str(std::move(buf));
 }
 
+static inline void cs_set_array(cs_value &res, cs_vector<cs_value> const &v) {
+    res.set_array(cs_const_value_r(v.data(), v.data() + v.size()));
+}
+
 static void cs_init_lib_list_sort(cs_state &cs);
+static void cs_init_lib_list_parallel(cs_state &cs);
+static void cs_init_lib_list_dict(cs_state &cs);
 
 void cs_init_lib_list(cs_state &gcs) {
-    gcs.new_command("listlen", "s", [](auto &cs, auto args, auto &res) {
+    /* the commands taking their list as "t" go through the values of arrays
+     * as they are, and make anything else a string list
+     */
+    gcs.new_command("array", "V", [](auto &, auto args, auto &res) {
+        res.set_array(cs_const_value_r(&args[0], &args[0] + args.size()));
+    });
+
+    gcs.new_command("listarray", "s", [](auto &cs, auto args, auto &res) {
+        cs_vector<cs_value> vals;
+        for (util::list_parser p(cs, args[0].get_strr()); p.parse();) {
+            vals.emplace_back().set_str(p.get_item());
+        }
+        cs_set_array(res, vals);
+    });
+
+    gcs.new_command("listlen", "t", [](auto &cs, auto args, auto &res) {
+        if (args[0].get_type() == cs_value_type::Array) {
+            res.set_int(cs_int(args[0].get_array().size()));
+            return;
+        }
+        args[0].force_str();
+        if (auto *idx = cs_list_index::get(cs, args[0])) {
+            res.set_int(cs_int(idx->items.size()));
+            return;
+        }
         res.set_int(cs_int(util::list_parser(cs, args[0].get_strr()).count()));
     });
 
-    gcs.new_command("at", "si1V", [](auto &cs, auto args, auto &res) {
+    gcs.new_command("at", "ti1V", [](auto &cs, auto args, auto &res) {
         if (args.empty()) {
             return;
         }
+        if (args[0].get_type() == cs_value_type::Array) {
+            if (args.size() < 2) {
+                res = args[0];
+                return;
+            }
+            /* like with lists, only the last index counts */
+            cs_const_value_r vals = args[0].get_array();
+            cs_int pos = std::max(args[args.size() - 1].get_int(), cs_int(0));
+            if (size_t(pos) >= vals.size()) {
+                res.set_str("");
+            } else {
+                res = vals[pos];
+            }
+            return;
+        }
+        args[0].force_str();
+        if (auto *idx = cs_list_index::get(cs, args[0])) {
+            ostd::string_range str = args[0].get_strr();
+            if (args.size() < 2) {
+                res.set_str(str);
+                return;
+            }
+            /* like below, only the last index counts */
+            cs_int pos = std::max(args[args.size() - 1].get_int(), cs_int(0));
+            if (size_t(pos) >= idx->items.size()) {
+                res.set_str("");
+                return;
+            }
+            auto &it = idx->items[pos];
+            ostd::string_range item = str.slice(it.item, it.item + it.item_len);
+            if (it.quote_len && (str[it.quote] == '"')) {
+                auto app = ostd::appender<cs_string>();
+                util::unescape_string(app, item);
+                res.set_str(std::move(app.get()));
+            } else {
+                res.set_str(item);
+            }
+            return;
+        }
         cs_string str = std::move(args[0].get_str());
         util::list_parser p(cs, str);
         p.get_raw_item() = str;
@@ -174,6 +263,40 @@ void cs_init_lib_list(cs_state &gcs) {
         cs_int offset = std::max(skip, cs_int(0)),
               len = (numargs >= 3) ? std::max(count, cs_int(0)) : -1;
 
+        if (auto *idx = cs_list_index::get(cs, args[0])) {
+            ostd::string_range str = args[0].get_strr();
+            size_t nitems = idx->items.size(), start;
+            if (len < 0) {
+                if (!offset) {
+                    start = 0;
+                } else if (size_t(offset) < nitems) {
+                    start = idx->items[offset].quote;
+                } else {
+                    start = idx->end;
+                }
+                res.set_str(str.slice(start, str.size()));
+                return;
+            }
+            if (!offset) {
+                start = 0;
+            } else if (size_t(offset) <= nitems) {
+                start = idx->items[offset - 1].next;
+            } else {
+                start = idx->end;
+            }
+            size_t last = std::min(size_t(offset) + size_t(len), nitems);
+            size_t qend = start;
+            /* as with the parser, a last item of no text selects nothing */
+            if (len && (size_t(offset) < last)) {
+                auto &it = idx->items[last - 1];
+                if (it.quote_len) {
+                    qend = it.quote + it.quote_len;
+                }
+            }
+            res.set_str(str.slice(start, qend));
+            return;
+        }
+
         util::list_parser p(cs, args[0].get_strr());
         for (cs_int i = 0; i < offset; ++i) {
             if (!p.parse()) break;
@@ -182,7 +305,7 @@ void cs_init_lib_list(cs_state &gcs) {
             if (offset > 0) {
                 p.skip();
             }
-            res.set_str(cs_string{p.get_input()});
+            res.set_str(p.get_input());
             return;
         }
 
@@ -193,20 +316,34 @@ void cs_init_lib_list(cs_state &gcs) {
         }
         ostd::string_range quote = p.get_raw_item(true);
         char const *qend = !quote.empty() ? &quote[quote.size()] : list;
-        res.set_str(cs_string{list, size_t(qend - list)});
+        res.set_str(ostd::string_range{list, qend});
     });
 
     gcs.new_command("listfind", "rse", [](auto &cs, auto args, auto &res) {
-        cs_stacked_value idv{args[0].get_ident()};
+        cs_stacked_value idv{cs, args[0].get_ident()};
         if (!idv.has_alias()) {
             res.set_int(-1);
             return;
         }
         auto body = args[2].get_code();
+        if (auto *idx = cs_list_index::get(cs, args[1])) {
+            ostd::string_range str = args[1].get_strr();
+            for (size_t n = 0; n < idx->items.size(); ++n) {
+                auto &it = idx->items[n];
+                idv.set_str(str.slice(it.item, it.item + it.item_len));
+                idv.push();
+                if (cs.run_bool(body)) {
+                    res.set_int(cs_int(n));
+                    return;
+                }
+            }
+            res.set_int(-1);
+            return;
+        }
         int n = -1;
         for (util::list_parser p(cs, args[1].get_strr()); p.parse();) {
             ++n;
-            idv.set_str(cs_string{p.get_raw_item()});
+            idv.set_str(p.get_raw_item());
             idv.push();
             if (cs.run_bool(body)) {
                 res.set_int(cs_int(n));
@@ -216,16 +353,31 @@ void cs_init_lib_list(cs_state &gcs) {
         res.set_int(-1);
     });
 
-    gcs.new_command("listassoc", "rse", [](auto &cs, auto args, auto &res) {
-        cs_stacked_value idv{args[0].get_ident()};
+    gcs.new_command("listassoc", "rte", [](auto &cs, auto args, auto &res) {
+        cs_stacked_value idv{cs, args[0].get_ident()};
         if (!idv.has_alias()) {
             return;
         }
         auto body = args[2].get_code();
+        if (args[1].get_type() == cs_value_type::Dict) {
+            size_t pos = 0;
+            ostd::string_range key;
+            cs_value const *v;
+            while (args[1].dict_next(pos, key, v)) {
+                idv.set_str(key);
+                idv.push();
+                if (cs.run_bool(body)) {
+                    res = *v;
+                    return;
+                }
+            }
+            return;
+        }
+        args[1].force_str();
         int n = -1;
         for (util::list_parser p(cs, args[1].get_strr()); p.parse();) {
             ++n;
-            idv.set_str(cs_string{p.get_raw_item()});
+            idv.set_str(p.get_raw_item());
             idv.push();
             if (cs.run_bool(body)) {
                 if (p.parse()) {
@@ -239,56 +391,76 @@ void cs_init_lib_list(cs_state &gcs) {
         }
     });
 
-    gcs.new_command("listfind=", "i", [](auto &cs, auto args, auto &res) {
+    gcs.new_command("listfind=", "sii", [](auto &cs, auto args, auto &res) {
         cs_list_find<cs_int>(
-            cs, args, res, [](const util::list_parser &p, cs_int val) {
-                return cs_parse_int(p.get_raw_item()) == val;
+            cs, args, res, [](ostd::string_range item, cs_int val) {
+                return cs_parse_int(item) == val;
             }
         );
     });
-    gcs.new_command("listfind=f", "f", [](auto &cs, auto args, auto &res) {
+    gcs.new_command("listfind=f", "sfi", [](auto &cs, auto args, auto &res) {
         cs_list_find<cs_float>(
-            cs, args, res, [](const util::list_parser &p, cs_float val) {
-                return cs_parse_float(p.get_raw_item()) == val;
+            cs, args, res, [](ostd::string_range item, cs_float val) {
+                return cs_parse_float(item) == val;
             }
         );
     });
-    gcs.new_command("listfind=s", "s", [](auto &cs, auto args, auto &res) {
+    gcs.new_command("listfind=s", "ssi", [](auto &cs, auto args, auto &res) {
         cs_list_find<ostd::string_range>(
-            cs, args, res, [](const util::list_parser &p, ostd::string_range val) {
-                return p.get_raw_item() == val;
+            cs, args, res, [](ostd::string_range item, ostd::string_range val) {
+                return item == val;
             }
         );
     });
 
-    gcs.new_command("listassoc=", "i", [](auto &cs, auto args, auto &res) {
+    /* dictionaries are looked up by key where the match would be one */
+    /* a number has more than one spelling, so those are scanned in order */
+    gcs.new_command("listassoc=", "ti", [](auto &cs, auto args, auto &res) {
         cs_list_assoc<cs_int>(
-            cs, args, res, [](const util::list_parser &p, cs_int val) {
-                return cs_parse_int(p.get_raw_item()) == val;
+            cs, args, res, [](ostd::string_range item, cs_int val) {
+                return cs_parse_int(item) == val;
             }
         );
     });
-    gcs.new_command("listassoc=f", "f", [](auto &cs, auto args, auto &res) {
+    gcs.new_command("listassoc=f", "tf", [](auto &cs, auto args, auto &res) {
         cs_list_assoc<cs_float>(
-            cs, args, res, [](const util::list_parser &p, cs_float val) {
-                return cs_parse_float(p.get_raw_item()) == val;
+            cs, args, res, [](ostd::string_range item, cs_float val) {
+                return cs_parse_float(item) == val;
             }
         );
     });
-    gcs.new_command("listassoc=s", "s", [](auto &cs, auto args, auto &res) {
+    gcs.new_command("listassoc=s", "ts", [](auto &cs, auto args, auto &res) {
+        if (args[0].get_type() == cs_value_type::Dict) {
+            if (auto *v = args[0].dict_get(args[1].get_strr())) {
+                res = *v;
+            }
+            return;
+        }
         cs_list_assoc<ostd::string_range>(
-            cs, args, res, [](const util::list_parser &p, ostd::string_range val) {
-                return p.get_raw_item() == val;
+            cs, args, res, [](ostd::string_range item, ostd::string_range val) {
+                return item == val;
             }
         );
     });
 
-    gcs.new_command("looplist", "rse", [](auto &cs, auto args, auto &) {
-        cs_stacked_value idv{args[0].get_ident()};
+    gcs.new_command("looplist", "rte", [](auto &cs, auto args, auto &) {
+        cs_stacked_value idv{cs, args[0].get_ident()};
         if (!idv.has_alias()) {
             return;
         }
         auto body = args[2].get_code();
+        if (args[1].get_type() == cs_value_type::Array) {
+            cs_const_value_r vals = args[1].get_array();
+            for (size_t i = 0; i < vals.size(); ++i) {
+                idv = vals[i];
+                idv.push();
+                if (cs.run_loop(body) == CsLoopState::Break) {
+                    break;
+                }
+            }
+            return;
+        }
+        args[1].force_str();
         int n = 0;
         for (util::list_parser p(cs, args[1].get_strr()); p.parse(); ++n) {
             idv.set_str(p.get_item());
@@ -305,7 +477,8 @@ end:
     });
 
     gcs.new_command("looplist2", "rrse", [](auto &cs, auto args, auto &) {
-        cs_stacked_value idv1{args[0].get_ident()}, idv2{args[1].get_ident()};
+        cs_stacked_value idv1{cs, args[0].get_ident()};
+        cs_stacked_value idv2{cs, args[1].get_ident()};
         if (!idv1.has_alias() || !idv2.has_alias()) {
             return;
         }
@@ -332,9 +505,9 @@ end:
     });
 
     gcs.new_command("looplist3", "rrrse", [](auto &cs, auto args, auto &) {
-        cs_stacked_value idv1{args[0].get_ident()};
-        cs_stacked_value idv2{args[1].get_ident()};
-        cs_stacked_value idv3{args[2].get_ident()};
+        cs_stacked_value idv1{cs, args[0].get_ident()};
+        cs_stacked_value idv2{cs, args[1].get_ident()};
+        cs_stacked_value idv3{cs, args[2].get_ident()};
         if (!idv1.has_alias() || !idv2.has_alias() || !idv3.has_alias()) {
             return;
         }
@@ -382,16 +555,30 @@ end:
         );
     });
 
-    gcs.new_command("listfilter", "rse", [](auto &cs, auto args, auto &res) {
-        cs_stacked_value idv{args[0].get_ident()};
+    gcs.new_command("listfilter", "rte", [](auto &cs, auto args, auto &res) {
+        cs_stacked_value idv{cs, args[0].get_ident()};
         if (!idv.has_alias()) {
             return;
         }
         auto body = args[2].get_code();
+        if (args[1].get_type() == cs_value_type::Array) {
+            cs_const_value_r vals = args[1].get_array();
+            cs_vector<cs_value> r;
+            for (size_t i = 0; i < vals.size(); ++i) {
+                idv = vals[i];
+                idv.push();
+                if (cs.run_bool(body)) {
+                    r.push_back(vals[i]);
+                }
+            }
+            cs_set_array(res, r);
+            return;
+        }
+        args[1].force_str();
         cs_string r;
         int n = 0;
         for (util::list_parser p(cs, args[1].get_strr()); p.parse(); ++n) {
-            idv.set_str(cs_string{p.get_raw_item()});
+            idv.set_str(p.get_raw_item());
             idv.push();
             if (cs.run_bool(body)) {
                 if (r.size()) {
@@ -404,14 +591,14 @@ end:
     });
 
     gcs.new_command("listcount", "rse", [](auto &cs, auto args, auto &res) {
-        cs_stacked_value idv{args[0].get_ident()};
+        cs_stacked_value idv{cs, args[0].get_ident()};
         if (!idv.has_alias()) {
             return;
         }
         auto body = args[2].get_code();
         int n = 0, r = 0;
         for (util::list_parser p(cs, args[1].get_strr()); p.parse(); ++n) {
-            idv.set_str(cs_string{p.get_raw_item()});
+            idv.set_str(p.get_raw_item());
             idv.push();
             if (cs.run_bool(body)) {
                 r++;
@@ -449,7 +636,7 @@ end:
 
     gcs.new_command("indexof", "ss", [](auto &cs, auto args, auto &res) {
         res.set_int(
-            cs_list_includes(cs, args[0].get_strr(), args[1].get_strr())
+            cs_list_includes(cs, args[0], args[1].get_strr())
         );
     });
 
@@ -510,6 +697,8 @@ end:
     });
 
     cs_init_lib_list_sort(gcs);
+    cs_init_lib_list_parallel(gcs);
+    cs_init_lib_list_dict(gcs);
 }
 
 struct ListSortItem {
@@ -529,10 +718,339 @@ struct ListSortFun {
         yv.push();
         return cs.run_bool(body);
     }
+
+    bool operator()(cs_value const *xval, cs_value const *yval) {
+        xv = *xval;
+        yv = *yval;
+        xv.push();
+        yv.push();
+        return cs.run_bool(body);
+    }
 };
 
+/* comparisons left to a builtin cs_code_cmp recognises are done natively,
+ * on keys taken from each item once; they go through the same sort as the
+ * scripted comparisons, so equal items end up in the same order, except in
+ * lists long enough to be sorted in parallel, where they keep their order
+ */
+enum {
+    CsSortInt = 0, CsSortFloat, CsSortStr
+};
+
+struct ListSortNative {
+    int kind;
+    bool sort, desc, unique;
+    /* equal items keep their order, as sortlistby promises */
+    bool stable;
+};
+
+static int cs_sort_kind(cs_cmp_code const &c) {
+    if (c.str) {
+        return CsSortStr;
+    }
+    return (c.op & CsMathFloat) ? CsSortFloat : CsSortInt;
+}
+
+static bool cs_sort_plan(
+    cs_state &cs, cs_ident *x, cs_ident *y, cs_bcode *body, cs_bcode *unique,
+    ListSortNative &ret
+) {
+    cs_cmp_code bc, uc;
+    ret.sort = (body != nullptr);
+    ret.desc = false;
+    ret.stable = false;
+    ret.unique = !cs_code_is_empty(unique);
+    if (ret.sort) {
+        if (!cs_code_cmp(cs, body, x, y, bc)) {
+            return false;
+        }
+        int op = bc.op & ~CsMathFloat;
+        if ((op != CsMathLt) && (op != CsMathGt)) {
+            return false;
+        }
+        ret.desc = ((op == CsMathGt) != bc.swap);
+        ret.kind = cs_sort_kind(bc);
+    }
+    if (ret.unique) {
+        if (
+            !cs_code_cmp(cs, unique, x, y, uc) ||
+            ((uc.op & ~CsMathFloat) != CsMathEq)
+        ) {
+            return false;
+        }
+        if (ret.sort && (cs_sort_kind(uc) != ret.kind)) {
+            return false;
+        }
+        ret.kind = cs_sort_kind(uc);
+    }
+    return ret.sort || ret.unique;
+}
+
+static void cs_sort_key(
+    ListSortItem const &it, cs_int &k, cs_vector<cs_string> &
+) {
+    k = cs_parse_int(it.str);
+}
+
+static void cs_sort_key(
+    ListSortItem const &it, cs_float &k, cs_vector<cs_string> &
+) {
+    k = cs_parse_float(it.str);
+}
+
+static void cs_sort_key(
+    ListSortItem const &it, ostd::string_range &k, cs_vector<cs_string> &
+) {
+    k = it.str;
+}
+
+static void cs_sort_key(
+    cs_value const *v, cs_int &k, cs_vector<cs_string> &
+) {
+    k = v->get_int();
+}
+
+static void cs_sort_key(
+    cs_value const *v, cs_float &k, cs_vector<cs_string> &
+) {
+    k = v->get_float();
+}
+
+static void cs_sort_key(
+    cs_value const *v, ostd::string_range &k, cs_vector<cs_string> &strs
+) {
+    switch (v->get_type()) {
+        case cs_value_type::String:
+        case cs_value_type::Array:
+        case cs_value_type::Dict:
+            k = v->get_strr();
+            break;
+        default:
+            /* reserved for every item, so earlier keys do not move */
+            k = strs.emplace_back(v->get_str());
+            break;
+    }
+}
+
+/* lists this long are sorted in chunks on the thread pool, which are then
+ * merged pairwise, also on it
+ */
+static constexpr size_t CsSortParMin = 1 << 14;
+
+template<typename C>
+static void cs_sort_order(
+    cs_state &cs, cs_vector<size_t> &order, bool stable, C cmp
+) {
+    size_t n = order.size();
+    if (n < CsSortParMin) {
+        if (stable) {
+            std::stable_sort(order.begin(), order.end(), cmp);
+        } else {
+            ostd::sort_cmp(ostd::iter(order), cmp);
+        }
+        return;
+    }
+    size_t nchunks = std::min(n / (CsSortParMin / 4), size_t(64));
+    auto bound = [&order, n, nchunks](size_t i) {
+        return order.begin() + (i * n / nchunks);
+    };
+    cs_parallel_for(cs, nchunks, [&](cs_state &, size_t first, size_t last) {
+        for (size_t i = first; i < last; ++i) {
+            std::stable_sort(bound(i), bound(i + 1), cmp);
+        }
+        return true;
+    });
+    for (size_t w = 1; w < nchunks; w *= 2) {
+        size_t npairs = (nchunks + (2 * w) - 1) / (2 * w);
+        cs_parallel_for(cs, npairs, [&](
+            cs_state &, size_t first, size_t last
+        ) {
+            for (size_t i = first; i < last; ++i) {
+                size_t lo = i * 2 * w;
+                size_t mid = std::min(lo + w, nchunks);
+                size_t hi = std::min(lo + 2 * w, nchunks);
+                if (mid < hi) {
+                    std::inplace_merge(bound(lo), bound(mid), bound(hi), cmp);
+                }
+            }
+            return true;
+        });
+    }
+}
+
+/* the order of the items after sorting, and which of them are kept */
+template<typename K>
+static void cs_sort_by_keys(
+    cs_state &cs, cs_vector<K> const &keys, ListSortNative const &how,
+    cs_vector<size_t> &order, cs_vector<unsigned char> &keep
+) {
+    size_t n = keys.size();
+    order.resize(n);
+    std::iota(order.begin(), order.end(), size_t(0));
+    keep.assign(n, 1);
+    if (how.sort) {
+        if (how.desc) {
+            cs_sort_order(cs, order, how.stable, [&keys](size_t a, size_t b) {
+                return keys[b] < keys[a];
+            });
+        } else {
+            cs_sort_order(cs, order, how.stable, [&keys](size_t a, size_t b) {
+                return keys[a] < keys[b];
+            });
+        }
+    }
+    if (!how.unique) {
+        return;
+    }
+    if (how.sort) {
+        for (size_t i = 1; i < n; ++i) {
+            keep[i] = !(keys[order[i - 1]] == keys[order[i]]);
+        }
+        return;
+    }
+    /* the first of equal items is kept, as with the scripted comparisons */
+    std::unordered_set<K> seen;
+    seen.reserve(n);
+    for (size_t i = 0; i < n; ++i) {
+        keep[i] = seen.insert(keys[i]).second;
+    }
+}
+
+template<typename K, typename T>
+static void cs_sort_native_keys(
+    cs_state &cs, cs_vector<T> &items, ListSortNative const &how,
+    cs_vector<unsigned char> &keep
+) {
+    cs_vector<K> keys(items.size());
+    cs_vector<cs_string> strs;
+    if (how.kind == CsSortStr) {
+        strs.reserve(items.size());
+    }
+    for (size_t i = 0; i < items.size(); ++i) {
+        cs_sort_key(items[i], keys[i], strs);
+    }
+    cs_vector<size_t> order;
+    cs_sort_by_keys(cs, keys, how, order, keep);
+    cs_vector<T> sorted;
+    sorted.reserve(items.size());
+    for (size_t i: order) {
+        sorted.push_back(items[i]);
+    }
+    items = std::move(sorted);
+}
+
+/* sorts the items in place, leaving in keep which of them stay */
+template<typename T>
+static void cs_sort_native(
+    cs_state &cs, cs_vector<T> &items, ListSortNative const &how,
+    cs_vector<unsigned char> &keep
+) {
+    switch (how.kind) {
+        case CsSortInt:
+            cs_sort_native_keys<cs_int>(cs, items, how, keep);
+            break;
+        case CsSortFloat:
+            cs_sort_native_keys<cs_float>(cs, items, how, keep);
+            break;
+        default:
+            cs_sort_native_keys<ostd::string_range>(cs, items, how, keep);
+            break;
+    }
+}
+
+static void cs_array_put(
+    cs_value &res, cs_vector<cs_value const *> const &items,
+    cs_vector<unsigned char> const &keep
+) {
+    cs_vector<cs_value> sorted;
+    sorted.reserve(items.size());
+    for (size_t i = 0; i < items.size(); ++i) {
+        if (keep[i]) {
+            sorted.push_back(*items[i]);
+        }
+    }
+    cs_set_array(res, sorted);
+}
+
+/* the same as below with the values of an array, which are compared as
+ * they are and make up an array again
+ */
+static void cs_array_sort(
+    cs_state &cs, cs_value &res, cs_const_value_r vals,
+    cs_alias *xa, cs_alias *ya, cs_bcode *body, cs_bcode *unique
+) {
+    cs_vector<cs_value const *> items;
+    for (size_t i = 0; i < vals.size(); ++i) {
+        items.push_back(&vals[i]);
+    }
+    if (items.empty()) {
+        res.set_array(vals);
+        return;
+    }
+
+    /* whether each item is kept */
+    cs_vector<unsigned char> keep(items.size(), 1);
+    ListSortNative how;
+    if (cs_sort_plan(cs, xa, ya, body, unique, how)) {
+        cs_sort_native(cs, items, how, keep);
+        cs_array_put(res, items, keep);
+        return;
+    }
+
+    cs_stacked_value xval{cs, xa}, yval{cs, ya};
+    xval.set_null();
+    yval.set_null();
+    xval.push();
+    yval.push();
+
+    if (body) {
+        ListSortFun f = { cs, xval, yval, body };
+        ostd::sort_cmp(ostd::iter(items), f);
+        if (!cs_code_is_empty(unique)) {
+            f.body = unique;
+            for (size_t i = 1; i < items.size(); i++) {
+                keep[i] = !f(items[i - 1], items[i]);
+            }
+        }
+    } else {
+        ListSortFun f = { cs, xval, yval, unique };
+        for (size_t i = 1; i < items.size(); i++) {
+            for (size_t j = 0; j < i; ++j) {
+                if (keep[j] && f(items[i], items[j])) {
+                    keep[i] = 0;
+                    break;
+                }
+            }
+        }
+    }
+
+    xval.pop();
+    yval.pop();
+
+    cs_array_put(res, items, keep);
+}
+
+static void cs_list_put(
+    cs_value &res, cs_vector<ListSortItem> const &items,
+    size_t totaluniq, size_t nuniq
+) {
+    cs_string sorted;
+    sorted.reserve(totaluniq + std::max(nuniq - 1, size_t(0)));
+    for (size_t i = 0; i < items.size(); ++i) {
+        ListSortItem const &item = items[i];
+        if (item.quote.empty()) {
+            continue;
+        }
+        if (i) {
+            sorted += ' ';
+        }
+        sorted += item.quote;
+    }
+    res.set_str(std::move(sorted));
+}
+
 static void cs_list_sort(
-    cs_state &cs, cs_value &res, ostd::string_range list,
+    cs_state &cs, cs_value &res, cs_value &lval,
     cs_ident *x, cs_ident *y, cs_bcode *body, cs_bcode *unique
 ) {
     if (x == y || !x->is_alias() || !y->is_alias()) {
@@ -540,6 +1058,11 @@ static void cs_list_sort(
     }
 
     cs_alias *xa = static_cast<cs_alias *>(x), *ya = static_cast<cs_alias *>(y);
+    if (lval.get_type() == cs_value_type::Array) {
+        cs_array_sort(cs, res, lval.get_array(), xa, ya, body, unique);
+        return;
+    }
+    ostd::string_range list = lval.force_str();
 
     cs_vector<ListSortItem> items;
     size_t total = 0;
@@ -551,18 +1074,33 @@ static void cs_list_sort(
     }
 
     if (items.empty()) {
-        res.set_str(cs_string{list});
+        res.set_str(list);
+        return;
+    }
+
+    size_t totaluniq = total;
+    size_t nuniq = items.size();
+    ListSortNative how;
+    if (cs_sort_plan(cs, xa, ya, body, unique, how)) {
+        cs_vector<unsigned char> keep;
+        cs_sort_native(cs, items, how, keep);
+        for (size_t i = 0; i < items.size(); ++i) {
+            if (!keep[i]) {
+                totaluniq -= items[i].quote.size();
+                items[i].quote = nullptr;
+                --nuniq;
+            }
+        }
+        cs_list_put(res, items, totaluniq, nuniq);
         return;
     }
 
-    cs_stacked_value xval{xa}, yval{ya};
+    cs_stacked_value xval{cs, xa}, yval{cs, ya};
     xval.set_null();
     yval.set_null();
     xval.push();
     yval.push();
 
-    size_t totaluniq = total;
-    size_t nuniq = items.size();
     if (body) {
         ListSortFun f = { cs, xval, yval, body };
         ostd::sort_cmp(ostd::iter(items), f);
@@ -603,34 +1141,472 @@ static void cs_list_sort(
     xval.pop();
     yval.pop();
 
-    cs_string sorted;
-    sorted.reserve(totaluniq + std::max(nuniq - 1, size_t(0)));
-    for (size_t i = 0; i < items.size(); ++i) {
-        ListSortItem &item = items[i];
-        if (item.quote.empty()) {
-            continue;
+    cs_list_put(res, items, totaluniq, nuniq);
+}
+
+/* how a key given as a string compares: as a number when cs_check_num
+ * takes it for one, a float unless it is all an int, and as a string
+ * otherwise
+ */
+static int cs_sort_str_kind(ostd::string_range s) {
+    if (s.empty() || !cs_check_num(s)) {
+        return CsSortStr;
+    }
+    ostd::string_range end;
+    cs_parse_int(s, &end);
+    return end.empty() ? CsSortInt : CsSortFloat;
+}
+
+/* sorts by the key the body gives for each item, run once per item rather
+ * than once per comparison; the keys compare as numbers when all of them
+ * are or read as one, as strings otherwise, and items with equal keys keep
+ * their order
+ */
+static void cs_list_sort_by(
+    cs_state &cs, cs_value &res, cs_value &lval, cs_ident *x,
+    cs_bcode *body, bool desc
+) {
+    if (!x->is_alias()) {
+        return;
+    }
+    bool arr = (lval.get_type() == cs_value_type::Array);
+    cs_vector<ListSortItem> items;
+    cs_vector<cs_value const *> vals;
+    size_t total = 0;
+    if (arr) {
+        cs_const_value_r r = lval.get_array();
+        for (size_t i = 0; i < r.size(); ++i) {
+            vals.push_back(&r[i]);
         }
-        if (i) {
-            sorted += ' ';
+    } else {
+        for (util::list_parser p(cs, lval.force_str()); p.parse();) {
+            items.push_back({ p.get_raw_item(), p.get_raw_item(true) });
+            total += items.back().quote.size();
         }
-        sorted += item.quote;
     }
-    res.set_str(std::move(sorted));
+    size_t n = arr ? vals.size() : items.size();
+    if (!n) {
+        res = lval;
+        return;
+    }
+
+    cs_vector<cs_value> keys(n);
+    int kind = CsSortInt;
+    {
+        cs_stacked_value xval{cs, x};
+        for (size_t i = 0; i < n; ++i) {
+            if (arr) {
+                xval = *vals[i];
+            } else {
+                xval.set_cstr(items[i].str);
+            }
+            xval.push();
+            cs.run(body, keys[i]);
+            switch (keys[i].get_type()) {
+                case cs_value_type::Int:
+                    break;
+                case cs_value_type::Float:
+                    kind = std::max(kind, int(CsSortFloat));
+                    break;
+                case cs_value_type::String:
+                case cs_value_type::Cstring:
+                case cs_value_type::Macro:
+                    kind = std::max(
+                        kind, cs_sort_str_kind(keys[i].get_strr())
+                    );
+                    break;
+                default:
+                    kind = CsSortStr;
+                    break;
+            }
+        }
+    }
+
+    ListSortNative how{kind, true, desc, false, true};
+    cs_vector<size_t> order;
+    cs_vector<unsigned char> keep;
+    if (kind == CsSortInt) {
+        cs_vector<cs_int> k;
+        for (auto &v: keys) {
+            k.push_back(v.get_int());
+        }
+        cs_sort_by_keys(cs, k, how, order, keep);
+    } else if (kind == CsSortFloat) {
+        cs_vector<cs_float> k;
+        for (auto &v: keys) {
+            k.push_back(v.get_float());
+        }
+        cs_sort_by_keys(cs, k, how, order, keep);
+    } else {
+        cs_vector<ostd::string_range> k;
+        for (auto &v: keys) {
+            k.push_back(v.force_str());
+        }
+        cs_sort_by_keys(cs, k, how, order, keep);
+    }
+
+    if (arr) {
+        cs_vector<cs_value const *> sorted;
+        for (size_t i: order) {
+            sorted.push_back(vals[i]);
+        }
+        cs_array_put(res, sorted, keep);
+        return;
+    }
+    cs_vector<ListSortItem> sorted;
+    for (size_t i: order) {
+        sorted.push_back(items[i]);
+    }
+    cs_list_put(res, sorted, total, n);
 }
 
 static void cs_init_lib_list_sort(cs_state &gcs) {
-    gcs.new_command("sortlist", "srree", [](auto &cs, auto args, auto &res) {
+    gcs.new_command("sortlist", "trree", [](auto &cs, auto args, auto &res) {
         cs_list_sort(
-            cs, res, args[0].get_strr(), args[1].get_ident(),
+            cs, res, args[0], args[1].get_ident(),
             args[2].get_ident(), args[3].get_code(), args[4].get_code()
         );
     });
-    gcs.new_command("uniquelist", "srre", [](auto &cs, auto args, auto &res) {
+    gcs.new_command("uniquelist", "trre", [](auto &cs, auto args, auto &res) {
         cs_list_sort(
-            cs, res, args[0].get_strr(), args[1].get_ident(),
+            cs, res, args[0], args[1].get_ident(),
             args[2].get_ident(), nullptr, args[3].get_code()
         );
     });
+    gcs.new_command("sortlistby", "trei", [](auto &cs, auto args, auto &res) {
+        cs_list_sort_by(
+            cs, res, args[0], args[1].get_ident(), args[2].get_code(),
+            args[3].get_int() != 0
+        );
+    });
+}
+
+/* the parallel variants parse the list once up front and hand the items
+ * out in chunks through cs_parallel_for; the loop variable is pushed on
+ * the state of each thread, so the caller never sees it, and the results
+ * are kept per item so that they merge in list order
+ */
+
+struct ListParItem {
+    ostd::string_range str;
+    ostd::string_range quote;
+
+    cs_string get() const {
+        if (!quote.empty() && (*quote == '"')) {
+            return std::move(util::unescape_string(
+                ostd::appender<cs_string>(), str
+            ).get());
+        }
+        return cs_string{str};
+    }
+};
+
+static cs_vector<ListParItem> cs_list_par_items(
+    cs_state &cs, ostd::string_range list
+) {
+    cs_vector<ListParItem> items;
+    for (util::list_parser p(cs, list); p.parse();) {
+        items.push_back({ p.get_raw_item(), p.get_raw_item(true) });
+    }
+    return items;
+}
+
+/* a break stops the chunks not yet started; the results end before the
+ * first item that broke, even if later ones already ran
+ */
+static void cs_list_par_break(std::atomic<size_t> &brk, size_t i) {
+    size_t cur = brk.load();
+    while ((i < cur) && !brk.compare_exchange_weak(cur, i));
+}
+
+static void cs_init_lib_list_parallel(cs_state &gcs) {
+    gcs.new_command("plooplist", "rse", [](auto &cs, auto args, auto &) {
+        cs_ident *id = args[0].get_ident();
+        if (!id->is_alias()) {
+            return;
+        }
+        auto body = args[2].get_code();
+        auto items = cs_list_par_items(cs, args[1].get_strr());
+        cs_parallel_for(cs, items.size(), [&](
+            cs_state &ts, size_t first, size_t last
+        ) {
+            cs_stacked_value idv{ts, id};
+            for (size_t i = first; i < last; ++i) {
+                idv.set_str(items[i].get());
+                idv.push();
+                if (ts.run_loop(body) == CsLoopState::Break) {
+                    return false;
+                }
+            }
+            return true;
+        });
+    });
+
+    gcs.new_command("plistmap", "rse", [](auto &cs, auto args, auto &res) {
+        cs_ident *id = args[0].get_ident();
+        if (!id->is_alias()) {
+            return;
+        }
+        auto body = args[2].get_code();
+        auto items = cs_list_par_items(cs, args[1].get_strr());
+        /* items skipped by continue are left out with their separator */
+        cs_vector<cs_string> rets(items.size());
+        cs_vector<char> keep(items.size(), 0);
+        std::atomic<size_t> brk = items.size();
+        cs_parallel_for(cs, items.size(), [&](
+            cs_state &ts, size_t first, size_t last
+        ) {
+            cs_stacked_value idv{ts, id};
+            for (size_t i = first; i < last; ++i) {
+                idv.set_str(items[i].get());
+                idv.push();
+                cs_value v;
+                switch (ts.run_loop(body, v)) {
+                    case CsLoopState::Break:
+                        cs_list_par_break(brk, i);
+                        return false;
+                    case CsLoopState::Continue:
+                        continue;
+                    default:
+                        break;
+                }
+                rets[i] = v.get_str();
+                keep[i] = 1;
+            }
+            return true;
+        });
+        cs_string r;
+        bool first = true;
+        for (size_t i = 0, n = brk.load(); i < n; ++i) {
+            if (!keep[i]) {
+                continue;
+            }
+            if (!first) {
+                r += ' ';
+            }
+            r += rets[i];
+            first = false;
+        }
+        res.set_str(std::move(r));
+    });
+
+    gcs.new_command("plistfilter", "rse", [](auto &cs, auto args, auto &res) {
+        cs_ident *id = args[0].get_ident();
+        if (!id->is_alias()) {
+            return;
+        }
+        auto body = args[2].get_code();
+        auto items = cs_list_par_items(cs, args[1].get_strr());
+        cs_vector<char> keep(items.size(), 0);
+        cs_parallel_for(cs, items.size(), [&](
+            cs_state &ts, size_t first, size_t last
+        ) {
+            cs_stacked_value idv{ts, id};
+            for (size_t i = first; i < last; ++i) {
+                idv.set_str(items[i].str);
+                idv.push();
+                keep[i] = ts.run_bool(body);
+            }
+            return true;
+        });
+        cs_string r;
+        for (size_t i = 0; i < items.size(); ++i) {
+            if (!keep[i]) {
+                continue;
+            }
+            if (!r.empty()) {
+                r += ' ';
+            }
+            r += items[i].quote;
+        }
+        res.set_str(std::move(r));
+    });
+
+    gcs.new_command("plistcount", "rse", [](auto &cs, auto args, auto &res) {
+        cs_ident *id = args[0].get_ident();
+        if (!id->is_alias()) {
+            return;
+        }
+        auto body = args[2].get_code();
+        auto items = cs_list_par_items(cs, args[1].get_strr());
+        std::atomic<cs_int> r = 0;
+        cs_parallel_for(cs, items.size(), [&](
+            cs_state &ts, size_t first, size_t last
+        ) {
+            cs_stacked_value idv{ts, id};
+            cs_int n = 0;
+            for (size_t i = first; i < last; ++i) {
+                idv.set_str(items[i].str);
+                idv.push();
+                if (ts.run_bool(body)) {
+                    ++n;
+                }
+            }
+            r += n;
+            return true;
+        });
+        res.set_int(r.load());
+    });
+}
+
+/* anything else is made a dictionary from its items taken in pairs, a
+ * missing last value being null; a key given more than once keeps its
+ * first value, which is the one listassoc and such find
+ */
+static void cs_dict_from(cs_state &cs, cs_value &v) {
+    if (v.get_type() == cs_value_type::Dict) {
+        return;
+    }
+    cs_value d;
+    d.set_dict();
+    if (v.get_type() == cs_value_type::Array) {
+        cs_const_value_r vals = v.get_array();
+        for (size_t i = 0; i < vals.size(); i += 2) {
+            cs_value val;
+            if ((i + 1) < vals.size()) {
+                val = vals[i + 1];
+            }
+            cs_string key = vals[i].get_str();
+            if (!d.dict_get(key)) {
+                d.dict_set(key, val);
+            }
+        }
+    } else {
+        v.force_str();
+        cs_value val;
+        for (util::list_parser p(cs, v.get_strr()); p.parse();) {
+            cs_string key = p.get_item();
+            if (p.parse()) {
+                val.set_str(p.get_item());
+            } else {
+                val.set_null();
+            }
+            if (!d.dict_get(key)) {
+                d.dict_set(key, val);
+            }
+        }
+    }
+    v = std::move(d);
+}
+
+/* the alias keeps the only ref to its dictionary while it is changed, so
+ * that sets and deletes do not copy it
+ */
+template<typename F>
+static void cs_dict_change(cs_state &cs, cs_ident *id, F change) {
+    if (!id || !id->is_alias()) {
+        return;
+    }
+    cs_alias *a = static_cast<cs_alias *>(id);
+    cs_value d = cs_alias_internal::take_value(a, cs);
+    auto give = [&cs, a](cs_value &v) {
+        if (a->get_index() < MaxArguments) {
+            cs_alias_internal::set_arg(a, cs, v);
+        } else {
+            cs_alias_internal::set_alias(a, cs, v);
+        }
+    };
+    try {
+        cs_dict_from(cs, d);
+        change(d);
+    } catch (...) {
+        give(d);
+        throw;
+    }
+    give(d);
+}
+
+static void cs_init_lib_list_dict(cs_state &gcs) {
+    /* the commands taking their dictionary as "t" use anything else as a
+     * key/value list, which is what dictionaries are as strings
+     */
+    gcs.new_command("dict", "V", [](auto &, auto args, auto &res) {
+        res.set_dict();
+        cs_value val;
+        for (size_t i = 0; i < args.size(); i += 2) {
+            if ((i + 1) < args.size()) {
+                val = args[i + 1];
+            } else {
+                val.set_null();
+            }
+            /* the first value of a repeated key stays, as in cs_dict_from */
+            cs_string key = args[i].get_str();
+            if (!res.dict_get(key)) {
+                res.dict_set(key, val);
+            }
+        }
+    });
+
+    gcs.new_command("listdict", "t", [](auto &cs, auto args, auto &res) {
+        cs_dict_from(cs, args[0]);
+        res = std::move(args[0]);
+    });
+
+    gcs.new_command("dictget", "ts", [](auto &cs, auto args, auto &res) {
+        cs_dict_from(cs, args[0]);
+        if (auto *v = args[0].dict_get(args[1].get_strr())) {
+            res = *v;
+        }
+    });
+
+    gcs.new_command("dicthas", "ts", [](auto &cs, auto args, auto &res) {
+        cs_dict_from(cs, args[0]);
+        res.set_int(args[0].dict_get(args[1].get_strr()) != nullptr);
+    });
+
+    gcs.new_command("dictlen", "t", [](auto &cs, auto args, auto &res) {
+        cs_dict_from(cs, args[0]);
+        res.set_int(cs_int(args[0].dict_size()));
+    });
+
+    gcs.new_command("dictkeys", "t", [](auto &cs, auto args, auto &res) {
+        cs_dict_from(cs, args[0]);
+        cs_vector<cs_value> keys;
+        size_t pos = 0;
+        ostd::string_range key;
+        cs_value const *val;
+        while (args[0].dict_next(pos, key, val)) {
+            keys.emplace_back().set_str(key);
+        }
+        cs_set_array(res, keys);
+    });
+
+    gcs.new_command("dictset", "rst", [](auto &cs, auto args, auto &) {
+        cs_dict_change(cs, args[0].get_ident(), [&args](cs_value &d) {
+            d.dict_set(args[1].get_strr(), args[2]);
+        });
+    });
+
+    gcs.new_command("dictdel", "rs", [](auto &cs, auto args, auto &res) {
+        bool found = false;
+        cs_dict_change(cs, args[0].get_ident(), [&args, &found](cs_value &d) {
+            found = d.dict_del(args[1].get_strr());
+        });
+        res.set_int(found);
+    });
+
+    gcs.new_command("loopdict", "rrte", [](auto &cs, auto args, auto &) {
+        cs_stacked_value kv{cs, args[0].get_ident()};
+        cs_stacked_value vv{cs, args[1].get_ident()};
+        if (!kv.has_alias() || !vv.has_alias()) {
+            return;
+        }
+        auto body = args[3].get_code();
+        /* the body sees a copy of its own once it changes the dictionary */
+        cs_dict_from(cs, args[2]);
+        size_t pos = 0;
+        ostd::string_range key;
+        cs_value const *val;
+        while (args[2].dict_next(pos, key, val)) {
+            kv.set_str(key);
+            kv.push();
+            vv = *val;
+            vv.push();
+            if (cs.run_loop(body) == CsLoopState::Break) {
+                break;
+            }
+        }
+    });
 }
 
 } /* namespace cscript */
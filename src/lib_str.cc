@@ -139,12 +139,10 @@ void cs_init_lib_string(cs_state &cs) {
         cs_int start = args[1].get_int(), count = args[2].get_int();
         cs_int numargs = args[3].get_int();
         cs_int len = cs_int(s.size()), offset = std::clamp(start, cs_int(0), len);
-        res.set_str(cs_string{
-            &s[offset],
-            (numargs >= 3)
-                ? size_t(std::clamp(count, cs_int(0), len - offset))
-                : size_t(len - offset)
-        });
+        res.set_str(s.slice(size_t(offset), (numargs >= 3)
+            ? size_t(offset + std::clamp(count, cs_int(0), len - offset))
+            : size_t(len)
+        ));
     });
 
     cs.new_command("strcmp", "s1V", [](auto &, auto args, auto &res) {
@@ -179,7 +177,7 @@ void cs_init_lib_string(cs_state &cs) {
         }
         cs_string buf;
         if (!oldval.size()) {
-            res.set_str(cs_string{s});
+            res.set_str(s);
             return;
         }
         for (size_t i = 0;; ++i) {
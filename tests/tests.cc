@@ -2,7 +2,14 @@
 
 #include <signal.h>
 
+#include <atomic>
+#include <chrono>
+#include <filesystem>
+#include <fstream>
 #include <optional>
+#include <set>
+#include <thread>
+#include <vector>
 
 #include <ostd/platform.hh>
 #include <ostd/io.hh>
@@ -91,6 +98,50 @@ TEST(MATH, nested)
 }
 
 
+TEST(MATH, inline_ops)
+{
+    cs_state gcs;
+    gcs.init_libs();
+
+    ASSERT_EQ(gcs.run_str(
+        "concat (+ 40 2) (- 2 40) (* 6 7) (div 7 2) (mod 7 2)"
+    ), "42 -38 42 3 1");
+    ASSERT_EQ(gcs.run_str(
+        "concat (div 7 0) (mod 7 0) (divf 1 0) (+ 1 2 3)"
+    ), "0 0 0.0 6");
+    ASSERT_EQ(gcs.run_str(
+        "concat (= 1 1) (!= 1 1) (< 1 2) (>= 1 2) (<f 0.5 1)"
+    ), "1 0 1 0 1");
+    ASSERT_EQ(gcs.run_str(
+        "a = 5; b = \"3x\"; concat (+ $a $b) (+f $a 0.5)"
+    ), "8 5.5");
+    ASSERT_EQ(gcs.run_str("n = +; $n 1 2"), "3");
+    ASSERT_TRUE(gcs.get_ident("+")->is_command());
+
+    std::string fname = (
+        std::filesystem::temp_directory_path() / "cs_inline_ops.csb"
+    ).string();
+    auto code = gcs.compile("+ 1 2");
+    {
+        ostd::file_stream f{fname, ostd::stream_mode::WRITE};
+        gcs.save_code(code, f);
+    }
+
+    // code compiled after a host replaces a builtin calls the replacement
+    gcs.new_command("+", "ii", [](auto &, auto args, auto &res) {
+        res.set_int(args[0].get_int() * 100 + args[1].get_int());
+    });
+    ASSERT_EQ(gcs.run_str("+ 1 2"), "102");
+    ASSERT_EQ(gcs.run_str(code), "3");
+
+    // and so does code loaded after that
+    ostd::file_stream f{fname, ostd::stream_mode::READ};
+    ASSERT_EQ(gcs.run_str(gcs.load_code(f)), "102");
+    f.close();
+    std::filesystem::remove(fname);
+}
+
+
 TEST(ECHO, literals_ascii)
 {
     run_test("eq", "echo hello world", "hello world");
@@ -150,6 +201,366 @@ TEST(LOOPS, nested)
     );
 }
 
+TEST(LOOPS, break_continue)
+{
+    cs_state gcs;
+    gcs.init_libs();
+
+    ASSERT_EQ(gcs.run_str(
+        "r = 0; loop i 10 [if (= $i 3) [break]; r = (+ $r 1)]; result $r"
+    ), "3");
+    ASSERT_EQ(gcs.run_str(
+        "r = 0; loop i 10 [if (mod $i 2) [continue]; r = (+ $r $i)]; result $r"
+    ), "20");
+
+    // from inside aliases, expressions and commands called by name
+    ASSERT_EQ(gcs.run_str(
+        "f = [if (= $arg1 4) [break]]; r = 0; "
+        "loop i 10 [f $i; r = (+ $r 1)]; result $r"
+    ), "4");
+    ASSERT_EQ(gcs.run_str(
+        "r = 0; loop i 10 [r = (+ $r (if (> $i 1) [break] [result 1]))]; "
+        "result $r"
+    ), "2");
+    ASSERT_EQ(gcs.run_str(
+        "b = break; r = 0; loop i 10 [r = $i; $b]; result $r"
+    ), "0");
+
+    // only the innermost loop is affected
+    ASSERT_EQ(gcs.run_str(
+        "r = 0; loop i 3 [loop j 10 [if (= $j 2) [break]; r = (+ $r 1)]]; "
+        "result $r"
+    ), "6");
+    ASSERT_EQ(gcs.run_str(
+        "r = \"\"; looplist x \"a b c d\" [if (=s $x c) [break]; "
+        "r = (concatword $r $x)]; result $r"
+    ), "ab");
+
+    // the loop above is over, so there is nothing to break out of
+    EXPECT_THROW(gcs.run("break"), cs_error);
+    ASSERT_FALSE(gcs.is_in_loop());
+}
+
+TEST(LOOPS, variants)
+{
+    cs_state gcs;
+    gcs.init_libs();
+
+    ASSERT_EQ(gcs.run_str(
+        "r = \"\"; loop+ i 3 4 [r = (concatword $r $i)]; result $r"
+    ), "3456");
+    ASSERT_EQ(gcs.run_str(
+        "r = \"\"; loop* i 3 2 [r = (concatword $r $i)]; result $r"
+    ), "024");
+    ASSERT_EQ(gcs.run_str(
+        "r = \"\"; loop+* i 1 3 2 [r = (concatword $r $i)]; result $r"
+    ), "14");
+    ASSERT_EQ(gcs.run_str(
+        "r = \"\"; loopwhile i 10 [< $i 3] [r = (concatword $r $i)]; "
+        "result $r"
+    ), "012");
+    ASSERT_EQ(gcs.run_str(
+        "r = \"\"; loopwhile* i 2 10 [< $i 5] [r = (concatword $r $i)]; "
+        "result $r"
+    ), "024");
+    ASSERT_EQ(gcs.run_str(
+        "r = \"\"; loopwhile+* i 1 2 10 [< $i 6] [r = (concatword $r $i)]; "
+        "result $r"
+    ), "135");
+
+    // the counter is restored afterwards, also when the body fails
+    ASSERT_EQ(gcs.run_str(
+        "i = x; loop i 3 []; loop i 3 [r = $i]; concat $i $r"
+    ), "x 2");
+    EXPECT_THROW(gcs.run("loop i 3 [error oops]"), cs_error);
+    ASSERT_EQ(gcs.run_str("result $i"), "x");
+    ASSERT_FALSE(gcs.is_in_loop());
+
+    // bodies that are not literal blocks go through the command
+    ASSERT_EQ(gcs.run_str(
+        "b = [r = (+ $r $i)]; r = 0; loop i 5 $b; loop i 4 [] $b; result $r"
+    ), "10");
+    ASSERT_EQ(gcs.run_str(
+        "r = 0; n = loop; $n i 4 [r = (+ $r $i)]; result $r"
+    ), "6");
+}
+
+TEST(LISTS, indexed)
+{
+    cs_state gcs;
+    gcs.init_libs();
+
+    // long enough for the list commands to index it instead of reparsing
+    gcs.run_str(
+        "l = \"\"; loop i 30 [l = (concat $l $i)]; "
+        "l = (concat \"^\"x^^^\"y^\"\" $l \"[p [q]] // c\")"
+    );
+    ASSERT_EQ(gcs.run_str("listlen $l"), "32");
+    ASSERT_EQ(gcs.run_str("at $l 0"), "x\"y");
+    ASSERT_EQ(gcs.run_str("at $l -5"), "x\"y");
+    ASSERT_EQ(gcs.run_str("at $l 7"), "6");
+    ASSERT_EQ(gcs.run_str("at $l 0 31"), "p [q]");
+    ASSERT_EQ(gcs.run_str("at $l 32"), "");
+    ASSERT_EQ(gcs.run_str("sublist $l 29 2"), "28 29");
+    ASSERT_EQ(gcs.run_str("sublist $l 30"), "29 [p [q]] // c");
+    ASSERT_EQ(gcs.run_str("sublist $l 31 5"), "[p [q]]");
+    ASSERT_EQ(gcs.run_str("sublist $l 32 1"), "");
+    ASSERT_EQ(gcs.run_str("sublist $l 40"), "");
+    ASSERT_EQ(gcs.run_str("sublist $l 1 0"), "");
+    ASSERT_EQ(gcs.run_str("sublist $l 0 2"), "\"x^\"y\"  0");
+    ASSERT_EQ(gcs.run_str("listfind x $l [= $x 17]"), "18");
+    ASSERT_EQ(gcs.run_str("listfind x $l [=s $x \"p [q]\"]"), "31");
+    ASSERT_EQ(gcs.run_str("listfind x $l [= $x 99]"), "-1");
+
+    // a last item with no text of its own selects nothing, as when parsed
+    cs_value m;
+    m.set_str(
+        "\"\t^)$]qqqqqqqqqa\"^             ;;;)qqqqqqqqqqqqqqqqqqqqqqqqqqqqq"
+    );
+    gcs.set_alias("m", m);
+    ASSERT_EQ(gcs.run_str("listlen $m"), "4");
+    ASSERT_EQ(gcs.run_str("sublist $m 2 5"), "");
+    ASSERT_EQ(gcs.run_str("sublist $m 0 5"), "");
+    ASSERT_EQ(gcs.run_str("sublist $m 0 2"), "\"\t^)$]qqqqqqqqqa\"^");
+}
+
+TEST(LISTS, set_ops)
+{
+    cs_state gcs;
+    gcs.init_libs();
+
+    gcs.run_str(
+        "a = (concat (loopconcat i 20 [result $i]) \"^\"x y^\"\" "
+        "[[p q]] 3); "
+        "b = (concat (loopconcat i 20 [* $i 3]) \"^\"x y^\"\" 3)"
+    );
+    ASSERT_EQ(
+        gcs.run_str("listintersect $a $b"), "0 3 6 9 12 15 18 \"x y\" 3"
+    );
+    ASSERT_EQ(
+        gcs.run_str("listdel $a $b"),
+        "1 2 4 5 7 8 10 11 13 14 16 17 19 [p q]"
+    );
+    ASSERT_EQ(
+        gcs.run_str("listdel (listunion $a $b) $a"),
+        "21 24 27 30 33 36 39 42 45 48 51 54 57"
+    );
+    // the first one is found, whether scanned or looked up
+    ASSERT_EQ(gcs.run_str("indexof $a 3"), "3");
+    ASSERT_EQ(gcs.run_str("indexof $a 3"), "3");
+    ASSERT_EQ(gcs.run_str("indexof $a \"x y\""), "20");
+    ASSERT_EQ(gcs.run_str("indexof $a 99"), "-1");
+}
+
+TEST(LISTS, long_runs)
+{
+    cs_state gcs;
+    gcs.init_libs();
+
+    // runs of every length around the 16 and 32 byte blocks the scanner uses
+    gcs.run_str(
+        "pad = \"\"; l = \"\"; "
+        "loop i 70 [l = (concat $l (format \"%1%2^\"%2^^^\"%1^\" [%2[%1]]"
+        "%2//%2^n\" $i $pad)); pad = (concatword $pad \" \")]"
+    );
+    ASSERT_EQ(gcs.run_str("listlen $l"), "210");
+    ASSERT_EQ(gcs.run_str("at $l 0"), "0");
+    ASSERT_EQ(gcs.run_str("at $l 61"), "                    \"20");
+    ASSERT_EQ(gcs.run_str("at $l 206"), (std::string(68, ' ') + "[68]"));
+    ASSERT_EQ(gcs.run_str("at $l 209"), (std::string(69, ' ') + "[69]"));
+    ASSERT_EQ(gcs.run_str(
+        "n = 0; looplist x $l [n = (+ $n (strlen $x))]; result $n"
+    ), "5430");
+}
+
+TEST(LISTS, arrays)
+{
+    cs_state gcs;
+    gcs.init_libs();
+
+    // the values keep their types, strings only come out as lists
+    gcs.run("a = (array 3 (+ 1 0) \"x y\" \"\" [q])");
+    cs_value v;
+    gcs.run("at $a 1", v);
+    ASSERT_EQ(v.get_type(), cs_value_type::Int);
+    ASSERT_EQ(v.get_int(), 1);
+    ASSERT_EQ(gcs.run_str("result $a"), "3 1 \"x y\" \"\" q");
+    ASSERT_EQ(gcs.run_int("listlen $a"), 5);
+    ASSERT_EQ(gcs.run_str("at $a 2"), "x y");
+    ASSERT_EQ(gcs.run_str("at $a 5"), "");
+    ASSERT_EQ(gcs.run_int("listlen (listarray $a)"), 5);
+    ASSERT_EQ(gcs.run_str("at (listarray $a) 2"), "x y");
+
+    // copies share the values, and lookups taking a string get the list
+    v = gcs.get_alias("a")->get_value();
+    ASSERT_EQ(v.get_type(), cs_value_type::Array);
+    ASSERT_EQ(v.get_array().size(), size_t(5));
+    cs_value w = v;
+    ASSERT_EQ(&v.get_array()[0], &w.get_array()[0]);
+    gcs.run("b = $a; result $b", w);
+    ASSERT_EQ(w.get_type(), cs_value_type::String);
+    ASSERT_EQ(w.get_strr(), v.get_strr());
+
+    ASSERT_EQ(gcs.run_str(
+        "n = \"\"; looplist x $a [n = (concatword $n $x .)]; result $n"
+    ), "3.1.x y..q.");
+    ASSERT_EQ(gcs.run_str(
+        "n = 0; looplist x (array 1 2 3) [n = (+ $n $x); break]; result $n"
+    ), "1");
+    gcs.run("listfilter x $a [> (strlen $x) 1]", v);
+    ASSERT_EQ(v.get_type(), cs_value_type::Array);
+    ASSERT_EQ(v.get_str(), "\"x y\"");
+    ASSERT_EQ(gcs.run_str(
+        "sortlist (array 5 2 9 1 2) x y [< $x $y]"
+    ), "1 2 2 5 9");
+    ASSERT_EQ(gcs.run_str(
+        "sortlist (array 5 2 9 1 2) x y [< $x $y] [= $x $y]"
+    ), "1 2 5 9");
+    ASSERT_EQ(gcs.run_str(
+        "uniquelist (array 1 2 1 3 2) x y [= $x $y]"
+    ), "1 2 3");
+
+    // the string list commands take them as lists
+    ASSERT_EQ(gcs.run_int("indexof $a \"x y\""), 2);
+    ASSERT_EQ(gcs.run_str("sublist (array 1 2 3 4) 1 2"), "2 3");
+    ASSERT_EQ(gcs.run_int("+ (at (array 1 2 3) 2) 1"), 4);
+}
+
+TEST(LISTS, sorting)
+{
+    cs_state gcs;
+    gcs.init_libs();
+
+    // plain comparisons run natively and agree with the scripted ones
+    gcs.run("l = (loopconcat i 3000 [mod (* $i 7919) 3001])");
+    ASSERT_EQ(gcs.run_str("sortlist \"5 3 10 1\" x y [< $x $y]"), "1 3 5 10");
+    ASSERT_EQ(gcs.run_str("sortlist \"5 3 10 1\" x y [< $y $x]"), "10 5 3 1");
+    ASSERT_EQ(gcs.run_str("sortlist \"5 3 10 1\" x y [<s $x $y]"), "1 10 3 5");
+    ASSERT_EQ(gcs.run_str(
+        "sortlist \"2.5 0.5 1\" x y [<f $x $y]"
+    ), "0.5 1 2.5");
+    ASSERT_EQ(gcs.run_int(
+        "=s (sortlist $l x y [> $x $y]) (sortlist $l x y [> (+ $x 0) $y])"
+    ), 1);
+    ASSERT_EQ(gcs.run_int(
+        "=s (sortlist $l x y [>s $x $y]) (sortlist $l x y [>s $x (result $y)])"
+    ), 1);
+    // also in how they order items that compare equal
+    gcs.run(
+        "t = (loopconcat i 3000 "
+        "[concatword (substr 00 0 (mod $i 3)) (mod (* $i 7919) 50)])"
+    );
+    ASSERT_EQ(gcs.run_int(
+        "=s (sortlist $t x y [< $x $y]) (sortlist $t x y [< $x (+ $y 0)])"
+    ), 1);
+    ASSERT_EQ(gcs.run_int(
+        "=s (sortlist $t x y [> $x $y]) (sortlist $t x y [> $x (+ $y 0)])"
+    ), 1);
+
+    // uniqueness hashes the items and keeps the first of each
+    ASSERT_EQ(gcs.run_str(
+        "uniquelist \"b a b c a\" x y [=s $x $y]"
+    ), "b a c");
+    ASSERT_EQ(gcs.run_str(
+        "uniquelist \"1 01 2 1.0\" x y [= $x $y]"
+    ), "1 2");
+    ASSERT_EQ(gcs.run_str(
+        "sortlist \"3 1 3 2 1\" x y [< $x $y] [= $y $x]"
+    ), "1 2 3");
+    ASSERT_EQ(gcs.run_str(
+        "uniquelist (array 3 1 3 (+ 1 0)) x y [= $x $y]"
+    ), "3 1");
+
+    // keys are taken once per item, equal ones keep their order
+    ASSERT_EQ(gcs.run_str(
+        "n = 0; sortlistby \"ccc a bb dd\" w [n = (+ $n 1); strlen $w]"
+    ), "a bb dd ccc");
+    ASSERT_EQ(gcs.run_int("result $n"), 4);
+    ASSERT_EQ(gcs.run_str(
+        "sortlistby \"ccc a bb dd\" w [strlen $w] 1"
+    ), "ccc bb dd a");
+    ASSERT_EQ(gcs.run_str(
+        "sortlistby \"b2 a3 c1\" w [substr $w 1]"
+    ), "c1 b2 a3");
+    ASSERT_EQ(gcs.run_str("sortlistby \"b2 a3 c1\" w [result $w]"), "a3 b2 c1");
+    // keys made as strings still compare as numbers when they read as one
+    ASSERT_EQ(gcs.run_str("sortlistby \"10 9 100\" w [result $w]"), "9 10 100");
+    ASSERT_EQ(gcs.run_str(
+        "sortlistby \"x2 y1.5 z10\" w [substr $w 1]"
+    ), "y1.5 x2 z10");
+    // long lists are sorted in parallel
+    gcs.run("l = (loopconcat i 40000 [mod (* $i 7919) 40009])");
+    ASSERT_EQ(gcs.run_int(
+        "=s (sortlistby $l w [- 0 $w]) (sortlist $l x y [> $x $y])"
+    ), 1);
+    ASSERT_EQ(gcs.run_str("at (sortlist $l x y [< $x $y]) 39999"), "40008");
+
+    // a command replacing a comparison builtin is called like any other
+    gcs.new_command("<s", "ss", [](auto &, auto args, auto &res) {
+        res.set_int(args[0].get_strr() > args[1].get_strr());
+    });
+    ASSERT_EQ(gcs.run_str("sortlist \"a c b\" x y [<s $x $y]"), "c b a");
+}
+
+TEST(LISTS, dicts)
+{
+    cs_state gcs;
+    gcs.init_libs();
+
+    // entries keep the order they were first set in, values their types
+    gcs.run("d = (dict a (+ 1 0) b \"x y\" c)");
+    ASSERT_EQ(gcs.run_str("result $d"), "a 1 b \"x y\" c \"\"");
+    cs_value v;
+    gcs.run("dictget $d a", v);
+    ASSERT_EQ(v.get_type(), cs_value_type::Int);
+    ASSERT_EQ(gcs.run_str("dictget $d b"), "x y");
+    ASSERT_EQ(gcs.run_int("dicthas $d c"), 1);
+    ASSERT_EQ(gcs.run_int("dicthas $d z"), 0);
+    ASSERT_EQ(gcs.run_int("dictlen $d"), 3);
+
+    // changes copy dictionaries only while something else shares them
+    v = gcs.get_alias("d")->get_value();
+    gcs.run("dictset d a 5; dictset d e 6");
+    ASSERT_EQ(v.dict_get("a")->get_int(), 1);
+    ASSERT_EQ(v.dict_get("e"), nullptr);
+    ASSERT_EQ(gcs.run_str("result $d"), "a 5 b \"x y\" c \"\" e 6");
+    ASSERT_EQ(gcs.run_int("dictdel d b"), 1);
+    ASSERT_EQ(gcs.run_int("dictdel d b"), 0);
+    ASSERT_EQ(gcs.run_str("dictkeys $d"), "a c e");
+    ASSERT_EQ(gcs.run_str(
+        "n = \"\"; loopdict k x $d [n = (concatword $n $k = $x .)]; result $n"
+    ), "a=5.c=.e=6.");
+    ASSERT_EQ(gcs.run_str(
+        "loopdict k x $d [dictset d $k 0]; result $d"
+    ), "a 0 c 0 e 0");
+
+    // many entries, with half of them deleted again
+    gcs.run("m = (dict); loop i 1000 [dictset m $i (* $i 2)]");
+    gcs.run("loop i 500 [dictdel m (* $i 2)]");
+    ASSERT_EQ(gcs.run_int("dictlen $m"), 500);
+    ASSERT_EQ(gcs.run_int("dictget $m 777"), 1554);
+    ASSERT_EQ(gcs.run_int("dicthas $m 778"), 0);
+
+    // lists work as dictionaries and the other way around
+    ASSERT_EQ(gcs.run_str("dictget \"p q r s\" r"), "s");
+    // a key given twice keeps its first value, as listassoc has it
+    ASSERT_EQ(gcs.run_str("dict a 1 b 2 a 3"), "a 1 b 2");
+    ASSERT_EQ(gcs.run_str("listdict \"a 1 b 2 a 3\""), "a 1 b 2");
+    ASSERT_EQ(gcs.run_str("dictget \"a 1 a 2\" a"), "1");
+    ASSERT_EQ(gcs.run_str("listassoc=s \"a 1 a 2\" a"), "1");
+    ASSERT_EQ(gcs.run_str("listassoc= \"01 x 1 y\" 1"), "x");
+    ASSERT_EQ(gcs.run_str("listassoc= (dict 01 x 1 y) 1"), "x");
+    ASSERT_EQ(gcs.run_str("l = \"a 1 b 2 a 3\"; dictset l b 4; result $l"),
+        "a 1 b 4"
+    );
+    ASSERT_EQ(gcs.run_str("l = \"x 1\"; dictset l y 2; result $l"), "x 1 y 2");
+    ASSERT_EQ(gcs.run_str("listassoc=s (dict a 1 e 6) e"), "6");
+    ASSERT_EQ(gcs.run_str("listassoc= (dict 1 one 2 two) 2"), "two");
+    ASSERT_EQ(gcs.run_str("listassoc=f \"1 one 2.5 two\" 2.5"), "two");
+    ASSERT_EQ(gcs.run_str("listassoc k (dict a 1 e 6) [=s $k e]"), "6");
+    ASSERT_EQ(gcs.run_int("listfind= \"1 2 3 4\" 3"), 2);
+    ASSERT_EQ(gcs.run_int("listfind=s \"a b c d\" c 1"), 2);
+}
 
 TEST(EXEC, basic)
 {
@@ -159,3 +570,747 @@ TEST(EXEC, basic)
         "This is a file run"
     );
 }
+
+
+TEST(STACK, value_stack)
+{
+    cs_state gcs;
+    gcs.init_libs();
+
+    ASSERT_EQ(gcs.get_value_stack_depth(), 0u);
+
+    // deep enough to span several stack chunks
+    ASSERT_EQ(gcs.run_str(
+        "f = [if (> $arg1 0) [+ (f (- $arg1 1)) 1] [result 0]]; f 50"
+    ), "50");
+
+    ASSERT_EQ(gcs.get_value_stack_depth(), 0u);
+    ASSERT_GT(gcs.get_value_stack_peak(), 50u);
+
+    // an empty name has a slot of its own like any other made at runtime
+    EXPECT_THROW(gcs.run("\"\" x"), cs_error);
+    EXPECT_THROW(gcs.run("r = (\"\")"), cs_error);
+    ASSERT_EQ(gcs.get_value_stack_depth(), 0u);
+}
+
+
+TEST(VALUES, strings)
+{
+    cs_state gcs;
+    gcs.init_libs();
+
+    // short strings live inline, long ones are shared between copies
+    ASSERT_EQ(gcs.run_str("a = abc; b = $a; concat $a $b"), "abc abc");
+    ASSERT_EQ(gcs.run_str(
+        "a = \"a fairly long string that does not fit inline\"; b = $a; "
+        "a = x; result $b"
+    ), "a fairly long string that does not fit inline");
+    ASSERT_EQ(gcs.run_str(
+        "r = \"\"; looplist x \"first second third\" [r = (concatword $r $x)]; result $r"
+    ), "firstsecondthird");
+    ASSERT_EQ(gcs.run_str("a = 5; concatword $a \"\""), "5");
+    ASSERT_EQ(gcs.run_str("substr \"hello world\" 6 3"), "wor");
+
+    cs_value v, w;
+    v.set_str("a fairly long string that does not fit inline");
+    w = v;
+    v.set_str(v.get_strr().slice(2, 8));
+    ASSERT_EQ(v.get_str(), "fairly");
+    ASSERT_EQ(w.get_str(), "a fairly long string that does not fit inline");
+}
+
+
+TEST(IDENTS, interned_names)
+{
+    cs_state gcs;
+    gcs.init_libs();
+
+    // g is not known when the body of f is compiled, so it is called by name
+    ASSERT_EQ(gcs.run_str("f = [g 3]; g = [+ $arg1 1]; f"), "4");
+    ASSERT_EQ(gcs.run_str("f"), "4");
+    ASSERT_EQ(gcs.run_str("n = g; $n 5"), "6");
+
+    // names only mentioned by code do not become identifiers
+    ASSERT_EQ(gcs.run_str("h = [if 0 [nosuchcmd]]; h"), "");
+    ASSERT_FALSE(gcs.have_ident("nosuchcmd"));
+    ASSERT_TRUE(gcs.have_ident("g"));
+}
+
+
+static size_t alloc_live = 0;
+
+static void *counting_alloc(void *, void *p, size_t, size_t ns)
+{
+    if (!ns)
+    {
+        --alloc_live;
+        delete[] static_cast<unsigned char *>(p);
+        return nullptr;
+    }
+    ++alloc_live;
+    return new unsigned char[ns];
+}
+
+TEST(COMPILE, line_numbers)
+{
+    cs_state gcs;
+    gcs.init_libs();
+
+    auto error_of = [&gcs](std::string const &code) -> std::string {
+        try {
+            gcs.run(code);
+        } catch (cs_error const &e) {
+            return std::string{e.what().data(), e.what().size()};
+        }
+        return "";
+    };
+    // long enough runs that the lexer skips over them in blocks
+    std::string lead =
+        "a = [\n    long block line one with [nested] words in it\n"
+        "    // a comment line inside of the block, ] not closing it\n"
+        "    \"a string with an escaped ^\n newline in it\"\n]\n"
+        "// a comment on its own line that is a good bit longer than 32\n"
+        "b = (concat 1 \\\n    2)\n\n";
+    ASSERT_EQ(error_of(lead + "c = [\n\n"), "13: missing \"]\"");
+    ASSERT_EQ(error_of(lead + "\n\n  ]"), "13: unexpected \"]\"");
+    ASSERT_EQ(error_of(lead + "d = \"x\n"), "11: unfinished string '\"x'");
+
+    // a comment that runs to the end without a newline
+    ASSERT_EQ(gcs.run_str("x = 5 // comment"), "");
+    ASSERT_EQ(gcs.run_str("result $x // comment"), "5");
+}
+
+TEST(COMPILE, bytecode_allocator)
+{
+    alloc_live = 0;
+    {
+        cs_state gcs{counting_alloc};
+        gcs.init_libs();
+
+        // aliases, runtime compiled strings and conditions
+        ASSERT_EQ(gcs.run_str(
+            "f = [+ $arg1 1]; s = \"f 2\"; r = (do $s); "
+            "if (= $r 3) [result (f $r)] [result 0]"
+        ), "4");
+        ASSERT_EQ(gcs.run_str("b = [result [x]]; b"), "x");
+        ASSERT_GT(alloc_live, 0u);
+    }
+    // compiled code came from the state allocator and went back to it
+    ASSERT_EQ(alloc_live, 0u);
+}
+
+
+TEST(EXEC, file_cache)
+{
+    cs_state gcs;
+    gcs.init_libs();
+
+    auto path = std::filesystem::temp_directory_path() / "cs_file_cache.cfg";
+    auto write = [&path](char const *src) {
+        std::ofstream f{path, std::ios::trunc};
+        f << src;
+    };
+    std::string fname = path.string();
+
+    write("x = (+ $x 1)");
+    gcs.run("x = 0");
+    ASSERT_TRUE(gcs.run_file(fname));
+    ASSERT_TRUE(gcs.run_file(fname));
+    ASSERT_EQ(gcs.run_str("result $x"), "2");
+    ASSERT_EQ(gcs.get_file_cache_misses(), 1u);
+    ASSERT_EQ(gcs.get_file_cache_hits(), 1u);
+
+    // new contents get compiled again
+    write("x = (+ $x 10)");
+    std::filesystem::last_write_time(
+        path, std::filesystem::last_write_time(path) + std::chrono::seconds(1)
+    );
+    ASSERT_TRUE(gcs.run_file(fname));
+    ASSERT_EQ(gcs.run_str("result $x"), "12");
+    ASSERT_EQ(gcs.get_file_cache_misses(), 2u);
+
+    // the same contents written again do not
+    write("x = (+ $x 10)");
+    std::filesystem::last_write_time(
+        path, std::filesystem::last_write_time(path) + std::chrono::seconds(2)
+    );
+    ASSERT_TRUE(gcs.run_file(fname));
+    ASSERT_EQ(gcs.run_str("result $x"), "22");
+    ASSERT_EQ(gcs.run_str("concat (filecachehits) (filecachemisses)"), "2 2");
+
+    // a rewrite of the same size that keeps the mtime is still seen
+    auto mtime = std::filesystem::last_write_time(path);
+    write("x = (+ $x 20)");
+    std::filesystem::last_write_time(path, mtime);
+    ASSERT_TRUE(gcs.run_file(fname));
+    ASSERT_EQ(gcs.run_str("result $x"), "42");
+    ASSERT_EQ(gcs.get_file_cache_misses(), 3u);
+
+    // past the limit the least recently run file goes
+    auto path2 = std::filesystem::temp_directory_path() / "cs_file_cache2.cfg";
+    std::ofstream{path2} << "y = 1";
+    std::string fname2 = path2.string();
+    gcs.set_file_cache_limit(1);
+    ASSERT_TRUE(gcs.run_file(fname2));
+    ASSERT_TRUE(gcs.run_file(fname));
+    ASSERT_EQ(gcs.get_file_cache_misses(), 5u);
+    ASSERT_TRUE(gcs.run_file(fname));
+    ASSERT_EQ(gcs.get_file_cache_hits(), 3u);
+
+    gcs.run("clearfilecache");
+    ASSERT_TRUE(gcs.run_file(fname));
+    ASSERT_EQ(gcs.get_file_cache_misses(), 6u);
+
+    std::filesystem::remove(path);
+    std::filesystem::remove(path2);
+}
+
+
+TEST(COMPILE, save_load)
+{
+    std::string fname = (
+        std::filesystem::temp_directory_path() / "cs_save_load.csb"
+    ).string();
+
+    {
+        cs_state gcs;
+        gcs.init_libs();
+        gcs.new_ivar("limit", 0, 100, 10);
+        auto code = gcs.compile(
+            "sq = [* $arg1 $arg1]; r = 0; "
+            "loop i $limit [r = (+ $r (sq $i))]; "
+            "n = sq; concat $r ($n 4) (later 2) [block $i]"
+        );
+        ostd::file_stream f{fname, ostd::stream_mode::WRITE};
+        gcs.save_code(code, f);
+    }
+
+    cs_state gcs;
+    gcs.init_libs();
+    // created in a different order than in the saving state
+    gcs.run("later = [+ $arg1 1]; x = 1");
+    gcs.new_ivar("limit", 0, 100, 10);
+    ostd::file_stream f{fname, ostd::stream_mode::READ};
+    auto code = gcs.load_code(f);
+    ASSERT_EQ(gcs.run_str(code), "285 16 3 block $i");
+
+    cs_state other;
+    other.init_libs();
+    f.seek(0);
+    // limit is not a variable in this state
+    other.run("limit = 5");
+    EXPECT_THROW(other.load_code(f), cs_error);
+
+    std::filesystem::remove(fname);
+}
+
+/* a stream of bytes in memory, to load changed bytecode from */
+struct string_stream: ostd::stream
+{
+    string_stream(std::string const &s): p_data(s) {}
+
+    void close() override {}
+
+    bool end() const override
+    {
+        return p_pos == p_data.size();
+    }
+
+    std::size_t read_bytes(void *buf, std::size_t n) override
+    {
+        n = std::min(n, p_data.size() - p_pos);
+        memcpy(buf, &p_data[p_pos], n);
+        p_pos += n;
+        return n;
+    }
+
+    void write_bytes(void const *buf, std::size_t n) override
+    {
+        p_data.append(static_cast<char const *>(buf), n);
+    }
+
+    std::string p_data;
+    std::size_t p_pos = 0;
+};
+
+TEST(COMPILE, load_checks)
+{
+    auto save = [](cs_state &cs, char const *src) {
+        string_stream f{""};
+        cs.save_code(cs.compile(src), f);
+        return f.p_data;
+    };
+    auto load = [](cs_state &cs, std::string const &data) {
+        string_stream f{data};
+        return cs.load_code(f);
+    };
+    auto word = [](std::string const &data, size_t off) {
+        uint32_t v;
+        memcpy(&v, &data[off], sizeof(v));
+        return v;
+    };
+
+    cs_state gcs;
+    gcs.init_libs();
+    gcs.new_command("echo", "C", [](auto &, auto, auto &) {});
+
+    // the inline data of large numbers is not taken for instructions, here
+    // one that looks like an exit to the condition of the loop
+    char const *big = "r = 0; loopwhile i 3 [< $i (+ 16777225 0)] "
+        "[r = (+ $r 1)]; result $r";
+    ASSERT_EQ(gcs.run_str(big), "3");
+    ASSERT_EQ(gcs.run_str(load(gcs, save(gcs, big))), "3");
+
+    auto data = save(gcs,
+        "local a b; a = 1; b = [x y]; loop i 3 [a = (+ $a $i)]; "
+        "if (> $a 2) [echo $a] [echo $b]; && $a [result 2] [result $b]; "
+        "loopwhile j 4 [< $j 2] [b = (concat $b $j)]; "
+        "f = [result (+ $arg1 $a)]; concat (f 1) $b (do [result 3])"
+    );
+    ASSERT_EQ(gcs.run_str(load(gcs, data)), "5 x y 0 1 3");
+
+    // the identifiers and strings, then the count of the instructions
+    size_t off = 12;
+    for (int table = 0; table < 2; ++table) {
+        uint32_t n = word(data, off);
+        off += 4;
+        for (uint32_t i = 0; i < n; ++i) {
+            off += (table ? 4 : 8) + word(data, off + (table ? 0 : 4));
+        }
+    }
+    ASSERT_EQ(size_t(word(data, off)) * 4, data.size() - off - 4);
+
+    // counts past the end of the stream do not get allocated up front
+    for (size_t woff: {size_t(12), off}) {
+        auto bad = data;
+        uint32_t huge = 0xFFFFFFFF;
+        memcpy(&bad[woff], &huge, sizeof(huge));
+        EXPECT_THROW(load(gcs, bad), cs_error);
+    }
+    for (size_t n = 0; n < data.size(); ++n) {
+        EXPECT_THROW(load(gcs, data.substr(0, n)), cs_error);
+    }
+
+    // whatever an instruction is changed into, the code either does not
+    // load or runs within its frame, so only errors of the script come out
+    for (off += 4; off < data.size(); ++off) {
+        for (int bit = 0; bit < 8; ++bit) {
+            auto bad = data;
+            bad[off] ^= char(1 << bit);
+            try {
+                auto code = load(gcs, bad);
+                gcs.set_instruction_budget(10000);
+                gcs.run(code);
+            } catch (cs_error const &) {
+            }
+            gcs.clear_instruction_budget();
+        }
+    }
+
+    // which locals get slots is up to the state loading the code
+    auto peek_state = [](cs_state &cs, int flags) {
+        cs.init_libs();
+        cs.new_command("peek", "", [](auto &cs, auto, auto &res) {
+            res.set_str(cs.get_alias_val("a").value_or(""));
+        }, flags);
+    };
+    char const *src = "local a; a = 5; peek";
+    cs_state named, unnamed;
+    peek_state(named, 0);
+    peek_state(unnamed, CS_IDF_NONAMES);
+    ASSERT_EQ(named.run_str(src), "5");
+    ASSERT_EQ(unnamed.run_str(src), "");
+    ASSERT_EQ(named.run_str(load(named, save(unnamed, src))), "5");
+    ASSERT_EQ(unnamed.run_str(load(unnamed, save(named, src))), "");
+}
+
+
+TEST(THREADS, shared_state)
+{
+    cs_state gcs;
+    gcs.init_libs();
+    gcs.run(
+        "fib = [if (< $arg1 2) [result $arg1] "
+        "[+ (fib (- $arg1 1)) (fib (- $arg1 2))]]; "
+        "nargs = [result $numargs]; base = 100"
+    );
+
+    // not flagged thread safe, so never entered by two threads at once
+    std::atomic<int> inside = 0, overlaps = 0;
+    gcs.new_command("unsafe", "", [&](auto &, auto, auto &res) {
+        if (++inside > 1)
+        {
+            ++overlaps;
+        }
+        std::this_thread::sleep_for(std::chrono::microseconds(50));
+        --inside;
+        res.set_int(1);
+    });
+
+    constexpr int nthreads = 8;
+    std::vector<std::string> results(nthreads);
+    std::vector<std::thread> threads;
+    for (int i = 0; i < nthreads; ++i)
+    {
+        threads.emplace_back([&gcs, &results, i]() {
+            cs_state cs = gcs.new_thread();
+            cs.run("x = " + std::to_string(i) + "; base = $x; s = 0");
+            // names made by every thread at once end up as one ident each
+            results[i] = cs.run_str(
+                "loop j 40 [s = (+ $s (fib 10) (unsafe)); "
+                "alias (concatword shared $j) $x; "
+                "alias (concatword own $x _ $j) $j]; "
+                "local y; y = (nargs a b c); "
+                "concat $x $s $base $y $shared3 (fib 12)"
+            );
+        });
+    }
+    for (auto &t: threads)
+    {
+        t.join();
+    }
+    EXPECT_EQ(overlaps, 0);
+    for (int i = 0; i < nthreads; ++i)
+    {
+        auto n = std::to_string(i);
+        EXPECT_EQ(results[i], n + " 2240 " + n + " 3 " + n + " 144");
+    }
+
+    // what the threads assigned stayed with them
+    EXPECT_EQ(gcs.run_str("result $base"), "100");
+    EXPECT_TRUE(gcs.have_ident("shared39"));
+    EXPECT_TRUE(gcs.have_ident("own7_39"));
+    std::set<std::string> names;
+    for (auto *id: gcs.get_idents())
+    {
+        EXPECT_TRUE(names.insert(std::string{id->get_name()}).second);
+    }
+    EXPECT_EQ(gcs.run_int("fib 15"), 610);
+}
+
+TEST(THREADS, parallel_lists)
+{
+    cs_state gcs;
+    gcs.init_libs();
+    gcs.run(
+        "l = (concat (loopconcat i 300 [result $i]) \"^\"a b^\"\" [[c d]]); "
+        "x = outer"
+    );
+
+    // the results merge in list order, as the serial commands give them
+    ASSERT_EQ(
+        gcs.run_str("plistmap x $l [concatword <$x>]"),
+        gcs.run_str("looplistconcat x $l [concatword <$x>]")
+    );
+    ASSERT_EQ(
+        gcs.run_str("plistfilter x $l [|| (= (mod $x 7) 3) (> (strlen $x) 3)]"),
+        gcs.run_str("listfilter x $l [|| (= (mod $x 7) 3) (> (strlen $x) 3)]")
+    );
+    ASSERT_EQ(gcs.run_str("plistcount x $l [> $x 199]"), "100");
+    ASSERT_EQ(gcs.run_str("plistmap x $l [if (> $x 4) [break] [* $x 2]]"),
+        "0 2 4 6 8"
+    );
+    ASSERT_EQ(gcs.run_str("plistmap x \"1 2 3 4\" [if (= $x 2) [continue]]"),
+        "  "
+    );
+    ASSERT_EQ(
+        gcs.run_str("plistmap x \"1 2 3 4\" [if (!= $x 2) [continue] [+ $x]]"),
+        "2"
+    );
+
+    // arguments of the caller are seen by every body
+    gcs.run("f = [plistcount x $l [= $x $arg1]]");
+    ASSERT_EQ(gcs.run_str("f 42"), "1");
+
+    // loop variables stay on the threads, errors reach the caller
+    ASSERT_EQ(gcs.run_str("plooplist x $l []; result $x"), "outer");
+    EXPECT_THROW(gcs.run("plooplist x $l [if (= $x 150) [error oops]]"),
+        cs_error
+    );
+    ASSERT_EQ(gcs.run_str("result $x"), "outer");
+}
+
+TEST(TASKS, spawn_step)
+{
+    cs_state gcs;
+    gcs.init_libs();
+    gcs.run("r = \"\"; x = outer");
+
+    gcs.spawn("loop i 3 [r = (concatword $r a $i); yield]");
+    gcs.spawn(
+        "local x; x = inner; r = (concatword $r b); yield; "
+        "r = (concatword $r $x)"
+    );
+    ASSERT_EQ(gcs.get_task_count(), 2);
+    ASSERT_EQ(gcs.run_str("result $r"), "");
+
+    // tasks take turns, assigning to the shared aliases but not the locals
+    ASSERT_EQ(gcs.step(), 2);
+    ASSERT_EQ(gcs.run_str("concat $r $x"), "a0b outer");
+    ASSERT_EQ(gcs.step(), 1);
+    ASSERT_EQ(gcs.run_str("result $r"), "a0ba1inner");
+    ASSERT_EQ(gcs.step(), 1);
+    ASSERT_EQ(gcs.step(), 0);
+    ASSERT_EQ(gcs.run_str("result $r"), "a0ba1innera2");
+
+    gcs.spawn("sleep 30; r = woken");
+    ASSERT_EQ(gcs.step(), 1);
+    ASSERT_EQ(gcs.step(), 1);
+    ASSERT_EQ(gcs.run_str("result $r"), "a0ba1innera2");
+    std::this_thread::sleep_for(std::chrono::milliseconds(40));
+    ASSERT_EQ(gcs.step(), 0);
+    ASSERT_EQ(gcs.run_str("result $r"), "woken");
+
+    // a spent budget resumes nothing
+    gcs.spawn("r = again");
+    ASSERT_EQ(gcs.step(std::chrono::nanoseconds{0}), 1);
+    ASSERT_EQ(gcs.step(), 0);
+    ASSERT_EQ(gcs.run_str("result $r"), "again");
+
+    // errors end their task, recursion runs to the limit on a task's stack
+    gcs.spawn("yield; error oops");
+    gcs.spawn("f = [f $arg1]; f 1");
+    EXPECT_THROW(gcs.step(), cs_error);
+    ASSERT_EQ(gcs.get_task_count(), 1);
+    EXPECT_THROW(gcs.step(), cs_error);
+    ASSERT_EQ(gcs.get_task_count(), 0);
+    EXPECT_THROW(gcs.run("yield"), cs_error);
+
+    // tasks left suspended are unwound with the state
+    gcs.spawn("local x; x = 1; yield; r = $x");
+    ASSERT_EQ(gcs.step(), 1);
+    ASSERT_EQ(gcs.run_str("result $x"), "outer");
+}
+
+TEST(EXEC, instruction_budget)
+{
+    cs_state gcs;
+    gcs.init_libs();
+
+    // straight runs take off what they go through, loops are stopped
+    gcs.set_instruction_budget(1000);
+    gcs.run("loop i 10 [r = $i]");
+    ASSERT_LT(*gcs.get_instruction_budget(), size_t(1000));
+    EXPECT_THROW(gcs.run("while [1] []"), cs_error);
+    ASSERT_EQ(*gcs.get_instruction_budget(), size_t(0));
+
+    // and stay stopped until the budget is set again
+    EXPECT_THROW(gcs.run("result 1"), cs_error);
+    gcs.set_instruction_budget(1000);
+    EXPECT_THROW(gcs.run("pcall [while [1] []] r s; loop i 10 []"), cs_error);
+
+    // the hook may give more, until it does not
+    int calls = 0;
+    gcs.set_budget_hook([&calls](cs_state &cs) {
+        if (++calls < 5)
+        {
+            cs.set_instruction_budget(100);
+        }
+    });
+    gcs.set_instruction_budget(100);
+    EXPECT_THROW(gcs.run("i = 0; while [1] [i = (+ $i 1)]"), cs_error);
+    ASSERT_EQ(calls, 5);
+    gcs.set_budget_hook([](cs_state &cs) {
+        cs.clear_instruction_budget();
+    });
+    gcs.set_instruction_budget(100);
+    ASSERT_EQ(gcs.run_int("i = 0; while [< $i 1000] [i = (+ $i 1)]; result $i"),
+        1000
+    );
+    ASSERT_FALSE(gcs.get_instruction_budget());
+
+    // tasks out of their share are suspended and carry on in the next step
+    gcs.spawn("r = 0; while [1] [r = (+ $r 1)]");
+    ASSERT_EQ(gcs.step(std::chrono::nanoseconds::max(), 500), 1);
+    cs_int r = gcs.run_int("result $r");
+    ASSERT_GT(r, 0);
+    ASSERT_EQ(gcs.step(std::chrono::nanoseconds::max(), 500), 1);
+    ASSERT_GT(gcs.run_int("result $r"), r);
+}
+
+TEST(EXEC, profile)
+{
+    cs_state gcs;
+    gcs.init_libs();
+
+    gcs.run("b = [result $arg1]; a = [b 1; b 2]");
+    gcs.run("fac = [if (> $arg1 1) [* $arg1 (fac (- $arg1 1))] [result 1]]");
+    ASSERT_FALSE(gcs.is_profiling());
+    gcs.start_profile();
+    ASSERT_TRUE(gcs.is_profiling());
+    gcs.run("a; a; a");
+    ASSERT_EQ(gcs.run_int("fac 5"), 120);
+    gcs.stop_profile();
+    gcs.run("a");
+
+    std::unordered_map<std::string, cs_profile_entry> calls;
+    for (auto &e: gcs.get_profile()) {
+        ASSERT_GE(e.inclusive, e.exclusive);
+        calls.emplace(std::string{e.id->get_name()}, e);
+    }
+    ASSERT_EQ(calls.at("a").calls, 3);
+    ASSERT_EQ(calls.at("b").calls, 6);
+    ASSERT_EQ(calls.at("fac").calls, 5);
+    ASSERT_GE(calls.at("a").inclusive, calls.at("b").inclusive);
+    // recursion is only counted once into the inclusive time
+    ASSERT_GE(calls.at("fac").inclusive, calls.at("fac").exclusive);
+    ASSERT_NE(gcs.get_profile_folded().find("a;b "), std::string::npos);
+    ASSERT_NE(gcs.get_profile_folded().find("fac;fac;fac "), std::string::npos);
+
+    gcs.clear_profile();
+    ASSERT_TRUE(gcs.get_profile().empty());
+    ASSERT_TRUE(gcs.get_profile_folded().empty());
+
+    // the same is reachable from scripts
+    auto rep = gcs.run_str("profile start; a; profile stop; profile report");
+    ASSERT_NE(rep.find("a 1 "), std::string::npos);
+    EXPECT_THROW(gcs.run("profile foo"), cs_error);
+
+    // tasks report the aliases they called after their own copies are gone
+    gcs.run("g = [result 0]");
+    gcs.spawn(
+        "profile start; do [local g; g = [result 1]; g; g]; "
+        "r = (profile report)"
+    );
+    ASSERT_EQ(gcs.step(), 0);
+    ASSERT_NE(gcs.run_str("result $r").find("g 2 "), std::string::npos);
+}
+
+TEST(EXEC, vm_stats)
+{
+    cs_state gcs;
+    gcs.init_libs();
+
+    cs_state::clear_stats();
+    gcs.run("f = [result (+ $arg1 1)]; loop i 100 [f $i]");
+    EXPECT_THROW(gcs.run("nosuchcommand"), cs_error);
+    cs_stats st = cs_state::get_stats();
+    auto rep = gcs.run_str("vmstats");
+    if (!st.instructions)
+    {
+        // built without VM_STATS, nothing is counted
+        ASSERT_EQ(st.compilations + st.lookups + st.exceptions, size_t(0));
+        ASSERT_NE(rep.find("instructions 0\n"), std::string::npos);
+        return;
+    }
+    size_t ops = 0;
+    for (size_t n: st.ops)
+    {
+        ops += n;
+    }
+    ASSERT_EQ(ops, st.instructions);
+    ASSERT_GE(st.compilations, size_t(3));
+    ASSERT_GE(st.exceptions, size_t(1));
+    // each call of f leaves through an exit
+    size_t exits = 0;
+    for (size_t i = 0; i < st.ops.size(); ++i)
+    {
+        if (cs_opcode_name(i) == "Exit/Null")
+        {
+            exits = st.ops[i];
+        }
+    }
+    ASSERT_GE(exits, size_t(100));
+    ASSERT_NE(rep.find("op Exit/Null "), std::string::npos);
+
+    cs_state::clear_stats();
+    st = cs_state::get_stats();
+    ASSERT_EQ(st.instructions, size_t(0));
+    ASSERT_EQ(st.exceptions, size_t(0));
+}
+
+TEST(EXEC, arg_frames)
+{
+    cs_state gcs;
+    gcs.init_libs();
+    gcs.run("arg1 = top; f = [concat $arg1 $arg2 $numargs]");
+
+    // arguments read straight off the call, nested and as strings
+    ASSERT_EQ(gcs.run_str("f a b"), "a b 2");
+    ASSERT_EQ(gcs.run_str("g = [f $arg2 x]; g 1 2"), "2 x 2");
+    ASSERT_EQ(gcs.run_str("g = [f (+ $arg1 1)]; g (+ 1 0)"), "2  1");
+    ASSERT_EQ(gcs.run_str("result $arg1"), "top");
+
+    // anything looking at the aliases gets the arguments put there
+    ASSERT_EQ(gcs.run_str("g = [getalias arg1]; g hello"), "hello");
+    ASSERT_EQ(gcs.run_str("g = [result $(concatword arg 1)]; g w"), "w");
+    ASSERT_EQ(gcs.run_str("h = [doargs [result $arg1]]; g = [h]; g q"), "q");
+    ASSERT_EQ(gcs.run_str("g = [getalias arg1]; h = [g x; f $arg1]; h y"),
+        "y  1"
+    );
+    ASSERT_EQ(
+        gcs.run_str("g = [arg3 = z; looplist arg1 $arg2 []; f $arg1 $arg3]; "
+            "g a \"b c\""),
+        "a z 2"
+    );
+    ASSERT_EQ(gcs.run_str("result $arg1"), "top");
+    ASSERT_EQ(gcs.get_alias("arg1")->get_value().get_str(), "top");
+
+    // frames unwound by errors put everything back
+    EXPECT_THROW(gcs.run("g = [getalias arg1; error oops]; g e"), cs_error);
+    ASSERT_EQ(gcs.run_str("result $arg1"), "top");
+}
+
+TEST(EXEC, local_slots)
+{
+    cs_state gcs;
+    gcs.init_libs();
+    gcs.run("x = top; y = top; h = [result $x]");
+
+    // kept in slots, also from loops and inner locals of their own
+    ASSERT_EQ(
+        gcs.run_str(
+            "f = [local x y; x = 1; loop i 3 [local z; z = (+ $x $i); "
+            "x = $z; y = (concatword $y $z)]; concat $x $y]; f"
+        ),
+        "4 124"
+    );
+    ASSERT_EQ(gcs.run_str("concat $x $y"), "top top");
+
+    // names that escape keep working as they always have
+    ASSERT_EQ(gcs.run_str("g = [local x; x = dyn; h]; g"), "dyn");
+    ASSERT_EQ(gcs.run_str("g = [local x; x = esc; getalias x]; g"), "esc");
+    ASSERT_EQ(
+        gcs.run_str(
+            "g = [local x; x = 1; looplist v \"2 3\" [x = $v]; result $x]; g"
+        ),
+        "3"
+    );
+    ASSERT_EQ(gcs.run_str("g = [local x; x = 5; result $(concatword x)]; g"),
+        "5"
+    );
+    ASSERT_EQ(
+        gcs.run_str("g = [local x; x = 5; getalias (substr \"xy\" 0 1)]; g"),
+        "5"
+    );
+    ASSERT_EQ(
+        gcs.run_str("g = [local x; x = 6; alias (substr \"xy\" 0 1) 7]; g; "
+            "result $x"),
+        "top"
+    );
+
+    // and so do commands of the host, which may look up anything
+    gcs.new_command("peekx", "", [](auto &cs, auto, auto &res) {
+        res.set_str(*cs.get_alias_val("x"));
+    });
+    gcs.new_command("runx", "", [](auto &cs, auto, auto &res) {
+        cs.run("result $x", res);
+    });
+    gcs.new_command("fire", "", [](auto &cs, auto, auto &res) {
+        cs.run(cs.get_ident("onfire"), cs_value_r{}, res);
+    });
+    gcs.run("onfire = [result $x]");
+    ASSERT_EQ(gcs.run_str("g = [local x; x = peek; peekx]; g"), "peek");
+    ASSERT_EQ(gcs.run_str("g = [local x; x = run; runx]; g"), "run");
+    ASSERT_EQ(gcs.run_str("g = [local x; x = fired; fire]; g"), "fired");
+
+    // and everything is put back when a block is left early
+    ASSERT_EQ(
+        gcs.run_str(
+            "loop i 3 [local x; x = $i; if (= $i 1) [break]]; result $x"
+        ),
+        "top"
+    );
+    EXPECT_THROW(gcs.run("local x; x = 1; error oops"), cs_error);
+    ASSERT_EQ(gcs.run_str("g = [local x; x = in]; g; h"), "top");
+}
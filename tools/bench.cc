@@ -0,0 +1,135 @@
+#include <chrono>
+#include <cstdlib>
+#include <memory>
+
+#include <ostd/io.hh>
+#include <ostd/string.hh>
+
+#include <cubescript/cubescript.hh>
+
+using namespace cscript;
+
+/* runs each given script file a number of times in a fresh state and
+ * reports the throughput; compare builds with different VM options by
+ * running the same workloads (tests/files/bench_*.cfg) against each
+ */
+
+static void print_usage(ostd::string_range progname) {
+    ostd::writefln(
+        "Usage: %s [-n runs] [-c] file...\n"
+        "\n"
+        "Options:\n"
+        "  -n runs  run each file this many times (default 10)\n"
+        "  -c       only compile the files, which measures the lexer and\n"
+        "           code generator rather than the VM",
+        progname
+    );
+}
+
+static void init_state(cs_state &cs) {
+    cs.init_libs();
+    cs.new_command("exec", "s", [](auto &css, auto args, auto &) {
+        auto file = args[0].get_strr();
+        if (!css.run_file(file)) {
+            throw cs_error(css, "could not run file \"%s\"", file);
+        }
+    });
+    /* benchmarks should not be measuring the terminal */
+    cs.new_command("echo", "C", [](auto &, auto, auto &) {});
+}
+
+static bool bench_file(ostd::string_range fname, int runs) {
+    using clock = std::chrono::steady_clock;
+    cs_state cs;
+    init_state(cs);
+    /* warm up, also catches missing files and script errors early */
+    try {
+        if (!cs.run_file(fname)) {
+            ostd::writefln("%s: could not run file", fname);
+            return false;
+        }
+    } catch (cs_error const &e) {
+        ostd::writefln("%s: %s", fname, e.what());
+        return false;
+    }
+    cs_state::clear_stats();
+    auto start = clock::now();
+    for (int i = 0; i < runs; ++i) {
+        cs.run_file(fname);
+    }
+    std::chrono::duration<double> secs = clock::now() - start;
+    ostd::writefln(
+        "%s: %d runs in %.3f s (%.3f ms/run, %.2f runs/s)", fname, runs,
+        secs.count(), secs.count() * 1000.0 / runs, runs / secs.count()
+    );
+    /* only counted with VM_STATS, whose counting makes the VM slower */
+    cs_stats st = cs_state::get_stats();
+    if (st.instructions) {
+        ostd::writefln(
+            "%s: %d instructions/run (%.2f M/s), %d compilations, "
+            "%d string allocations, %d lookups, %d exceptions", fname,
+            st.instructions / runs, st.instructions / secs.count() / 1e6,
+            st.compilations, st.string_allocs, st.lookups, st.exceptions
+        );
+    }
+    return true;
+}
+
+static bool bench_compile(ostd::string_range fname, int runs) {
+    using clock = std::chrono::steady_clock;
+    cs_state cs;
+    init_state(cs);
+    ostd::file_stream f(fname, ostd::stream_mode::READ);
+    if (!f.is_open()) {
+        ostd::writefln("%s: could not open file", fname);
+        return false;
+    }
+    size_t len = f.size();
+    auto buf = std::make_unique<char[]>(len + 1);
+    f.get(buf.get(), len);
+    buf[len] = '\0';
+    ostd::string_range src{buf.get(), buf.get() + len};
+    try {
+        cs.compile(src, fname);
+    } catch (cs_error const &e) {
+        ostd::writefln("%s: %s", fname, e.what());
+        return false;
+    }
+    auto start = clock::now();
+    for (int i = 0; i < runs; ++i) {
+        cs.compile(src, fname);
+    }
+    std::chrono::duration<double> secs = clock::now() - start;
+    ostd::writefln(
+        "%s: %d compiles in %.3f s (%.3f ms/compile, %.1f MB/s)", fname, runs,
+        secs.count(), secs.count() * 1000.0 / runs,
+        (double(len) * runs) / (secs.count() * 1024.0 * 1024.0)
+    );
+    return true;
+}
+
+int main(int argc, char **argv) {
+    int runs = 10, firstarg = 1;
+    bool compile_only = false;
+    if ((argc > 2) && (ostd::string_range{argv[1]} == "-n")) {
+        runs = std::atoi(argv[2]);
+        firstarg = 3;
+    }
+    if ((firstarg < argc) && (ostd::string_range{argv[firstarg]} == "-c")) {
+        compile_only = true;
+        ++firstarg;
+    }
+    if ((firstarg >= argc) || (runs <= 0)) {
+        print_usage(argv[0]);
+        return 1;
+    }
+    bool ret = true;
+    for (int i = firstarg; i < argc; ++i) {
+        if (compile_only) {
+            ret = bench_compile(argv[i], runs) && ret;
+        } else {
+            ret = bench_file(argv[i], runs) && ret;
+        }
+    }
+    return ret ? 0 : 1;
+}